@@ -1,11 +1,15 @@
 
 SVGUI_HEADERS += \
+           layer/BinReductionCache.h \
+           layer/CacheGovernor.h \
            layer/Colour3DPlotLayer.h \
 	   layer/Colour3DPlotRenderer.h \
 	   layer/ColourDatabase.h \
 	   layer/ColourMapper.h \
            layer/ColourScale.h \
            layer/ColourScaleLayer.h \
+           layer/ColumnReader.h \
+           layer/CompactColumnCache.h \
            layer/FlexiNoteLayer.h \
            layer/HorizontalFrequencyScale.h \
            layer/HorizontalScaleProvider.h \
@@ -18,24 +22,32 @@ SVGUI_HEADERS += \
            layer/LogNumericalScale.h \
            layer/LinearColourScale.h \
            layer/LogColourScale.h \
+           layer/MagnitudeRangeTree.h \
            layer/NoteLayer.h \
            layer/PaintAssistant.h \
+           layer/PeakColumnCache.h \
            layer/PianoScale.h \
            layer/RegionLayer.h \
            layer/RenderTimer.h \
+           layer/ScrollableColumns.h \
            layer/ScrollableImageCache.h \
            layer/ScrollableMagRangeCache.h \
+           layer/ScrollableRangeCache.h \
+           layer/ScrollableValueCache.h \
            layer/SingleColourLayer.h \
            layer/SliceableLayer.h \
            layer/SliceLayer.h \
            layer/SpectrogramLayer.h \
            layer/SpectrumLayer.h \
+           layer/SummaryPeakTable.h \
            layer/TextLayer.h \
            layer/TimeInstantLayer.h \
            layer/TimeRulerLayer.h \
            layer/TimeValueLayer.h \
            layer/VerticalScaleLayer.h \
+           layer/ViewMagnitudes.h \
            layer/WaveformLayer.h \
+           layer/ZoomTileCache.h \
 	   view/AlignmentView.h \
            view/Overview.h \
            view/Pane.h \
@@ -93,11 +105,15 @@ SVGUI_HEADERS += \
            widgets/WindowTypeSelector.h
 
 SVGUI_SOURCES += \
+           layer/BinReductionCache.cpp \
+           layer/CacheGovernor.cpp \
            layer/Colour3DPlotLayer.cpp \
 	   layer/Colour3DPlotRenderer.cpp \
 	   layer/ColourDatabase.cpp \
 	   layer/ColourMapper.cpp \
 	   layer/ColourScale.cpp \
+           layer/ColumnReader.cpp \
+           layer/CompactColumnCache.cpp \
            layer/FlexiNoteLayer.cpp \
            layer/HorizontalFrequencyScale.cpp \
            layer/ImageLayer.cpp \
@@ -108,21 +124,28 @@ SVGUI_SOURCES += \
            layer/LogNumericalScale.cpp \
            layer/LinearColourScale.cpp \
            layer/LogColourScale.cpp \
+           layer/MagnitudeRangeTree.cpp \
            layer/NoteLayer.cpp \
            layer/PaintAssistant.cpp \
+           layer/PeakColumnCache.cpp \
            layer/PianoScale.cpp \
            layer/RegionLayer.cpp \
            layer/ScrollableImageCache.cpp \
            layer/ScrollableMagRangeCache.cpp \
+           layer/ScrollableRangeCache.cpp \
+           layer/ScrollableValueCache.cpp \
            layer/SingleColourLayer.cpp \
            layer/SliceLayer.cpp \
            layer/SpectrogramLayer.cpp \
            layer/SpectrumLayer.cpp \
+           layer/SummaryPeakTable.cpp \
            layer/TextLayer.cpp \
            layer/TimeInstantLayer.cpp \
            layer/TimeRulerLayer.cpp \
            layer/TimeValueLayer.cpp \
+           layer/ViewMagnitudes.cpp \
            layer/WaveformLayer.cpp \
+           layer/ZoomTileCache.cpp \
 	   view/AlignmentView.cpp \
            view/Overview.cpp \
            view/Pane.cpp \
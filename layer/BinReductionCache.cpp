@@ -0,0 +1,236 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "BinReductionCache.h"
+#include "ColumnReader.h"
+#include "CompactColumnCache.h"
+#include "PeakColumnCache.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+
+#include "base/HitCount.h"
+
+#include <QMutexLocker>
+
+using namespace std;
+
+BinReductionCache::BinReductionCache(const DenseThreeDimensionalModel *source,
+                                     QMutex *sourceMutex,
+                                     const CompactColumnCache *compactCache,
+                                     size_t maxBytes) :
+    m_model(source),
+    m_compactCache(compactCache),
+    m_peakCache(0),
+    m_sourceMutex(sourceMutex),
+    m_height(source->getHeight()),
+    m_maxBytes(maxBytes),
+    m_bytes(0),
+    m_generation(0)
+{
+}
+
+BinReductionCache::BinReductionCache(const PeakColumnCache *source,
+                                     size_t maxBytes) :
+    m_model(0),
+    m_compactCache(0),
+    m_peakCache(source),
+    m_sourceMutex(0),
+    m_height(source->getHeight()),
+    m_maxBytes(maxBytes),
+    m_bytes(0),
+    m_generation(0)
+{
+}
+
+void
+BinReductionCache::reduce(const float *in, int n, int level,
+                          vector<float> &out)
+{
+    int group = 1 << level;
+    int count = getReducedCount(n, level);
+    out.resize(count);
+
+    for (int i = 0; i < count; ++i) {
+        int b0 = i * group;
+        int b1 = b0 + group;
+        if (b1 > n) b1 = n;
+        float value = in[b0];
+        for (int b = b0 + 1; b < b1; ++b) {
+            value = (in[b] > value ? in[b] : value);
+        }
+        out[i] = value;
+    }
+}
+
+int
+BinReductionCache::getSourceWidth() const
+{
+    if (m_peakCache) {
+        return m_peakCache->getWidth();
+    }
+    return m_model->getWidth();
+}
+
+void
+BinReductionCache::readSource(int x, float *values) const
+{
+    if (m_peakCache) {
+        m_peakCache->getColumnRange(x, 0, m_height, values);
+    } else if (m_compactCache) {
+        m_compactCache->getColumnRange(x, 0, m_height, values);
+    } else if (m_sourceMutex) {
+        QMutexLocker locker(m_sourceMutex);
+        ColumnReader::getColumnRange(m_model, x, 0, m_height, values);
+    } else {
+        ColumnReader::getColumnRange(m_model, x, 0, m_height, values);
+    }
+}
+
+void
+BinReductionCache::getGroupRange(int x, int level, int g0, int count,
+                                 float *maxima, float *minima) const
+{
+    static HitCount counter("BinReductionCache: columns");
+
+    if (count <= 0) return;
+
+    int groups = getReducedCount(m_height, level);
+    int generation = 0;
+
+    {
+        QMutexLocker locker(&m_mutex);
+
+        auto litr = m_levels.find(level);
+        if (litr != m_levels.end() &&
+            x >= 0 && x < int(litr->second.size()) &&
+            !litr->second[x].empty()) {
+            counter.hit();
+            const float *reduced = litr->second[x].data();
+            for (int i = 0; i < count; ++i) {
+                int g = g0 + i;
+                bool in = (g >= 0 && g < groups);
+                maxima[i] = (in ? reduced[g] : 0.f);
+                minima[i] = (in ? reduced[groups + g] : 0.f);
+            }
+            return;
+        }
+
+        generation = m_generation;
+    }
+
+    counter.miss();
+
+    // Read and reduce the whole column without the lock, so that
+    // other threads can go on reading columns we already have
+
+    vector<float> column(m_height, 0.f);
+    vector<float> reduced(groups * 2, 0.f);
+
+    int sw = getSourceWidth();
+    
+    if (x >= 0 && x < sw) {
+        readSource(x, column.data());
+        int size = 1 << level;
+        for (int g = 0; g < groups; ++g) {
+            int b0 = g * size;
+            int b1 = min(b0 + size, m_height);
+            float hi = column[b0], lo = column[b0];
+            for (int b = b0 + 1; b < b1; ++b) {
+                hi = (column[b] > hi ? column[b] : hi);
+                lo = (column[b] < lo ? column[b] : lo);
+            }
+            reduced[g] = hi;
+            reduced[groups + g] = lo;
+        }
+    }
+
+    for (int i = 0; i < count; ++i) {
+        int g = g0 + i;
+        bool in = (g >= 0 && g < groups);
+        maxima[i] = (in ? reduced[g] : 0.f);
+        minima[i] = (in ? reduced[groups + g] : 0.f);
+    }
+
+    // The last column of a source that is still growing may not be
+    // complete yet, so it is returned but not stored
+    if (x < 0 || x + 1 >= sw) return;
+
+    QMutexLocker locker(&m_mutex);
+
+    // Another thread may have filled the column meanwhile, which is
+    // harmless, or invalidated it, in which case what we have read
+    // may not be stored
+    if (m_generation != generation) return;
+
+    size_t bytes = reduced.size() * sizeof(float);
+
+    if (m_bytes + bytes > m_maxBytes) {
+        // Keep the level being read if we can, as that is the one
+        // the view wants now
+        for (auto litr = m_levels.begin(); litr != m_levels.end(); ) {
+            if (litr->first != level) {
+                litr = m_levels.erase(litr);
+            } else {
+                ++litr;
+            }
+        }
+        m_bytes = 0;
+        for (const auto &c: m_levels[level]) {
+            m_bytes += c.size() * sizeof(float);
+        }
+        if (m_bytes + bytes > m_maxBytes) {
+            m_levels.clear();
+            m_bytes = 0;
+        }
+    }
+
+    vector<vector<float>> &columns = m_levels[level];
+    if (x >= int(columns.size())) columns.resize(x + 1);
+    if (columns[x].empty()) {
+        columns[x].swap(reduced);
+        m_bytes += bytes;
+    }
+}
+
+void
+BinReductionCache::invalidate()
+{
+    QMutexLocker locker(&m_mutex);
+    m_levels.clear();
+    m_bytes = 0;
+    ++m_generation;
+}
+
+void
+BinReductionCache::invalidate(int x0, int x1)
+{
+    QMutexLocker locker(&m_mutex);
+    if (x0 < 0) x0 = 0;
+    for (auto &l: m_levels) {
+        vector<vector<float>> &columns = l.second;
+        int last = min(x1, int(columns.size()) - 1);
+        for (int x = x0; x <= last; ++x) {
+            m_bytes -= columns[x].size() * sizeof(float);
+            vector<float>().swap(columns[x]);
+        }
+    }
+    ++m_generation;
+}
+
+size_t
+BinReductionCache::getBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_bytes;
+}
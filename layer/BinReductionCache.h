@@ -0,0 +1,137 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef BIN_REDUCTION_CACHE_H
+#define BIN_REDUCTION_CACHE_H
+
+#include <QMutex>
+
+#include <map>
+#include <vector>
+#include <cstddef>
+
+class DenseThreeDimensionalModel;
+class CompactColumnCache;
+class PeakColumnCache;
+
+/**
+ * A cache of the columns of a dense 3d model (or of one of its peak
+ * caches) reduced in the vertical (bin) direction, for rendering
+ * models with many more bins than the view has pixel rows. A column
+ * is reduced at a power-of-two level: at level k, group g holds the
+ * maximum and the minimum of bins g * 2^k to (g+1) * 2^k - 1 of the
+ * source column. Groups are counted from bin 0, not from the range
+ * on display, so that a reduced column is good for any bin range.
+ *
+ * One of these is kept for each source a renderer may read from,
+ * alongside the peak caches, so that reduced columns survive changes
+ * of zoom level in either direction. Each level is filled a column
+ * at a time on first use, reading the whole source column once. The
+ * cache is cleared if it grows beyond its size limit.
+ *
+ * Values are raw source values: any gain or normalisation is for
+ * the reader to apply. The cache may be read from more than one
+ * thread.
+ */
+class BinReductionCache
+{
+public:
+    /**
+     * Create a cache of reductions of the columns of the given
+     * model, which must outlive the cache. If compactCache is
+     * non-null, columns are read from that instead of from the
+     * model. If sourceMutex is non-null, it is held while (and only
+     * while) reading from the model, as for CompactColumnCache.
+     */
+    BinReductionCache(const DenseThreeDimensionalModel *source,
+                      QMutex *sourceMutex = 0,
+                      const CompactColumnCache *compactCache = 0,
+                      size_t maxBytes = defaultMaxBytes);
+
+    /**
+     * Create a cache of reductions of the columns of a peak cache,
+     * which must outlive this one.
+     */
+    BinReductionCache(const PeakColumnCache *source,
+                      size_t maxBytes = defaultMaxBytes);
+
+    static const size_t defaultMaxBytes = 32 * 1024 * 1024;
+
+    /**
+     * Reduce the given column of n values at the given level,
+     * writing ceil(n / 2^level) group maxima to out. This is for
+     * callers that have a column to hand and nowhere to cache it.
+     */
+    static void reduce(const float *in, int n, int level,
+                       std::vector<float> &out);
+
+    /**
+     * Return the number of values in a column of n bins reduced at
+     * the given level.
+     */
+    static int getReducedCount(int n, int level) {
+        return (n + (1 << level) - 1) >> level;
+    }
+
+    /**
+     * Read the maxima and minima of groups g0 to g0 + count - 1 of
+     * column x reduced at the given level (which must be at least 1)
+     * into maxima and minima, each of which must have room for count
+     * floats. Groups beyond the height of the source read as zero.
+     */
+    void getGroupRange(int x, int level, int g0, int count,
+                       float *maxima, float *minima) const;
+
+    /**
+     * Mark all columns as needing to be fetched again from the
+     * source.
+     */
+    void invalidate();
+
+    /**
+     * Mark columns x0 to x1 inclusive as needing to be fetched again
+     * from the source. This does not invalidate the source itself.
+     */
+    void invalidate(int x0, int x1);
+
+    /**
+     * Return the memory used by the cached columns.
+     */
+    size_t getBytes() const;
+
+private:
+    const DenseThreeDimensionalModel *m_model;
+    const CompactColumnCache *m_compactCache;
+    const PeakColumnCache *m_peakCache;
+    QMutex *m_sourceMutex;
+    int m_height;
+    size_t m_maxBytes;
+
+    // The mutex guards the stored columns, but is not held while
+    // reading from the source; the generation is incremented by
+    // every invalidation, so that a column read from the source
+    // before one is not then stored as valid. Each level maps to its
+    // columns, an unfilled one being an empty vector, and a filled
+    // one holding the maxima of all its groups followed by the
+    // minima.
+    mutable QMutex m_mutex;
+    mutable std::map<int, std::vector<std::vector<float>>> m_levels;
+    mutable size_t m_bytes;
+    int m_generation;
+
+    int getSourceWidth() const;
+    void readSource(int x, float *values) const;
+};
+
+#endif
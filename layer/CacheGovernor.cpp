@@ -0,0 +1,374 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "CacheGovernor.h"
+
+#include "base/Debug.h"
+#include "base/Preferences.h"
+#include "system/System.h"
+
+#include <QMutexLocker>
+#include <QMetaObject>
+#include <QSettings>
+#include <QTimer>
+
+#include <algorithm>
+
+//#define DEBUG_CACHE_GOVERNOR 1
+
+CacheGovernor *
+CacheGovernor::getInstance()
+{
+    static CacheGovernor instance;
+    return &instance;
+}
+
+CacheGovernor::CacheGovernor() :
+    m_useCounter(0),
+    m_enforcePending(false),
+    m_memoryShort(false),
+    m_pressureTarget(0),
+    m_memoryPollTimer(new QTimer(this))
+{
+    m_budget = getPreferredBudget();
+    if (m_budget == 0) {
+        m_budget = getDefaultBudget();
+    }
+    
+    SVDEBUG << "CacheGovernor: budget is " << m_budget / (1024 * 1024)
+            << "M" << endl;
+
+    connect(Preferences::getInstance(),
+            SIGNAL(propertyChanged(PropertyContainer::PropertyName)),
+            this, SLOT(preferenceChanged(PropertyContainer::PropertyName)));
+    
+    connect(m_memoryPollTimer, SIGNAL(timeout()), this, SLOT(checkMemory()));
+    m_memoryPollTimer->start(memoryPollInterval);
+}
+
+size_t
+CacheGovernor::getDefaultBudget()
+{
+    // A quarter of physical memory, or 1G if we can't tell how much
+    // there is
+    ssize_t available = 0, total = 0;
+    GetRealMemoryMBAvailable(available, total);
+    if (total > 0) {
+        return size_t(total / 4) * 1024 * 1024;
+    } else {
+        return size_t(1024) * 1024 * 1024;
+    }
+}
+
+size_t
+CacheGovernor::getPreferredBudget()
+{
+    QSettings settings;
+    settings.beginGroup("Preferences");
+    int mb = settings.value("cache-budget-mb", 0).toInt();
+    settings.endGroup();
+    return mb > 0 ? size_t(mb) * 1024 * 1024 : 0;
+}
+
+void
+CacheGovernor::preferenceChanged(PropertyContainer::PropertyName)
+{
+    // The budget is not one of the Preferences object's own
+    // properties, so look again on any change
+    size_t budget = getPreferredBudget();
+    if (budget == 0) {
+        budget = getDefaultBudget();
+    }
+    if (budget != getBudget()) {
+        SVDEBUG << "CacheGovernor: budget is now " << budget / (1024 * 1024)
+                << "M" << endl;
+        setBudget(budget);
+    }
+}
+
+void
+CacheGovernor::checkMemory()
+{
+    bool wasShort = m_memoryShort;
+    if (isMemoryShort() && !wasShort) {
+        SVDEBUG << "CacheGovernor: releasing caches on memory pressure"
+                << endl;
+        handleMemoryPressure();
+    }
+}
+
+CacheGovernor::~CacheGovernor()
+{
+}
+
+void
+CacheGovernor::registerClient(Client *client)
+{
+    QMutexLocker locker(&m_mutex);
+    m_clients[client].lastUsed = ++m_useCounter;
+}
+
+void
+CacheGovernor::unregisterClient(Client *client)
+{
+    QMutexLocker locker(&m_mutex);
+    m_clients.erase(client);
+}
+
+void
+CacheGovernor::touch(Client *client)
+{
+    QMutexLocker locker(&m_mutex);
+
+    auto itr = m_clients.find(client);
+    if (itr != m_clients.end()) {
+        itr->second.lastUsed = ++m_useCounter;
+    }
+
+    if (!m_enforcePending) {
+        m_enforcePending = true;
+        QMetaObject::invokeMethod(this, "enforce", Qt::QueuedConnection);
+    }
+}
+
+bool
+CacheGovernor::requestAllocation(size_t bytes, const Client *requester)
+{
+    size_t total = getTotalBytes();
+    size_t budget = getBudget();
+    bool memoryShort = isMemoryShort();
+    
+    if (total + bytes <= budget && !memoryShort) {
+        return true;
+    }
+
+    size_t limit = budget;
+
+    if (memoryShort) {
+        // Caches may not grow while the system is short of memory:
+        // the allocation must be paid for by releasing at least as
+        // much, and the total must also come within the pressure
+        // target, as enforce() would make it
+        limit = std::min(limit, std::min(total, m_pressureTarget));
+    }
+
+    if (bytes > limit) {
+#ifdef DEBUG_CACHE_GOVERNOR
+        SVDEBUG << "CacheGovernor::requestAllocation: refusing " << bytes
+                << " bytes, which exceeds the limit of " << limit << endl;
+#endif
+        return false;
+    }
+
+    // Find out whether releasing other caches would make enough room
+    // before releasing any of them. When memory is short, only
+    // dormant caches are released, as in enforce().
+    
+    size_t target = limit - bytes;
+    size_t releasable = 0;
+    
+    for (Client *c: getReleaseOrder(requester)) {
+        if (memoryShort && !c->isCacheDormant()) continue;
+        releasable += c->getCacheBytes();
+    }
+
+    if (total - std::min(total, releasable) > target) {
+#ifdef DEBUG_CACHE_GOVERNOR
+        SVDEBUG << "CacheGovernor::requestAllocation: refusing " << bytes
+                << " bytes, as only " << releasable << " of " << total
+                << " could be released" << endl;
+#endif
+        return false;
+    }
+
+    releaseDownTo(target, requester, memoryShort);
+    return true;
+}
+
+void
+CacheGovernor::setBudget(size_t bytes)
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_budget = bytes;
+    }
+    enforce();
+}
+
+size_t
+CacheGovernor::getBudget() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_budget;
+}
+
+size_t
+CacheGovernor::getTotalBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    size_t total = 0;
+    for (const auto &c: m_clients) {
+        total += c.first->getCacheBytes();
+    }
+    return total;
+}
+
+void
+CacheGovernor::enforce()
+{
+    {
+        QMutexLocker locker(&m_mutex);
+        m_enforcePending = false;
+    }
+
+    size_t total = releaseDownTo(getBudget(), 0);
+
+    // The pressure target is set once per shortage, rather than
+    // halving whatever we have each time, so that the caches of the
+    // views on display, which are touched again as soon as they
+    // repaint, are not released over and over
+    if (isMemoryShort() && total > m_pressureTarget) {
+        releaseDownTo(m_pressureTarget, 0, true);
+    }
+}
+
+void
+CacheGovernor::handleMemoryPressure()
+{
+    releaseDownTo(getBudget() / 4, 0);
+}
+
+std::vector<CacheGovernor::Client *>
+CacheGovernor::getReleaseOrder(const Client *except) const
+{
+    struct Candidate {
+        Client *client;
+        bool dormant;
+        unsigned long lastUsed;
+        double costPerByte;
+    };
+
+    std::vector<Candidate> candidates;
+    
+    {
+        QMutexLocker locker(&m_mutex);
+        for (const auto &c: m_clients) {
+            if (c.first == except) continue;
+            size_t bytes = c.first->getCacheBytes();
+            if (bytes == 0) continue;
+            candidates.push_back({ c.first,
+                        c.first->isCacheDormant(),
+                        c.second.lastUsed,
+                        c.first->getCacheRebuildCost() / double(bytes) });
+        }
+    }
+
+    // Dormant first, then least recently used, then cheapest to
+    // rebuild for the memory it would free
+    std::sort(candidates.begin(), candidates.end(),
+              [](const Candidate &a, const Candidate &b) {
+                  if (a.dormant != b.dormant) return a.dormant;
+                  if (a.lastUsed != b.lastUsed) return a.lastUsed < b.lastUsed;
+                  return a.costPerByte < b.costPerByte;
+              });
+
+    std::vector<Client *> order;
+    for (const auto &c: candidates) {
+        order.push_back(c.client);
+    }
+    return order;
+}
+
+size_t
+CacheGovernor::releaseDownTo(size_t target, const Client *except,
+                             bool dormantOnly)
+{
+    size_t total = getTotalBytes();
+    if (total <= target) {
+        return total;
+    }
+
+    std::vector<Client *> order = getReleaseOrder(except);
+
+    for (Client *c: order) {
+
+        if (total <= target) {
+            break;
+        }
+
+        {
+            // Releasing one cache may have unregistered another
+            // (e.g. a layer deleting its renderers)
+            QMutexLocker locker(&m_mutex);
+            if (m_clients.find(c) == m_clients.end()) {
+                continue;
+            }
+        }
+
+        if (dormantOnly && !c->isCacheDormant()) {
+            continue;
+        }
+
+        size_t before = c->getCacheBytes();
+
+#ifdef DEBUG_CACHE_GOVERNOR
+        SVDEBUG << "CacheGovernor: total " << total << " exceeds target "
+                << target << ", releasing " << before << " bytes from "
+                << c << (c->isCacheDormant() ? " (dormant)" : "") << endl;
+#endif
+
+        c->releaseCache();
+
+        // Recalculate in full, as other clients may have gone
+        total = getTotalBytes();
+
+        if (c->getCacheBytes() >= before) {
+            SVDEBUG << "CacheGovernor: WARNING: Client " << c
+                    << " failed to release any of its " << before
+                    << " bytes" << endl;
+        }
+    }
+
+    return total;
+}
+
+bool
+CacheGovernor::isMemoryShort()
+{
+    // The memory status is not cheap to obtain, so look no more than
+    // once a second
+    if (m_memoryCheckTimer.isValid() &&
+        m_memoryCheckTimer.elapsed() < 1000) {
+        return m_memoryShort;
+    }
+    m_memoryCheckTimer.start();
+    
+    ssize_t available = 0, total = 0;
+    GetRealMemoryMBAvailable(available, total);
+
+    // Short if less than 5% of physical memory, or 256M, is free
+    ssize_t minimum = std::max(ssize_t(256), total / 20);
+    bool wasShort = m_memoryShort;
+    m_memoryShort = (available >= 0 && available < minimum);
+
+    if (m_memoryShort && !wasShort) {
+        m_pressureTarget = getTotalBytes() / 2;
+        SVDEBUG << "CacheGovernor: system memory is short (" << available
+                << "M available of " << total << "M), aiming for "
+                << m_pressureTarget / (1024 * 1024) << "M of caches"
+                << endl;
+    }
+
+    return m_memoryShort;
+}
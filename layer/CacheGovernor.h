@@ -0,0 +1,196 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef CACHE_GOVERNOR_H
+#define CACHE_GOVERNOR_H
+
+#include "base/PropertyContainer.h"
+
+#include <QObject>
+#include <QMutex>
+#include <QElapsedTimer>
+
+#include <map>
+#include <vector>
+
+class QTimer;
+
+/**
+ * Process-wide accountant for the memory used by rendering caches
+ * and similar discardable stores, such as the image caches of views
+ * and layers and the whole-model peak caches of spectrograms.
+ *
+ * Each cache registers as a client and reports its size and the
+ * cost of rebuilding it. When the total exceeds a budget, or the
+ * system is running short of memory, the governor asks clients to
+ * release their caches: first those that are dormant (not currently
+ * on display), then the least recently used. The governor must be
+ * used from the GUI thread, and releases caches only from the event
+ * loop, never from within a call made by a client, so that a client
+ * may report use in the middle of painting without risk of having
+ * anything pulled from under it.
+ *
+ * The budget may be set in the "cache-budget-mb" value of the
+ * Preferences settings group, which is read at startup and again
+ * whenever a preference changes. The system's free memory is polled
+ * every few seconds, and the first sign of a shortage is treated as
+ * a signal of memory pressure.
+ */
+class CacheGovernor : public QObject
+{
+    Q_OBJECT
+
+public:
+    class Client
+    {
+    public:
+        virtual ~Client() { }
+
+        /**
+         * Return the number of bytes currently held, or planned to
+         * be held, by the cache.
+         */
+        virtual size_t getCacheBytes() const = 0;
+
+        /**
+         * Return an estimate, in seconds, of the time it would take
+         * to rebuild the cache after it has been released. This is
+         * used to prefer cheap caches when choosing between ones
+         * that are otherwise equally good to release.
+         */
+        virtual double getCacheRebuildCost() const = 0;
+
+        /**
+         * Return true if the cache belongs to something that is not
+         * currently on display, or that has not been used for at
+         * least dormancyTimeout milliseconds. Dormant caches are
+         * released first, and while the system is short of memory
+         * they are the only ones released beyond the budget.
+         */
+        virtual bool isCacheDormant() const { return false; }
+
+        /**
+         * Release as much of the cache's memory as possible. It
+         * should be rebuilt, as needed, when next used.
+         */
+        virtual void releaseCache() = 0;
+    };
+    
+    static CacheGovernor *getInstance();
+
+    /**
+     * Time in milliseconds after its last use at which a client that
+     * cannot tell whether it is on display may consider its cache
+     * dormant.
+     */
+    static const int dormancyTimeout = 10000;
+
+    void registerClient(Client *client);
+    void unregisterClient(Client *client);
+
+    /**
+     * Mark the client as having just been used, and arrange to
+     * release caches of other clients if necessary. Call this when a
+     * cache is used and when it grows.
+     */
+    void touch(Client *client);
+
+    /**
+     * Return true if an allocation of the given number of bytes, not
+     * yet reported by any client, would fit within the budget, if
+     * necessary after releasing the caches of clients other than the
+     * given one (which may be null). If it would, release those
+     * caches at once. The allocation should then be reported by a
+     * client. The caller must not be within any client's use of its
+     * cache.
+     *
+     * While the system is short of memory, an allocation is granted
+     * only if at least as much can be released from dormant caches,
+     * and the total then stays within the target set when the
+     * shortage was first seen.
+     */
+    bool requestAllocation(size_t bytes, const Client *requester);
+
+    /**
+     * Set the number of bytes the registered caches may use in
+     * total. The default is the value of the cache budget
+     * preference, or if that is unset, a quarter of physical memory,
+     * if that is known.
+     */
+    void setBudget(size_t bytes);
+    size_t getBudget() const;
+
+    /**
+     * Return the number of bytes currently reported by all clients.
+     */
+    size_t getTotalBytes() const;
+
+public slots:
+    /**
+     * Release caches until the total is within budget. If the system
+     * is short of memory, also release dormant caches until the total
+     * is within half of what it was when the shortage was first
+     * seen. This is called from the event loop following a call to
+     * touch().
+     */
+    void enforce();
+
+    /**
+     * Release caches to bring the total down to a quarter of the
+     * budget, for example on a signal of memory pressure from the
+     * system.
+     */
+    void handleMemoryPressure();
+
+private slots:
+    void preferenceChanged(PropertyContainer::PropertyName);
+    void checkMemory();
+
+private:
+    CacheGovernor();
+    virtual ~CacheGovernor();
+
+    struct ClientRecord {
+        unsigned long lastUsed;
+    };
+    
+    mutable QMutex m_mutex;
+    std::map<Client *, ClientRecord> m_clients;
+    unsigned long m_useCounter;
+    size_t m_budget;
+    bool m_enforcePending;
+    QElapsedTimer m_memoryCheckTimer;
+    bool m_memoryShort;
+    size_t m_pressureTarget; // fixed when memory is first seen short
+    QTimer *m_memoryPollTimer;
+    static const int memoryPollInterval = 5000; // ms
+
+    // The budget from the preference, or 0 if it is unset
+    static size_t getPreferredBudget();
+    static size_t getDefaultBudget();
+
+    // Return the clients, other than the given one, in the order in
+    // which their caches should be released
+    std::vector<Client *> getReleaseOrder(const Client *except) const;
+
+    // Release caches, other than the given client's, until the total
+    // is no more than target. If dormantOnly is true, release only
+    // dormant ones. Return the resulting total.
+    size_t releaseDownTo(size_t target, const Client *except,
+                         bool dormantOnly = false);
+
+    bool isMemoryShort();
+};
+
+#endif
@@ -22,9 +22,12 @@
 #include "ColourMapper.h"
 #include "LayerGeometryProvider.h"
 #include "PaintAssistant.h"
+#include "PeakColumnCache.h"
+#include "BinReductionCache.h"
+#include "ColumnReader.h"
+#include "ScrollableColumns.h"
 
-#include "data/model/Dense3DModelPeakCache.h"
-
+#include "view/View.h"
 #include "view/ViewManager.h"
 
 #include <QPainter>
@@ -32,6 +35,7 @@
 #include <QRect>
 #include <QTextStream>
 #include <QSettings>
+#include <QThread>
 
 #include <iostream>
 
@@ -59,7 +63,8 @@ Colour3DPlotLayer::Colour3DPlotLayer() :
     m_maxy(0),
     m_synchronous(false),
     m_peakCache(0),
-    m_peakCacheDivisor(8)
+    m_peakCacheDivisor(8),
+    m_magnitudes(&m_sourceMutex)
 {
     QSettings settings;
     settings.beginGroup("Preferences");
@@ -70,8 +75,7 @@ Colour3DPlotLayer::Colour3DPlotLayer() :
 Colour3DPlotLayer::~Colour3DPlotLayer()
 {
     invalidateRenderers();
-    if (m_peakCache) m_peakCache->aboutToDelete();
-    delete m_peakCache;
+    deletePeakCache();
 }
 
 ColourScaleType
@@ -159,13 +163,13 @@ Colour3DPlotLayer::setModel(const DenseThreeDimensionalModel *model)
         m_peakResolution = 128;
     }
 
-    if (m_peakCache) m_peakCache->aboutToDelete();
-    delete m_peakCache;
-    m_peakCache = 0;
-
+    // The renderers may be reading from the old peak cache, so must
+    // go first
     invalidateRenderers();
     invalidateMagnitudes();
 
+    deletePeakCache();
+
     emit modelReplaced();
     emit sliceableModelReplaced(oldModel, model);
 }
@@ -173,21 +177,59 @@ Colour3DPlotLayer::setModel(const DenseThreeDimensionalModel *model)
 void
 Colour3DPlotLayer::cacheInvalid()
 {
+    for (auto r: m_binReductions) r->invalidate();
+    
     invalidateRenderers();
     invalidateMagnitudes();
 }
 
 void
-Colour3DPlotLayer::cacheInvalid(sv_frame_t /* startFrame */,
-                                sv_frame_t /* endFrame */)
+Colour3DPlotLayer::cacheInvalid(sv_frame_t startFrame,
+                                sv_frame_t endFrame)
 {
-    //!!! should do this only if the range is visible
-    if (m_peakCache) m_peakCache->aboutToDelete();
-    delete m_peakCache;
-    m_peakCache = 0;
+    if (!m_model) {
+        invalidateRenderers();
+        invalidateMagnitudes();
+        return;
+    }
+
+    // Only the peak columns overlapping the changed range need to be
+    // read again, and the renderers need only redraw the columns
+    // showing it. Widen the renderers' range by a peak's worth of
+    // columns either side, as a peak column overlapping it may be
+    // drawn across pixels that don't.
+
+    int peakResolution = m_model->getResolution() * m_peakCacheDivisor;
+    sv_frame_t margin = peakResolution;
+
+    if (m_peakCache) {
+        sv_frame_t x0 = 0, x1 = 0;
+        ScrollableColumns::getAffectedColumns(m_model->getStartFrame(),
+                                              peakResolution,
+                                              startFrame, endFrame,
+                                              x0, x1);
+        if (x1 > x0) {
+            m_peakCache->invalidate(int(x0), int(x1 - 1));
+        }
+    }
+
+    // The bin reductions are of the model and then the peak cache
+    for (size_t i = 0; i < m_binReductions.size(); ++i) {
+        sv_frame_t x0 = 0, x1 = 0;
+        ScrollableColumns::getAffectedColumns(m_model->getStartFrame(),
+                                              i == 0 ?
+                                              m_model->getResolution() :
+                                              peakResolution,
+                                              startFrame, endFrame,
+                                              x0, x1);
+        if (x1 > x0) {
+            m_binReductions[i]->invalidate(int(x0), int(x1 - 1));
+        }
+    }
     
-    invalidateRenderers();
-    invalidateMagnitudes();
+    for (auto &r: m_renderers) {
+        r.second->invalidate(startFrame - margin, endFrame + margin);
+    }
 }
 
 void
@@ -200,24 +242,51 @@ Colour3DPlotLayer::invalidateRenderers()
     m_renderers.clear();
 }
 
+void
+Colour3DPlotLayer::updateRendererColourScales()
+{
+    // For changes that affect only the mapping from value to colour,
+    // which the renderers can apply to what they already have
+    
+    Colour3DPlotRenderer::setColourScales
+        (m_renderers, [this](int viewId) { return createColourScale(viewId); });
+}
+
 void
 Colour3DPlotLayer::invalidateMagnitudes()
 {
 #ifdef DEBUG_COLOUR_3D_PLOT_LAYER_PAINT
     cerr << "Colour3DPlotLayer::invalidateMagnitudes called" << endl;
 #endif
-    m_viewMags.clear();
+    m_magnitudes.invalidate();
 }
 
-Dense3DModelPeakCache *
+PeakColumnCache *
 Colour3DPlotLayer::getPeakCache() const
 {
     if (!m_peakCache) {
-        m_peakCache = new Dense3DModelPeakCache(m_model, m_peakCacheDivisor);
+        m_peakCache = new PeakColumnCache(m_model, m_peakCacheDivisor,
+                                          &m_sourceMutex);
+        m_binReductions.push_back(new BinReductionCache
+                                  (m_model, &m_sourceMutex));
+        m_binReductions.push_back(new BinReductionCache(m_peakCache));
     }
     return m_peakCache;
 }
 
+void
+Colour3DPlotLayer::deletePeakCache()
+{
+    // The reductions read from the peak cache, so go first
+    for (auto r: m_binReductions) {
+        delete r;
+    }
+    m_binReductions.clear();
+
+    delete m_peakCache;
+    m_peakCache = 0;
+}
+
 void
 Colour3DPlotLayer::modelChanged()
 {
@@ -483,8 +552,14 @@ Colour3DPlotLayer::setColourScale(ColourScaleType scale)
 {
     m_colourScaleSet = true; // even if setting to the same thing
     if (m_colourScale == scale) return;
+    bool phaseChanged = ((m_colourScale == ColourScaleType::Phase) !=
+                         (scale == ColourScaleType::Phase));
     m_colourScale = scale;
-    invalidateRenderers();
+    if (phaseChanged) {
+        invalidateRenderers();
+    } else {
+        updateRendererColourScales();
+    }
     emit layerParametersChanged();
 }
 
@@ -493,7 +568,7 @@ Colour3DPlotLayer::setColourMap(int map)
 {
     if (m_colourMap == map) return;
     m_colourMap = map;
-    invalidateRenderers();
+    updateRendererColourScales();
     emit layerParametersChanged();
 }
 
@@ -502,7 +577,7 @@ Colour3DPlotLayer::setGain(float gain)
 {
     if (m_gain == gain) return;
     m_gain = gain;
-    invalidateRenderers();
+    updateRendererColourScales();
     emit layerParametersChanged();
 }
 
@@ -826,7 +901,8 @@ Colour3DPlotLayer::getFeatureDescription(LayerGeometryProvider *v, QPoint &pos)
 
     if (m_invertVertical) sy = m_model->getHeight() - sy - 1;
 
-    float value = m_model->getValueAt(sx0, sy);
+    float value = 0.f;
+    ColumnReader::getColumnRange(m_model, sx0, sy, 1, &value);
 
 //    cerr << "bin value (" << sx0 << "," << sy << ") is " << value << endl;
     
@@ -887,8 +963,9 @@ Colour3DPlotLayer::paintVerticalScale(LayerGeometryProvider *v, bool, QPainter &
     int ch = h - 20;
     if (ch > 20) {
 
-        double min = m_viewMags[v->getId()].getMin();
-        double max = m_viewMags[v->getId()].getMax();
+        MagnitudeRange range = m_magnitudes.getRange(v->getId());
+        double min = range.getMin();
+        double max = range.getMax();
 
         if (max <= min) max = min + 0.1;
 
@@ -994,6 +1071,46 @@ Colour3DPlotLayer::paintVerticalScale(LayerGeometryProvider *v, bool, QPainter &
     paint.restore();
 }
 
+ColourScale
+Colour3DPlotLayer::createColourScale(int viewId) const
+{
+    ColourScale::Parameters cparams;
+    cparams.colourMap = m_colourMap;
+    cparams.scaleType = m_colourScale;
+    cparams.gain = m_gain;
+
+    double minValue = 0.0;
+    double maxValue = 1.0;
+
+    bool visible = m_magnitudes.getColourScaleRange
+        (viewId, m_normalizeVisibleArea, minValue, maxValue);
+    
+    if (!visible) {
+        if (m_normalization == ColumnNormalization::Hybrid) {
+            minValue = 0;
+            maxValue = log10(m_model->getMaximumLevel() + 1.0);
+        } else if (m_normalization == ColumnNormalization::None) {
+            minValue = m_model->getMinimumLevel();
+            maxValue = m_model->getMaximumLevel();
+        }
+    }
+
+    SVDEBUG << "Colour3DPlotLayer: new colour scale, value range is "
+            << minValue << " -> " << maxValue << endl;
+    
+    if (maxValue <= minValue) {
+        maxValue = minValue + 0.1f;
+    }
+
+    cparams.threshold = minValue;
+    cparams.minValue = minValue;
+    cparams.maxValue = maxValue;
+
+    m_magnitudes.setColourScaleRange(viewId, visible, minValue, maxValue);
+
+    return ColourScale(cparams);
+}
+
 Colour3DPlotRenderer *
 Colour3DPlotLayer::getRenderer(const LayerGeometryProvider *v) const
 {
@@ -1006,49 +1123,28 @@ Colour3DPlotLayer::getRenderer(const LayerGeometryProvider *v) const
         sources.fft = 0;
         sources.source = m_model;
         sources.peakCaches.push_back(getPeakCache());
+        sources.binReductions = m_binReductions;
 
-        ColourScale::Parameters cparams;
-        cparams.colourMap = m_colourMap;
-        cparams.scaleType = m_colourScale;
-        cparams.gain = m_gain;
-
-        double minValue = 0.0;
-        double maxValue = 1.0;
-        
-        if (m_normalizeVisibleArea && m_viewMags[viewId].isSet()) {
-            minValue = m_viewMags[viewId].getMin();
-            maxValue = m_viewMags[viewId].getMax();
-        } else if (m_normalization == ColumnNormalization::Hybrid) {
-            minValue = 0;
-            maxValue = log10(m_model->getMaximumLevel() + 1.0);
-        } else if (m_normalization == ColumnNormalization::None) {
-            minValue = m_model->getMinimumLevel();
-            maxValue = m_model->getMaximumLevel();
-        }
-
-        SVDEBUG << "Colour3DPlotLayer: rebuilding renderer, value range is "
-                << minValue << " -> " << maxValue << endl;
-        
-        if (maxValue <= minValue) {
-            maxValue = minValue + 0.1f;
-        }
-
-        cparams.threshold = minValue;
-        cparams.minValue = minValue;
-        cparams.maxValue = maxValue;
-        
-        m_lastRenderedMags[viewId] = MagnitudeRange(float(minValue),
-                                                    float(maxValue));
+        sources.columnRanges = m_magnitudes.getColumnRanges(viewId);
+        sources.sourceMutex = &m_sourceMutex;
 
         Colour3DPlotRenderer::Parameters params;
-        params.colourScale = ColourScale(cparams);
+        params.colourScale = createColourScale(viewId);
         params.normalization = m_normalization;
         params.binScale = m_binScale;
         params.alwaysOpaque = m_opaque;
         params.invertVertical = m_invertVertical;
         params.interpolate = m_smooth;
+        params.threadCount = QThread::idealThreadCount();
+        params.overscan = 1;
+        params.asynchronous = true;
+        params.retainValues = true;
+        params.indexedCache = true;
 
         m_renderers[viewId] = new Colour3DPlotRenderer(sources, params);
+
+        // Repaint as background rendering makes progress
+        m_renderers[viewId]->connectRenderReady(v->getView(), SLOT(update()));
     }
 
     return m_renderers[viewId];
@@ -1065,10 +1161,13 @@ Colour3DPlotLayer::paintWithRenderer(LayerGeometryProvider *v,
     int viewId = v->getId();
 
     bool continuingPaint = !renderer->geometryChanged(v);
-    
-    if (continuingPaint) {
-        magRange = m_viewMags[viewId];
+
+    if (m_magnitudes.startPaint(v, m_model, continuingPaint,
+                                m_normalizeVisibleArea, magRange)) {
+        renderer->setColourScale(createColourScale(viewId));
     }
+
+    bool complete = true;
     
     if (m_synchronous) {
 
@@ -1079,31 +1178,22 @@ Colour3DPlotLayer::paintWithRenderer(LayerGeometryProvider *v,
         result = renderer->renderTimeConstrained(v, paint, rect);
 
         QRect uncached = renderer->getLargestUncachedRect(v);
-        if (uncached.width() > 0) {
+        if (renderer->hasPendingRender()) {
+            // The renderer will tell the view when it has more for us
+            complete = false;
+        } else if (uncached.width() > 0) {
+            complete = false;
             v->updatePaintRect(uncached);
+        } else {
+            // The visible area is complete, so arrange to fill the
+            // off-screen margin in the scroll direction
+            renderer->prefetch(v);
         }
     }
-    
-    magRange.sample(result.range);
 
-    if (magRange.isSet()) {
-        if (m_viewMags[viewId] != magRange) {
-            m_viewMags[viewId] = magRange;
-#ifdef DEBUG_COLOUR_3D_PLOT_LAYER_PAINT
-            cerr << "mag range in this view has changed: "
-                 << magRange.getMin() << " -> " << magRange.getMax() << endl;
-#endif
-        }
-    }
-    
-    if (!continuingPaint && m_normalizeVisibleArea &&
-        m_viewMags[viewId] != m_lastRenderedMags[viewId]) {
-#ifdef DEBUG_COLOUR_3D_PLOT_LAYER_PAINT
-        cerr << "mag range has changed from last rendered range: re-rendering"
-             << endl;
-#endif
-        delete m_renderers[viewId];
-        m_renderers.erase(viewId);
+    if (m_magnitudes.endPaint(v, m_model, m_normalizeVisibleArea,
+                              complete, result.range, magRange)) {
+        renderer->setColourScale(createColourScale(viewId));
         v->updatePaintRect(v->getPaintRect());
     }
 }
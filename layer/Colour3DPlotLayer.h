@@ -21,6 +21,7 @@
 
 #include "ColourScale.h"
 #include "Colour3DPlotRenderer.h"
+#include "ViewMagnitudes.h"
 
 #include "data/model/DenseThreeDimensionalModel.h"
 
@@ -181,20 +182,33 @@ protected:
     static std::pair<ColumnNormalization, bool> convertToColumnNorm(int value);
     static int convertFromColumnNorm(ColumnNormalization norm, bool visible);
 
-    mutable Dense3DModelPeakCache *m_peakCache;
+    mutable PeakColumnCache *m_peakCache;
     const int m_peakCacheDivisor;
-    Dense3DModelPeakCache *getPeakCache() const;
+    PeakColumnCache *getPeakCache() const;
 
-    typedef std::map<int, MagnitudeRange> ViewMagMap; // key is view id
-    mutable ViewMagMap m_viewMags;
-    mutable ViewMagMap m_lastRenderedMags; // when in normalizeVisibleArea mode
+    // Bin reductions of the model and of the peak cache, in that
+    // order, made along with the peak cache
+    mutable std::vector<BinReductionCache *> m_binReductions;
+    void deletePeakCache();
+
+    // The magnitude range of each view, and the per-column ranges
+    // recorded by its renderer, from which normalizeVisibleArea mode
+    // finds the visible range before rendering
+    mutable ViewMagnitudes m_magnitudes;
     void invalidateMagnitudes();
 
     typedef std::map<int, Colour3DPlotRenderer *> ViewRendererMap; // key is view id
     mutable ViewRendererMap m_renderers;
+
+    // Held by the renderers while reading the model, peak cache and
+    // column magnitudes, as they may do so from background threads
+    // for more than one view at once
+    mutable QMutex m_sourceMutex;
     
     Colour3DPlotRenderer *getRenderer(const LayerGeometryProvider *) const;
+    ColourScale createColourScale(int viewId) const;
     void invalidateRenderers();
+    void updateRendererColourScales();
         
     /**
      * Return the y coordinate at which the given bin "starts"
@@ -20,22 +20,97 @@
 #include "base/HitCount.h"
 
 #include "data/model/DenseThreeDimensionalModel.h"
-#include "data/model/Dense3DModelPeakCache.h"
 #include "data/model/FFTModel.h"
 
 #include "LayerGeometryProvider.h"
 #include "VerticalBinLayer.h"
 #include "PaintAssistant.h"
 #include "ImageRegionFinder.h"
+#include "ColumnReader.h"
+#include "CompactColumnCache.h"
+#include "PeakColumnCache.h"
+#include "BinReductionCache.h"
 
 #include "view/ViewManager.h" // for main model sample rate. Pity
+#include "view/View.h"
+
+#include <QMutexLocker>
+#include <QTimer>
+#include <QThreadPool>
+#include <QRunnable>
+#include <QSemaphore>
 
 #include <vector>
+#include <thread>
+#include <functional>
+#include <exception>
+#include <algorithm>
+#include <cmath>
 
 //#define DEBUG_COLOUR_PLOT_REPAINT 1
 
 using namespace std;
 
+Colour3DPlotRenderer::Colour3DPlotRenderer(Sources sources,
+                                           Parameters parameters) :
+    m_sources(sources),
+    m_params(parameters),
+    m_colourScale(parameters.colourScale),
+    m_phase(parameters.colourScale.getScale() == ColourScaleType::Phase),
+    m_tileCache(tileWidth, 0),
+    m_secondsPerXPixel(0.0),
+    m_secondsPerXPixelValid(false),
+    m_renderedEndFrame(-1),
+    m_notifier(new Colour3DPlotRenderNotifier(this)),
+    m_prefetchTimer(new QTimer(m_notifier)),
+    m_asyncThread(0),
+    m_asyncBusy(false),
+    m_asyncBusyZoomLevel(0),
+    m_asyncBusyHeight(0),
+    m_asyncBusyLeft(0),
+    m_asyncBusyRight(0),
+    m_asyncExiting(false),
+    m_asyncGeneration(0),
+    m_previewZoomLevel(0),
+    m_previewPixelLeft(0),
+    m_previewPixelStep(1),
+    m_previewStep(maxPreviewStep),
+    m_binforxMemoZoomLevel(0),
+    m_binforxMemoModelStart(0),
+    m_binforxMemoLeft(0)
+{
+    if (m_params.indexedCache) {
+        m_cache.setIndexed(true);
+        m_cache.setColourTable
+            (m_colourScale.getPalette(m_params.colourRotation));
+    }
+
+    m_prefetchTimer->setSingleShot(true);
+    m_prefetchTimer->setInterval(0);
+    QObject::connect(m_prefetchTimer, SIGNAL(timeout()),
+                     m_notifier, SLOT(prefetchTimeout()));
+
+    CacheGovernor::getInstance()->registerClient(this);
+}
+
+Colour3DPlotRenderer::~Colour3DPlotRenderer()
+{
+    CacheGovernor::getInstance()->unregisterClient(this);
+    
+    if (m_asyncThread) {
+        {
+            QMutexLocker locker(&m_asyncMutex);
+            m_asyncExiting = true;
+            m_asyncJobs.clear();
+            m_asyncCondition.wakeAll();
+        }
+        m_asyncThread->join();
+        delete m_asyncThread;
+    }
+
+    delete m_notifier;
+}
+
 Colour3DPlotRenderer::RenderResult
 Colour3DPlotRenderer::render(const LayerGeometryProvider *v, QPainter &paint, QRect rect)
 {
@@ -58,11 +133,20 @@ Colour3DPlotRenderer::getLargestUncachedRect(const LayerGeometryProvider *v)
         return QRect(); // never cached
     }
 
+    int w = m_cache.getSize().width();
     int h = m_cache.getSize().height();
 
-    QRect areaLeft(0, 0, m_cache.getValidLeft(), h);
-    QRect areaRight(m_cache.getValidRight(), 0,
-                    m_cache.getSize().width() - m_cache.getValidRight(), h);
+    if (!m_cache.isValid()) {
+        return QRect(0, 0, w, h);
+    }
+
+    // The valid area may extend into the overscan margins, but only
+    // the view area is of interest here
+    int validLeft = std::max(0, std::min(w, m_cache.getValidLeft()));
+    int validRight = std::max(0, std::min(w, m_cache.getValidRight()));
+    
+    QRect areaLeft(0, 0, validLeft, h);
+    QRect areaRight(validRight, 0, w - validRight, h);
 
     if (areaRight.width() > areaLeft.width()) {
         return areaRight;
@@ -80,13 +164,1167 @@ Colour3DPlotRenderer::geometryChanged(const LayerGeometryProvider *v)
         return true; // never cached
     }
 
-    if (m_cache.getSize() == v->getPaintSize() &&
-        m_cache.getZoomLevel() == v->getZoomLevel() &&
-        m_cache.getStartFrame() == v->getStartFrame()) {
+    if (m_cache.getSize() == v->getPaintSize() &&
+        m_cache.getZoomLevel() == v->getZoomLevel() &&
+        m_cache.getStartFrame() == v->getStartFrame()) {
+        return false;
+    } else {
+        return true;
+    }
+}
+
+void
+Colour3DPlotRenderNotifier::prefetchTimeout()
+{
+    m_renderer->prefetchStep();
+}
+
+bool
+Colour3DPlotRenderer::getPrefetchArea(const LayerGeometryProvider *v,
+                                      int &x0, int &width, int &direction)
+{
+    if (m_params.overscan <= 0) {
+        return false;
+    }
+
+    if (decideRenderType(v) == DirectTranslucent) {
+        return false; // never cached
+    }
+
+    if (geometryChanged(v) || !m_cache.isValid()) {
+        return false;
+    }
+
+    int w = m_cache.getSize().width();
+    int margin = m_cache.getMargin();
+
+    if (m_cache.getValidLeft() > 0 || m_cache.getValidRight() < w) {
+        // the visible area comes first
+        return false;
+    }
+
+    direction = m_cache.getScrollDirection();
+    
+    if (direction > 0) {
+        x0 = m_cache.getValidRight();
+        width = w + margin - x0;
+    } else if (direction < 0) {
+        x0 = -margin;
+        width = m_cache.getValidLeft() - x0;
+    } else {
+        width = 0;
+    }
+
+    return width > 0;
+}
+
+void
+Colour3DPlotRenderer::prefetch(const LayerGeometryProvider *v)
+{
+    if (m_params.overscan <= 0 || geometryChanged(v)) {
+        return;
+    }
+
+    CacheGovernor::getInstance()->touch(this);
+    m_lastUsed.start();
+
+    integrateAsyncResults(v);
+
+    int x0 = 0, width = 0, direction = 0;
+    if (!getPrefetchArea(v, x0, width, direction)) {
+        return;
+    }
+
+    // If we can render in the background, there is no need to hold
+    // back: queue the whole of the remaining margin at once
+    if (useAsynchronousRender(decideRenderType(v), true)) {
+        queueAsyncRender(v, x0, width, direction < 0, false);
+        return;
+    }
+
+    // Otherwise leave it until there is nothing else to do. The view
+    // is itself a geometry provider with the same geometry as v, or
+    // else prefetchStep() will find that the geometry has changed
+    // and give up.
+    m_prefetchView = v->getView();
+    if (!m_prefetchTimer->isActive()) {
+        m_prefetchTimer->start();
+    }
+}
+
+void
+Colour3DPlotRenderer::prefetchStep()
+{
+    const LayerGeometryProvider *v = m_prefetchView.data();
+    if (!v) {
+        return;
+    }
+    
+    int x0 = 0, width = 0, direction = 0;
+    if (!getPrefetchArea(v, x0, width, direction)) {
+        return;
+    }
+
+    // Render only a short chunk, adjacent to the valid area, so as
+    // not to hold up whatever the user does next
+
+    int chunk = getPrefetchWidth();
+    if (chunk < width) {
+        if (direction < 0) {
+            x0 += width - chunk;
+        }
+        width = chunk;
+    }
+
+    Profiler profiler("Colour3DPlotRenderer::prefetchStep");
+    
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "prefetchStep: direction " << direction << ", x0 " << x0
+            << ", width " << width << endl;
+#endif
+
+    int priorLeft = m_cache.getValidLeft();
+    int priorRight = m_cache.getValidRight();
+    
+    if (decideRenderType(v) == DrawBufferBinResolution) {
+        renderToCacheBinResolution(v, x0, width);
+    } else {
+        renderToCachePixelResolution(v, x0, width, direction < 0, false);
+    }
+
+    storeTiles(v);
+
+    if (m_cache.getValidLeft() == priorLeft &&
+        m_cache.getValidRight() == priorRight) {
+        // no progress, so don't try again until asked to
+        return;
+    }
+
+    if (getPrefetchArea(v, x0, width, direction)) {
+        m_prefetchTimer->start();
+    }
+}
+
+int
+Colour3DPlotRenderer::getPrefetchWidth() const
+{
+    // Aim for each prefetch chunk to take no more than this long
+    const double budget = 0.05; // seconds
+
+    // Width to use if we don't yet know how fast we are
+    const int fallbackWidth = 64;
+
+    const int minWidth = 16;
+    
+    if (!m_secondsPerXPixelValid || m_secondsPerXPixel <= 0.0) {
+        return fallbackWidth;
+    }
+
+    double width = budget / m_secondsPerXPixel;
+    if (width > 1e6) {
+        width = 1e6;
+    }
+    return std::max(minWidth, int(width));
+}
+
+void
+Colour3DPlotRenderer::setColourScale(const ColourScale &colourScale)
+{
+    if ((colourScale.getScale() == ColourScaleType::Phase) != m_phase) {
+        throw std::logic_error("Colour scale may not be changed to or from phase in Colour3DPlotRenderer::setColourScale");
+    }
+
+    bool samePixels = m_colourScale.hasSamePixels(colourScale);
+    
+    m_colourScale = colourScale;
+
+    if (samePixels) {
+        // only the colour map has changed
+        updatePalette();
+        return;
+    }
+
+    // Anything rendered or being rendered with the old colours is
+    // now of no use, except where we can recolour it from retained
+    // values, but the magnitude cache remains valid
+    QVector<QRgb> palette = m_colourScale.getPalette(m_params.colourRotation);
+    
+    discardAsyncWork();
+    if (m_cache.isIndexed()) {
+        m_cache.setColourTable(palette);
+    }
+    if (!recolourCache()) {
+        m_cache.invalidate();
+    }
+    m_tileCache.clear();
+    m_preview = QImage();
+
+    if (!m_drawBuffer.isNull()) {
+        m_drawBuffer.setColorTable(palette);
+    }
+}
+
+void
+Colour3DPlotRenderer::setColourRotation(int rotation)
+{
+    if (m_params.colourRotation == rotation) {
+        return;
+    }
+    
+    m_params.colourRotation = rotation;
+
+    updatePalette();
+}
+
+void
+Colour3DPlotRenderer::setColourScales(const ViewRendererMap &renderers,
+                                      std::function<ColourScale(int)> makeColourScale)
+{
+    for (const auto &r: renderers) {
+        r.second->setColourScale(makeColourScale(r.first));
+    }
+}
+
+void
+Colour3DPlotRenderer::updatePalette()
+{
+    QVector<QRgb> palette = m_colourScale.getPalette(m_params.colourRotation);
+    
+    if (!m_drawBuffer.isNull()) {
+        m_drawBuffer.setColorTable(palette);
+    }
+
+    if (m_cache.isIndexed()) {
+        // The pixel indices in the cache, the tiles, the preview and
+        // any background work are all still good: only the colours
+        // they stand for have changed
+        m_cache.setColourTable(palette);
+        if (!m_preview.isNull()) {
+            m_preview.setColorTable(palette);
+        }
+        return;
+    }
+
+    discardAsyncWork();
+    if (!recolourCache()) {
+        m_cache.invalidate();
+    }
+    m_tileCache.clear();
+    m_preview = QImage();
+}
+
+bool
+Colour3DPlotRenderer::recolourCache()
+{
+    if (!m_params.retainValues || !m_cache.isValid()) {
+        return false;
+    }
+
+    Profiler profiler("Colour3DPlotRenderer::recolourCache");
+    
+    // Find the longest run of columns, within the valid area of the
+    // image cache, for which we have values
+    
+    int left = 0, width = 0;
+    int runLeft = m_cache.getValidLeft();
+
+    for (int x = m_cache.getValidLeft(); x <= m_cache.getValidRight(); ++x) {
+        if (x < m_cache.getValidRight() && m_valueCache.isColumnSet(x)) {
+            continue;
+        }
+        if (x - runLeft > width) {
+            left = runLeft;
+            width = x - runLeft;
+        }
+        runLeft = x + 1;
+    }
+
+    if (width == 0) {
+        return false;
+    }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "recolourCache: recolouring x " << left << " -> "
+            << left + width << " of valid area "
+            << m_cache.getValidLeft() << " -> " << m_cache.getValidRight()
+            << endl;
+#endif
+    
+    int h = m_valueCache.getHeight();
+
+    QImage image(width, h, QImage::Format_Indexed8);
+    image.setColorTable
+        (m_colourScale.getPalette(m_params.colourRotation));
+    image.fill(0);
+
+    vector<uchar *> lines(h);
+    for (int y = 0; y < h; ++y) {
+        lines[y] = image.scanLine(y);
+    }
+    
+    vector<unsigned char> pixels(h);
+
+    for (int i = 0; i < width; ++i) {
+
+        const float *values = m_valueCache.getColumn(left + i);
+        if (!values) {
+            continue; // blank
+        }
+
+        m_colourScale.getPixels(values, h, pixels.data());
+        
+        for (int y = 0; y < h; ++y) {
+            int py;
+            if (m_params.invertVertical) {
+                py = y;
+            } else {
+                py = h - y - 1;
+            }
+            lines[py][i] = pixels[y];
+        }
+    }
+
+    m_cache.invalidate();
+    m_cache.drawImage(left, width, image, 0, width);
+
+    return true;
+}
+
+bool
+Colour3DPlotRenderer::hasPendingRender() const
+{
+    QMutexLocker locker(&m_asyncMutex);
+    return m_asyncBusy || !m_asyncJobs.empty() || !m_asyncResults.empty();
+}
+
+void
+Colour3DPlotRenderer::connectRenderReady(const QObject *receiver,
+                                         const char *slot)
+{
+    QObject::connect(m_notifier, SIGNAL(renderReady()), receiver, slot,
+                     Qt::QueuedConnection);
+}
+
+void
+Colour3DPlotRenderer::setCacheGeometry(const LayerGeometryProvider *v)
+{
+    if (m_cache.getZoomLevel() != v->getZoomLevel() ||
+        m_cache.getSize().height() != v->getPaintHeight()) {
+        // nothing queued for the old geometry is of any use now
+        discardAsyncWork();
+    }
+    
+    int margin = m_params.overscan * v->getPaintWidth();
+    
+    m_cache.setMargin(margin);
+    m_cache.resize(v->getPaintSize());
+    m_cache.setZoomLevel(v->getZoomLevel());
+
+    m_magCache.setMargin(margin);
+    m_magCache.resize(v->getPaintSize().width());
+    m_magCache.setZoomLevel(v->getZoomLevel());
+
+    if (m_params.retainValues) {
+        m_valueCache.setMargin(margin);
+        m_valueCache.resize(v->getPaintWidth(), v->getPaintHeight());
+        m_valueCache.setZoomLevel(v->getZoomLevel());
+    }
+    
+    m_tileCache.setHeight(v->getPaintHeight());
+
+    size_t bytesPerPixel = (m_params.indexedCache ? 1 : 4);
+    m_tileCache.setMaxBytes(size_t(tileCacheViews) * bytesPerPixel *
+                            size_t(v->getPaintWidth()) *
+                            size_t(v->getPaintHeight()));
+}
+
+void
+Colour3DPlotRenderer::storeTiles(const LayerGeometryProvider *v)
+{
+    // Copy into the tile cache any whole tiles that are valid in the
+    // image cache and not yet stored
+    
+    if (!m_cache.isValid()) {
+        return;
+    }
+
+    int zoomLevel = v->getZoomLevel();
+    int tw = m_tileCache.getTileWidth();
+    int h = m_cache.getSize().height();
+    int margin = m_cache.getMargin();
+
+    // pixel index, counted from frame 0, of view x coordinate 0
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+
+    sv_frame_t validLeft = origin + m_cache.getValidLeft();
+    sv_frame_t validRight = origin + m_cache.getValidRight();
+
+    // tiles from first up to (but not including) last lie wholly
+    // within the valid area
+    int first = m_tileCache.getTileIndexForPixel(validLeft + tw - 1);
+    int last = m_tileCache.getTileIndexForPixel(validRight);
+
+    for (int index = first; index < last; ++index) {
+
+        if (m_tileCache.haveTile(zoomLevel, index)) {
+            continue;
+        }
+
+        int x = int(sv_frame_t(index) * tw - origin);
+
+        ZoomTileCache::Tile tile;
+        tile.image = m_cache.getImage().copy(x + margin, 0, tw, h);
+        tile.ranges.resize(tw);
+        for (int i = 0; i < tw; ++i) {
+            tile.ranges[i] = m_magCache.getRange(x + i);
+        }
+
+        m_tileCache.storeTile(zoomLevel, index, tile);
+    }
+}
+
+void
+Colour3DPlotRenderer::restoreFromTiles(const LayerGeometryProvider *v, int x0)
+{
+    // Extend the valid area of the image cache as far as we can in
+    // both directions from stored tiles. If nothing is valid, start
+    // from the tile containing x0.
+    
+    if (m_tileCache.isEmpty()) {
+        return;
+    }
+
+    int w = m_cache.getSize().width();
+    int margin = m_cache.getMargin();
+
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+
+    if (!m_cache.isValid()) {
+        if (!restoreTile(v, m_tileCache.getTileIndexForPixel(origin + x0))) {
+            return;
+        }
+    }
+
+    while (m_cache.getValidRight() < w + margin) {
+        int index = m_tileCache.getTileIndexForPixel
+            (origin + m_cache.getValidRight());
+        if (!restoreTile(v, index)) {
+            break;
+        }
+    }
+
+    while (m_cache.getValidLeft() > -margin) {
+        int index = m_tileCache.getTileIndexForPixel
+            (origin + m_cache.getValidLeft() - 1);
+        if (!restoreTile(v, index)) {
+            break;
+        }
+    }
+}
+
+bool
+Colour3DPlotRenderer::restoreTile(const LayerGeometryProvider *v, int index)
+{
+    const ZoomTileCache::Tile *tile =
+        m_tileCache.getTile(v->getZoomLevel(), index);
+    
+    if (!tile) {
+        return false;
+    }
+
+    int tw = m_tileCache.getTileWidth();
+    int w = m_cache.getSize().width();
+    int margin = m_cache.getMargin();
+
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+    
+    int tileLeft = int(sv_frame_t(index) * tw - origin);
+    int left = std::max(tileLeft, -margin);
+    int right = std::min(tileLeft + tw, w + margin);
+
+    if (right <= left) {
+        return false;
+    }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "restoreTile: index " << index << " to x " << left
+            << " -> " << right << endl;
+#endif
+    
+    m_cache.drawImage(left, right - left,
+                      tile->image,
+                      left - tileLeft, right - left);
+
+    for (int x = left; x < right; ++x) {
+        const MagnitudeRange &range = tile->ranges[x - tileLeft];
+        if (range.isSet()) {
+            m_magCache.sampleColumn(x, range);
+        }
+        if (m_params.retainValues) {
+            m_valueCache.unsetColumn(x);
+        }
+    }
+
+    return true;
+}
+
+void
+Colour3DPlotRenderer::paintPlaceholder(const LayerGeometryProvider *v,
+                                       QPainter &paint, QRect rect)
+{
+    // Paint into rect, scaled, a preview of this zoom level if we
+    // have one that covers it, or otherwise whatever tiles we have
+    // from the closest other zoom level. This goes only to the
+    // painter, not into the image cache.
+
+    if (paintPreview(v, paint, rect)) {
+        return;
+    }
+    
+    int zoomLevel = v->getZoomLevel();
+    int other = m_tileCache.getNearestOtherZoomLevel(zoomLevel);
+    if (other <= 0) {
+        return;
+    }
+
+    // Don't bother if the other level is so much more zoomed-in
+    // that it would take a great many tiles to cover the area
+    const int maxTiles = 64;
+
+    int tw = m_tileCache.getTileWidth();
+
+    sv_frame_t f0 = v->getFrameForX(rect.x());
+    sv_frame_t f1 = v->getFrameForX(rect.x() + rect.width());
+
+    sv_frame_t p0 = f0 / other;
+    if (f0 < 0 && p0 * other != f0) --p0;
+    sv_frame_t p1 = f1 / other;
+    if (f1 < 0 && p1 * other != f1) --p1;
+
+    int first = m_tileCache.getTileIndexForPixel(p0);
+    int last = m_tileCache.getTileIndexForPixel(p1);
+    if (last - first >= maxTiles) {
+        return;
+    }
+
+    QVector<QRgb> palette;
+    if (m_cache.isIndexed()) {
+        palette = m_colourScale.getPalette(m_params.colourRotation);
+    }
+    
+    paint.save();
+    paint.setClipRect(rect, Qt::IntersectClip);
+
+    for (int index = first; index <= last; ++index) {
+
+        const ZoomTileCache::Tile *tile = m_tileCache.getTile(other, index);
+        if (!tile) {
+            continue;
+        }
+
+        QImage image = tile->image;
+        if (m_cache.isIndexed()) {
+            // the tile may date from before a change of palette
+            image.setColorTable(palette);
+        }
+
+        sv_frame_t tf0 = sv_frame_t(index) * tw * other;
+        sv_frame_t tf1 = tf0 + sv_frame_t(tw) * other;
+        int tx0 = v->getXForFrame(tf0);
+        int tx1 = v->getXForFrame(tf1);
+        if (tx1 <= tx0) {
+            continue;
+        }
+
+        paint.drawImage(QRect(tx0, 0, tx1 - tx0, image.height()), image);
+    }
+
+    paint.restore();
+}
+
+void
+Colour3DPlotRenderer::cancelPendingRender()
+{
+    discardAsyncWork();
+}
+
+void
+Colour3DPlotRenderer::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "invalidate: frames " << startFrame << " -> " << endFrame
+            << endl;
+#endif
+
+    // A change reaching the end of the model as last rendered, as
+    // when the model grows, also affects the blank columns beyond
+    // it. Extend the range to cover those, so that the valid area of
+    // the cache is cut back from the right rather than split.
+    if (m_renderedEndFrame >= 0 && endFrame >= m_renderedEndFrame) {
+        endFrame = std::max(endFrame, getCacheEndFrame());
+    }
+
+    discardAsyncWork();
+    m_cache.invalidate(startFrame, endFrame);
+    m_magCache.invalidate(startFrame, endFrame);
+    m_valueCache.invalidate(startFrame, endFrame);
+    m_tileCache.invalidate(startFrame, endFrame);
+
+    // The preview covers the whole model, so it isn't worth being
+    // selective here
+    m_preview = QImage();
+}
+
+sv_frame_t
+Colour3DPlotRenderer::getCacheEndFrame() const
+{
+    return m_cache.getStartFrame() +
+        sv_frame_t(m_cache.getSize().width() + m_cache.getMargin()) *
+        m_cache.getZoomLevel();
+}
+
+void
+Colour3DPlotRenderer::checkForModelGrowth(const LayerGeometryProvider *v)
+{
+    const DenseThreeDimensionalModel *model = m_sources.source;
+    if (!model) {
+        return;
+    }
+
+    sv_frame_t endFrame = model->getEndFrame();
+
+    if (m_renderedEndFrame >= 0 && endFrame > m_renderedEndFrame) {
+
+        // The last columns before the old end may have been rendered
+        // from incomplete data: a peak column may have covered fewer
+        // source columns than it will now, and an FFT column may have
+        // had part of its window missing
+        
+        int peakCacheIndex = -1, binsPerPeak = -1;
+        getPreferredPeakCache(v, peakCacheIndex, binsPerPeak);
+
+        sv_frame_t margin = model->getResolution();
+        if (peakCacheIndex >= 0) {
+            margin = m_sources.peakCaches[peakCacheIndex]->getResolution();
+        }
+        if (m_sources.fft) {
+            margin = std::max(margin, sv_frame_t(m_sources.fft->getFFTSize()));
+        }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+        SVDEBUG << "checkForModelGrowth: model end " << m_renderedEndFrame
+                << " -> " << endFrame << ", invalidating from "
+                << m_renderedEndFrame - margin << endl;
+#endif
+
+        invalidate(m_renderedEndFrame - margin, endFrame);
+    }
+
+    m_renderedEndFrame = endFrame;
+}
+
+void
+Colour3DPlotRenderer::paintFromCache(const LayerGeometryProvider *v,
+                                     QPainter &paint, QRect rect)
+{
+    if (!m_cache.isValid() || m_cache.getValidWidth() == 0) {
+        paintPlaceholder(v, paint, rect);
+        return;
+    }
+
+    const QImage &image = m_cache.getImage();
+    int zoomLevel = m_cache.getZoomLevel();
+    sv_frame_t startFrame = m_cache.getStartFrame();
+
+    sv_frame_t f0 = startFrame + sv_frame_t(m_cache.getValidLeft()) * zoomLevel;
+    sv_frame_t f1 = startFrame + sv_frame_t(m_cache.getValidRight()) * zoomLevel;
+    int x0 = v->getXForFrame(f0);
+    int x1 = v->getXForFrame(f1);
+    if (x1 <= x0) {
+        return;
+    }
+
+    QRect source(m_cache.getValidLeft() + m_cache.getMargin(), 0,
+                 m_cache.getValidWidth(), image.height());
+    QRect target(x0, 0, x1 - x0, v->getPaintHeight());
+    
+    paint.save();
+    paint.setClipRect(rect, Qt::IntersectClip);
+    if (target.size() != source.size()) {
+        paint.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    }
+    paint.drawImage(target, image, source);
+    paint.restore();
+}
+
+bool
+Colour3DPlotRenderer::useAsynchronousRender(RenderType renderType,
+                                            bool timeConstrained) const
+{
+    return m_params.asynchronous &&
+        timeConstrained &&
+        renderType == DrawBufferPixelResolution &&
+        m_params.binDisplay != BinDisplay::PeakFrequencies;
+}
+
+void
+Colour3DPlotRenderer::queueAsyncRender(const LayerGeometryProvider *v,
+                                       int x0, int repaintWidth,
+                                       bool rightToLeft, bool urgent)
+{
+    const DenseThreeDimensionalModel *model = m_sources.source;
+    if (!model || !model->isOK() || !model->isReady()) {
+        throw std::logic_error("no source model provided, or model not ready");
+    }
+
+    if (repaintWidth <= 0) {
+        return;
+    }
+    
+    int zoomLevel = v->getZoomLevel();
+    int h = v->getPaintHeight();
+    int w = v->getPaintWidth();
+    int margin = m_cache.getMargin();
+
+    // pixel index, counted from frame 0, of view x coordinate 0
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+
+    sv_frame_t left = origin + x0;
+    sv_frame_t right = left + repaintWidth;
+
+    {
+        QMutexLocker locker(&m_asyncMutex);
+
+        if (m_asyncBusy &&
+            m_asyncBusyZoomLevel == zoomLevel &&
+            m_asyncBusyHeight == h &&
+            m_asyncBusyLeft <= left && m_asyncBusyRight >= right) {
+            // already being rendered
+            return;
+        }
+
+        for (auto itr = m_asyncJobs.begin(); itr != m_asyncJobs.end(); ) {
+
+            sv_frame_t jobLeft = itr->pixelLeft;
+            sv_frame_t jobRight = jobLeft + sv_frame_t(itr->binforx.size());
+
+            if (itr->zoomLevel == zoomLevel && itr->height == h &&
+                jobLeft <= left && jobRight >= right) {
+                // already queued
+                return;
+            }
+
+            if (jobRight <= origin - margin || jobLeft >= origin + w + margin) {
+                // scrolled out of reach since it was queued
+                itr = m_asyncJobs.erase(itr);
+            } else {
+                ++itr;
+            }
+        }
+    }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "queueAsyncRender: x0 " << x0 << ", width " << repaintWidth
+            << " (pixels " << left << " -> " << right << "), rightToLeft "
+            << rightToLeft << ", urgent " << urgent << endl;
+#endif
+    
+    AsyncJob job;
+    job.generation = m_asyncGeneration;
+    job.zoomLevel = zoomLevel;
+    job.height = h;
+    job.pixelLeft = left;
+    job.rightToLeft = rightToLeft;
+    job.colourScale = m_colourScale;
+    job.palette = m_colourScale.getPalette(m_params.colourRotation);
+
+    getPixelResolutionBins(v, x0, repaintWidth, h, job.binforx, job.binfory);
+
+    int peakCacheIndex = -1;
+    int binsPerPeak = -1;
+    getPreferredPeakCache(v, peakCacheIndex, binsPerPeak);
+
+    initColumnContext(job.context, repaintWidth, h,
+                      job.binforx, job.binfory, peakCacheIndex);
+    job.context.generation = job.generation;
+
+    QMutexLocker locker(&m_asyncMutex);
+
+    if (urgent) {
+        m_asyncJobs.push_front(job);
+    } else {
+        m_asyncJobs.push_back(job);
+    }
+
+    if (!m_asyncThread) {
+        m_asyncThread = new std::thread([this]() { asyncRenderLoop(); });
+    }
+    
+    m_asyncCondition.wakeAll();
+}
+
+void
+Colour3DPlotRenderer::integrateAsyncResults(const LayerGeometryProvider *v)
+{
+    deque<AsyncResult> results;
+
+    {
+        QMutexLocker locker(&m_asyncMutex);
+        if (m_asyncResults.empty()) {
+            return;
+        }
+        results.swap(m_asyncResults);
+    }
+
+    int zoomLevel = v->getZoomLevel();
+    int w = m_cache.getSize().width();
+    int h = m_cache.getSize().height();
+    int margin = m_cache.getMargin();
+
+    // pixel index, counted from frame 0, of cache x coordinate 0
+    // (the cache has not necessarily been scrolled to the view yet)
+    sv_frame_t origin = sv_frame_t(v->getXForFrame(m_cache.getStartFrame()))
+        - sv_frame_t(v->getXForFrame(0));
+
+    for (const AsyncResult &result: results) {
+
+        if (result.zoomLevel != zoomLevel || result.image.height() != h) {
+            continue;
+        }
+
+        int width = result.image.width();
+
+        if (width > 20) {
+            m_secondsPerXPixel = result.secondsPerXPixel;
+            m_secondsPerXPixelValid = true;
+            updatePreviewStep();
+        }
+        
+        sv_frame_t resultLeft = result.pixelLeft - origin;
+        sv_frame_t left = std::max(resultLeft, sv_frame_t(-margin));
+        sv_frame_t right = std::min(resultLeft + width, sv_frame_t(w + margin));
+
+        if (right <= left) {
+            continue;
+        }
+
+        if (m_cache.isValid() &&
+            (right < m_cache.getValidLeft() ||
+             left > m_cache.getValidRight())) {
+            // would not be contiguous with what we have
+            continue;
+        }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+        SVDEBUG << "integrateAsyncResults: x " << left << " -> " << right
+                << endl;
+#endif
+        
+        int imageLeft = int(left - resultLeft);
+        
+        m_cache.drawImage(int(left), int(right - left),
+                          result.image,
+                          imageLeft, int(right - left));
+
+        for (int x = int(left); x < int(right); ++x) {
+            int ix = x - int(resultLeft);
+            const MagnitudeRange &range = result.ranges[ix];
+            if (range.isSet()) {
+                m_magCache.sampleColumn(x, range);
+            }
+            if (result.values.empty()) {
+                continue;
+            }
+            if (range.isSet()) {
+                m_valueCache.setColumn(x, result.values.data() + size_t(ix) * h);
+            } else {
+                m_valueCache.setColumnBlank(x);
+            }
+        }
+    }
+
+    if (m_cache.getStartFrame() == v->getStartFrame()) {
+        storeTiles(v);
+    }
+}
+
+void
+Colour3DPlotRenderer::discardAsyncWork()
+{
+    QMutexLocker locker(&m_asyncMutex);
+    ++m_asyncGeneration;
+    m_asyncJobs.clear();
+    m_asyncResults.clear();
+
+    // We don't wait for the worker: it checks the generation before
+    // every column and will drop its job on its own
+}
+
+void
+Colour3DPlotRenderer::asyncRenderLoop()
+{
+    while (true) {
+
+        AsyncJob job;
+        
+        {
+            QMutexLocker locker(&m_asyncMutex);
+            
+            while (!m_asyncExiting && m_asyncJobs.empty()) {
+                m_asyncCondition.wait(&m_asyncMutex);
+            }
+            if (m_asyncExiting) {
+                return;
+            }
+            
+            job = m_asyncJobs.front();
+            m_asyncJobs.pop_front();
+
+            m_asyncBusy = true;
+            m_asyncBusyZoomLevel = job.zoomLevel;
+            m_asyncBusyHeight = job.height;
+            m_asyncBusyLeft = job.pixelLeft;
+            m_asyncBusyRight = job.pixelLeft + sv_frame_t(job.binforx.size());
+        }
+
+        try {
+            renderAsyncJob(job);
+        } catch (const std::exception &e) {
+            SVCERR << "WARNING: Colour3DPlotRenderer: Background render failed: "
+                   << e.what() << endl;
+        }
+
+        {
+            QMutexLocker locker(&m_asyncMutex);
+            m_asyncBusy = false;
+        }
+
+        emit m_notifier->renderReady();
+    }
+}
+
+void
+Colour3DPlotRenderer::renderAsyncJob(AsyncJob &job)
+{
+    Profiler profiler("Colour3DPlotRenderer::renderAsyncJob");
+
+    // Columns per result: few enough that results arrive often
+    const int chunkWidth = 128;
+    
+    int w = int(job.binforx.size());
+    int h = job.height;
+
+    QImage image(w, h, QImage::Format_Indexed8);
+    image.setColorTable(job.palette);
+    image.fill(0);
+
+    vector<MagnitudeRange> ranges(w);
+
+    vector<float> values;
+    if (m_params.retainValues) {
+        values.resize(size_t(w) * h);
+    }
+
+    DrawBufferColumnContext &context = job.context;
+    context.binforx = &job.binforx;
+    context.binfory = &job.binfory;
+    context.colourScale = &job.colourScale;
+    context.lines.resize(h);
+    for (int y = 0; y < h; ++y) {
+        context.lines[y] = image.scanLine(y);
+    }
+    context.ranges = ranges.data();
+    context.values = (values.empty() ? 0 : values.data());
+
+    ColumnScratch scratch;
+    
+    int chunks = (w + chunkWidth - 1) / chunkWidth;
+
+    for (int i = 0; i < chunks; ++i) {
+
+        if (isCancelled(context)) {
+            return;
+        }
+
+        // Work outward from the end adjacent to the valid area
+        int chunk = (job.rightToLeft ? chunks - 1 - i : i);
+        int x0 = chunk * chunkWidth;
+        int x1 = std::min(w, x0 + chunkWidth);
+
+        int stripes = std::min(getRenderThreadCount(),
+                               (x1 - x0) / minStripeWidth);
+
+        RenderTimer timer(RenderTimer::NoTimeout);
+        
+        if (stripes > 1) {
+            renderDrawBufferParallel(context, x0, x1, stripes);
+        } else {
+            stripes = 1;
+            for (int x = x0; x < x1; ++x) {
+                if (isCancelled(context)) {
+                    return;
+                }
+                renderDrawBufferColumn(context, x, scratch);
+            }
+        }
+
+        if (isCancelled(context)) {
+            // and some columns may be incomplete
+            return;
+        }
+
+        AsyncResult result;
+        result.zoomLevel = job.zoomLevel;
+        result.pixelLeft = job.pixelLeft + x0;
+        result.image = image.copy(x0, 0, x1 - x0, h);
+        result.ranges = vector<MagnitudeRange>(ranges.begin() + x0,
+                                               ranges.begin() + x1);
+        if (!values.empty()) {
+            result.values = vector<float>(values.begin() + size_t(x0) * h,
+                                          values.begin() + size_t(x1) * h);
+        }
+        result.secondsPerXPixel = timer.secondsPerItem(x1 - x0);
+
+        {
+            QMutexLocker locker(&m_asyncMutex);
+            if (m_asyncGeneration != job.generation) {
+                return;
+            }
+            m_asyncResults.push_back(result);
+        }
+
+        emit m_notifier->renderReady();
+    }
+}
+
+void
+Colour3DPlotRenderer::renderPreview(const LayerGeometryProvider *v)
+{
+    // Render the whole view at low resolution, with one column for
+    // every m_previewStep pixels, each read from a single source
+    // column (or peak cache column). Preview columns are aligned to
+    // multiples of the step from frame 0 so that a preview remains
+    // usable, with only its edges missing, as the view scrolls.
+    
+    int zoomLevel = v->getZoomLevel();
+    int w = v->getPaintWidth();
+    int h = v->getPaintHeight();
+    int step = m_previewStep;
+
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+
+    if (!m_preview.isNull() &&
+        m_previewZoomLevel == zoomLevel &&
+        m_preview.height() == h &&
+        m_previewPixelLeft <= origin &&
+        m_previewPixelLeft + sv_frame_t(m_preview.width()) * m_previewPixelStep
+        >= origin + w) {
+        // existing preview still covers the view
+        return;
+    }
+
+    Profiler profiler("Colour3DPlotRenderer::renderPreview");
+    
+    sv_frame_t pixelLeft = origin - (((origin % step) + step) % step);
+    int columns = int((origin + w - pixelLeft + step - 1) / step);
+
+    if (columns <= 0 || h <= 0) {
+        return;
+    }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "renderPreview: step " << step << ", columns " << columns
+            << " from pixel " << pixelLeft << endl;
+#endif
+
+    vector<int> binforx;
+    vector<double> binfory;
+    getPixelResolutionBins(v, int(pixelLeft - origin), columns, h,
+                           binforx, binfory, step);
+
+    // Use the coarsest peak cache that each preview column covers
+    int peakCacheIndex = -1;
+    int binsPerPeak = -1;
+    getPreferredPeakCache(zoomLevel * step, peakCacheIndex, binsPerPeak);
+
+    QImage image(columns, h, QImage::Format_Indexed8);
+    image.setColorTable
+        (m_colourScale.getPalette(m_params.colourRotation));
+    image.fill(0);
+
+    vector<MagnitudeRange> ranges(columns);
+
+    DrawBufferColumnContext context;
+    initColumnContext(context, columns, h, binforx, binfory, peakCacheIndex);
+    context.sampled = true;
+    context.lines.resize(h);
+    for (int y = 0; y < h; ++y) {
+        context.lines[y] = image.scanLine(y);
+    }
+    context.ranges = ranges.data();
+
+    int stripes = std::min(getRenderThreadCount(), columns / minStripeWidth);
+
+    if (stripes > 1) {
+        renderDrawBufferParallel(context, 0, columns, stripes);
+    } else {
+        ColumnScratch scratch;
+        for (int x = 0; x < columns; ++x) {
+            renderDrawBufferColumn(context, x, scratch);
+        }
+    }
+
+    // The magnitude ranges are discarded: they would not be a fair
+    // record of the full-resolution columns
+
+    m_preview = image;
+    m_previewZoomLevel = zoomLevel;
+    m_previewPixelLeft = pixelLeft;
+    m_previewPixelStep = step;
+}
+
+bool
+Colour3DPlotRenderer::paintPreview(const LayerGeometryProvider *v,
+                                   QPainter &paint, QRect rect)
+{
+    if (m_preview.isNull() ||
+        m_previewZoomLevel != v->getZoomLevel() ||
+        m_preview.height() != v->getPaintHeight()) {
+        return false;
+    }
+
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+
+    sv_frame_t left = m_previewPixelLeft - origin;
+    sv_frame_t width = sv_frame_t(m_preview.width()) * m_previewPixelStep;
+
+    if (left > rect.x() || left + width < rect.x() + rect.width()) {
         return false;
-    } else {
-        return true;
     }
+
+    paint.save();
+    paint.setClipRect(rect, Qt::IntersectClip);
+    paint.setRenderHint(QPainter::SmoothPixmapTransform, true);
+    paint.drawImage(QRect(int(left), 0, int(width), m_preview.height()),
+                    m_preview);
+    paint.restore();
+
+    return true;
+}
+
+void
+Colour3DPlotRenderer::updatePreviewStep()
+{
+    // Aim for a preview of the whole view to take no more than this
+    const double budget = 0.05; // seconds
+
+    int w = m_cache.getSize().width();
+    double predicted = m_secondsPerXPixel * w;
+    int step = int(ceil(predicted / budget));
+
+    if (step > maxPreviewStep) step = maxPreviewStep;
+    if (step < 1) step = 1;
+    m_previewStep = step;
 }
 
 Colour3DPlotRenderer::RenderResult
@@ -95,6 +1333,9 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
 {
     RenderType renderType = decideRenderType(v);
 
+    CacheGovernor::getInstance()->touch(this);
+    m_lastUsed.start();
+
     if (timeConstrained) {
         if (renderType != DrawBufferPixelResolution) {
             // Rendering should be fast in bin-resolution and direct
@@ -127,16 +1368,17 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
 
     sv_frame_t startFrame = v->getStartFrame();
     
-    m_cache.resize(v->getPaintSize());
-    m_cache.setZoomLevel(v->getZoomLevel());
-
-    m_magCache.resize(v->getPaintSize().width());
-    m_magCache.setZoomLevel(v->getZoomLevel());
+    setCacheGeometry(v);
+    checkForModelGrowth(v);
     
     if (renderType == DirectTranslucent) {
         MagnitudeRange range = renderDirectTranslucent(v, paint, rect);
         return { rect, range };
     }
+
+    // Take in anything that has been rendered in the background since
+    // the last call
+    integrateAsyncResults(v);
     
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
     SVDEBUG << "cache start " << m_cache.getStartFrame()
@@ -164,7 +1406,8 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
             count.hit();
             
             // cache is valid for the complete requested area
-            paint.drawImage(rect, m_cache.getImage(), rect);
+            paint.drawImage(rect, m_cache.getImage(),
+                            rect.translated(m_cache.getMargin(), 0));
 
             MagnitudeRange range = m_magCache.getRange(x0, x1 - x0);
 
@@ -181,18 +1424,16 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
             // partially usable
             m_cache.scrollTo(v, startFrame);
             m_magCache.scrollTo(v, startFrame);
+            if (m_params.retainValues) {
+                m_valueCache.scrollTo(v, startFrame);
+            }
 
-            // if we are not time-constrained, then we want to paint
-            // the whole area in one go; we don't return a partial
-            // paint. To avoid providing the more complex logic to
-            // handle painting discontiguous areas, if the only valid
-            // part of cache is in the middle, just make the whole
-            // thing invalid and start again.
-            if (!timeConstrained) {
-                if (m_cache.getValidLeft() > x0 &&
-                    m_cache.getValidRight() < x1) {
-                    m_cache.invalidate();
-                }
+            // if all that remains valid is off-screen in a margin,
+            // keeping it would mean rendering the off-screen gap
+            // between it and the view before the view itself
+            if (m_cache.getValidRight() <= 0 ||
+                m_cache.getValidLeft() >= v->getPaintWidth()) {
+                m_cache.invalidate();
             }
         }
     } else {
@@ -200,6 +1441,54 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
         count.miss();
         m_cache.setStartFrame(startFrame);
         m_magCache.setStartFrame(startFrame);
+        if (m_params.retainValues) {
+            m_valueCache.setStartFrame(startFrame);
+        }
+    }
+
+    // Recover whatever we can from tiles stored when this zoom level
+    // was last displayed
+    restoreFromTiles(v, x0);
+
+    if (m_cache.isValid() &&
+        m_cache.getValidLeft() <= x0 &&
+        m_cache.getValidRight() >= x1) {
+
+        // cache is now valid for the complete requested area
+        paint.drawImage(rect, m_cache.getImage(),
+                        rect.translated(m_cache.getMargin(), 0));
+
+        MagnitudeRange range = m_magCache.getRange(x0, x1 - x0);
+
+        return { rect, range };
+    }
+    
+    // if we are not time-constrained, then we want to paint the whole
+    // area in one go; we don't return a partial paint. To avoid
+    // providing the more complex logic to handle painting
+    // discontiguous areas, if the only valid part of cache is in the
+    // middle, just make the whole thing invalid and start again.
+    if (!timeConstrained) {
+        if (m_cache.getValidLeft() > x0 &&
+            m_cache.getValidRight() < x1) {
+            m_cache.invalidate();
+        }
+    }
+
+    // If we are unlikely to fill most of the view in this pass, make
+    // sure there is a low-resolution preview to show in the rest
+    if (timeConstrained &&
+        renderType == DrawBufferPixelResolution &&
+        m_params.binDisplay != BinDisplay::PeakFrequencies) {
+        int w = v->getPaintWidth();
+        int validInView = 0;
+        if (m_cache.isValid()) {
+            validInView = std::max(0, (std::min(w, m_cache.getValidRight()) -
+                                       std::max(0, m_cache.getValidLeft())));
+        }
+        if (validInView < w / 2) {
+            renderPreview(v);
+        }
     }
 
     bool rightToLeft = false;
@@ -287,18 +1576,46 @@ Colour3DPlotRenderer::render(const LayerGeometryProvider *v,
 
         renderToCacheBinResolution(v, x0, x1 - x0);
 
+    } else if (useAsynchronousRender(renderType, timeConstrained)) {
+
+        queueAsyncRender(v, x0, x1 - x0, rightToLeft, true);
+        
     } else { // must be DrawBufferPixelResolution, handled DirectTranslucent earlier
 
         renderToCachePixelResolution(v, x0, x1 - x0, rightToLeft, timeConstrained);
     }
 
+    storeTiles(v);
+    
     QRect pr = rect & m_cache.getValidArea();
     paint.drawImage(pr.x(), pr.y(), m_cache.getImage(),
-                    pr.x(), pr.y(), pr.width(), pr.height());
+                    pr.x() + m_cache.getMargin(), pr.y(),
+                    pr.width(), pr.height());
 
-    if (!timeConstrained && (pr != rect)) {
-        SVCERR << "WARNING: failed to render entire requested rect "
-             << "even when not time-constrained" << endl;
+    if (pr != rect) {
+        
+        if (!timeConstrained) {
+            SVCERR << "WARNING: failed to render entire requested rect "
+                   << "even when not time-constrained" << endl;
+        }
+
+        // Fill the parts we haven't reached yet with whatever we have
+        // from another zoom level, until we do reach them
+        if (pr.isEmpty()) {
+            paintPlaceholder(v, paint, rect);
+        } else {
+            if (pr.x() > rect.x()) {
+                paintPlaceholder(v, paint,
+                                 QRect(rect.x(), rect.y(),
+                                       pr.x() - rect.x(), rect.height()));
+            }
+            if (pr.right() < rect.right()) {
+                paintPlaceholder(v, paint,
+                                 QRect(pr.right() + 1, rect.y(),
+                                       rect.right() - pr.right(),
+                                       rect.height()));
+            }
+        }
     }
 
     MagnitudeRange range = m_magCache.getRange(reqx0, reqx1 - reqx0);
@@ -358,32 +1675,429 @@ Colour3DPlotRenderer::getColumn(int sx, int minbin, int nbins,
     // get column -> scale -> normalise
 
     ColumnOp::Column column;
-                
-    if (m_params.colourScale.getScale() == ColourScaleType::Phase &&
-        m_sources.fft) {
+    fetchColumn(sx, minbin, nbins, peakCacheIndex, column);
+    scaleColumn(column);
+    return column;
+}
+
+void
+Colour3DPlotRenderer::fetchColumn(int sx, int minbin, int nbins,
+                                  int peakCacheIndex,
+                                  ColumnOp::Column &column) const
+{
+    // Read only the bins we are going to display, straight into the
+    // caller's column
+    
+    column.resize(nbins);
 
-        ColumnOp::Column fullColumn = m_sources.fft->getPhases(sx);
+    bool phase = (m_phase && m_sources.fft);
 
-        column = vector<float>(fullColumn.data() + minbin,
-                               fullColumn.data() + minbin + nbins);
+    // The peak caches and the compact cache are safe to read from any
+    // number of threads at once, and take the source mutex themselves
+    // only when they have to go to the source model for a column, so
+    // we can avoid serialising the cache hits here
+    
+    if (!phase && peakCacheIndex >= 0) {
+        m_sources.peakCaches[peakCacheIndex]->getColumnRange
+            (sx, minbin, nbins, column.data());
+        return;
+    }
 
+    if (!phase && m_sources.compactCache) {
+        m_sources.compactCache->getColumnRange(sx, minbin, nbins,
+                                               column.data());
+        return;
+    }
+    
+    QMutexLocker locker(getSourceMutex());
+        
+    if (phase) {
+        ColumnReader::getPhaseRange(m_sources.fft, sx, minbin, nbins,
+                                    column.data());
     } else {
+        ColumnReader::getColumnRange(m_sources.source, sx, minbin, nbins,
+                                     column.data());
+    }
+}
 
-        ColumnOp::Column fullColumn =
-            (peakCacheIndex >= 0 ?
-             m_sources.peakCaches[peakCacheIndex] :
-             m_sources.source)
-            ->getColumn(sx);
-                
-        column = vector<float>(fullColumn.data() + minbin,
-                               fullColumn.data() + minbin + nbins);
+// The shift and scale applied by ColumnOp::normalize for a column
+// with the given extents, for any normalisation but Sum1, which needs
+// the sum of the column as well
+static void
+getNormalizationForRange(float min, float max, ColumnNormalization norm,
+                         float &shift, float &scale)
+{
+    shift = 0.f;
+    scale = 1.f;
+
+    if (norm == ColumnNormalization::Range01) {
 
-        column = ColumnOp::applyGain(column, m_params.scaleFactor);
+        if (min != 0.f) {
+            shift = -min;
+            max -= min;
+        }
+        if (max != 0.f) {
+            scale = 1.f / max;
+        }
+        
+    } else if (norm == ColumnNormalization::Max1 ||
+               norm == ColumnNormalization::Hybrid) {
+
+        // L-infinity norm
+        float total = fabsf(min);
+        float v = fabsf(max);
+        total = (v > total ? v : total);
+        if (total != 0.f) {
+            scale = 1.f / total;
+        }
+        if (norm == ColumnNormalization::Hybrid && total > 0.f) {
+            scale *= log10f(total + 1.f);
+        }
+    }
+}
 
-        column = ColumnOp::normalize(column, m_params.normalization);
+// As ColumnOp::normalize, which this replaces so as not to allocate a
+// new column every time: the same shift and scale, applied in place
+static void
+normalizeInPlace(float *values, int n, ColumnNormalization norm)
+{
+    if (norm == ColumnNormalization::None || n == 0) {
+        return;
     }
+    
+    float shift = 0.f;
+    float scale = 1.f;
 
-    return column;
+    if (norm == ColumnNormalization::Sum1) {
+
+        // L1 norm
+        float total = 0.f;
+        for (int i = 0; i < n; ++i) {
+            total += fabsf(values[i]);
+        }
+        if (total != 0.f) {
+            scale = 1.f / total;
+        }
+        
+    } else {
+
+        float min = values[0], max = values[0];
+        for (int i = 1; i < n; ++i) {
+            min = (values[i] < min ? values[i] : min);
+            max = (values[i] > max ? values[i] : max);
+        }
+        getNormalizationForRange(min, max, norm, shift, scale);
+    }
+
+    if (shift == 0.f && scale == 1.f) {
+        return;
+    }
+    
+    for (int i = 0; i < n; ++i) {
+        values[i] = (values[i] + shift) * scale;
+    }
+}
+
+MagnitudeRange
+Colour3DPlotRenderer::scaleColumn(ColumnOp::Column &column) const
+{
+    int n = int(column.size());
+    if (n == 0) {
+        return MagnitudeRange();
+    }
+    
+    if (!m_phase || !m_sources.fft) {
+
+        float gain = float(m_params.scaleFactor);
+        if (gain != 1.f) {
+            float *values = column.data();
+            for (int i = 0; i < n; ++i) {
+                values[i] *= gain;
+            }
+        }
+
+        if (m_params.normalization != ColumnNormalization::None) {
+            normalizeInPlace(column.data(), n, m_params.normalization);
+        }
+    }
+
+    const float *values = column.data();
+    float min = values[0], max = values[0];
+    for (int i = 1; i < n; ++i) {
+        min = (values[i] < min ? values[i] : min);
+        max = (values[i] > max ? values[i] : max);
+    }
+    
+    return MagnitudeRange(min, max);
+}
+
+MagnitudeRange
+Colour3DPlotRenderer::prepareColumn(const DrawBufferColumnContext &context,
+                                    int sx, ColumnScratch &scratch) const
+{
+    // order:
+    // get column -> scale -> normalise -> record extents ->
+    // peak pick -> distribute/interpolate -> apply display gain
+
+    // The first four happen in fetchColumn and scaleColumn, in
+    // place. Peak picking is then folded into distribution, which
+    // takes a single pass over the pixel rows reading each bin at
+    // most once (or twice when interpolating). Display gain belongs
+    // to the colour scale and is applied by the colour scale object
+    // when mapping.
+    
+    if (context.reductionLevel > 0) {
+        return prepareReducedColumn(context, sx, scratch);
+    }
+    
+    fetchColumn(sx, context.minbin, context.nbins, context.peakCacheIndex,
+                scratch.source);
+    
+    MagnitudeRange range = scaleColumn(scratch.source);
+
+    const ColumnOp::Column &column = scratch.source;
+    const float *in = column.data();
+    int bins = int(column.size());
+
+    int h = context.h;
+    const vector<double> &binfory = *context.binfory;
+    double minbin = context.minbin;
+    
+    scratch.prepared.resize(h);
+    float *out = scratch.prepared.data();
+
+    if (bins == 0) {
+        std::fill(out, out + h, 0.f);
+        return range;
+    }
+    
+    bool peaks = (m_params.binDisplay == BinDisplay::PeakBins);
+
+    if (m_params.interpolate && h > bins) {
+
+        for (int y = 0; y < h; ++y) {
+
+            double sy = binfory[y] - minbin - 0.5;
+            double syf = floor(sy);
+
+            int mainbin = int(syf);
+            int other = mainbin;
+            if (sy > syf) {
+                other = mainbin + 1;
+            } else if (sy < syf) {
+                other = mainbin - 1;
+            }
+
+            if (mainbin < 0) mainbin = 0;
+            if (mainbin >= bins) mainbin = bins - 1;
+            if (other < 0) other = 0;
+            if (other >= bins) other = bins - 1;
+
+            double prop = 1.0 - fabs(sy - syf);
+
+            double v0 = in[mainbin];
+            double v1 = in[other];
+            if (peaks) {
+                if (!ColumnOp::isPeak(column, mainbin)) v0 = 0.0;
+                if (!ColumnOp::isPeak(column, other)) v1 = 0.0;
+            }
+
+            out[y] = float(prop * v0 + (1.0 - prop) * v1);
+        }
+
+        return range;
+    }
+
+    for (int y = 0; y < h; ++y) {
+
+        int by0 = int(binfory[y] - minbin + 0.0001);
+        int by1 = by0 + 1;
+        if (y + 1 < h) {
+            by1 = int(binfory[y+1] - minbin + 0.0001);
+            if (by1 <= by0) by1 = by0 + 1;
+        }
+        if (by0 < 0) by0 = 0;
+        // As ColumnOp::distribute, which this replaces: the range
+        // stops short of the top bin, which is therefore never shown
+        if (by1 >= bins) by1 = bins - 1;
+
+        if (by0 >= by1) {
+            out[y] = 0.f;
+            continue;
+        }
+
+        float value;
+
+        if (peaks) {
+            value = (ColumnOp::isPeak(column, by0) ? in[by0] : 0.f);
+            for (int bin = by0 + 1; bin < by1; ++bin) {
+                float v = (ColumnOp::isPeak(column, bin) ? in[bin] : 0.f);
+                value = (v > value ? v : value);
+            }
+        } else {
+            value = in[by0];
+            for (int bin = by0 + 1; bin < by1; ++bin) {
+                value = (in[bin] > value ? in[bin] : value);
+            }
+        }
+
+        out[y] = value;
+    }
+
+    return range;
+}
+
+MagnitudeRange
+Colour3DPlotRenderer::prepareReducedColumn(const DrawBufferColumnContext &context,
+                                           int sx, ColumnScratch &scratch) const
+{
+    int level = context.reductionLevel;
+    int bins = context.nbins;
+    int size = 1 << level;
+    MagnitudeRange range;
+
+    BinReductionCache *reductions = 0;
+    int rix = context.peakCacheIndex + 1;
+    if (in_range_for(m_sources.binReductions, rix)) {
+        reductions = m_sources.binReductions[rix];
+    }
+
+    // The stored reductions can stand in for the column only if the
+    // gain and normalisation preserve the order of values and can be
+    // worked out from the extents of the column alone
+    bool phase = (m_phase && m_sources.fft);
+    if (phase ||
+        m_params.scaleFactor < 0.0 ||
+        m_params.normalization == ColumnNormalization::Sum1) {
+        reductions = 0;
+    }
+
+    // Groups are counted from bin 0 in the stored reductions, but
+    // from minbin in a column reduced here
+    int offset = 0;
+    
+    if (!reductions) {
+        
+        fetchColumn(sx, context.minbin, bins, context.peakCacheIndex,
+                    scratch.source);
+        range = scaleColumn(scratch.source);
+        BinReductionCache::reduce(scratch.source.data(),
+                                  int(scratch.source.size()), level,
+                                  scratch.reduced);
+
+    } else {
+
+        int b0 = context.minbin;
+        int b1 = b0 + bins;
+        int first = b0 >> level;
+        int count = ((b1 - 1) >> level) - first + 1;
+        offset = b0 - (first << level);
+        
+        scratch.reduced.resize(count);
+        scratch.reducedMin.resize(count);
+        float *maxima = scratch.reduced.data();
+        float *minima = scratch.reducedMin.data();
+        reductions->getGroupRange(sx, level, first, count, maxima, minima);
+
+        // The extents of the displayed bins, as recorded for an
+        // unreduced column: the groups lying wholly within them give
+        // theirs, and the few bins of a group straddling either end
+        // are read individually
+        
+        int full0 = (b0 + size - 1) >> level;
+        int full1 = b1 >> level; // one past the last whole group
+        int head1 = b1, tail0 = b1;
+        if (full0 < full1) {
+            head1 = full0 << level;
+            tail0 = full1 << level;
+        }
+
+        bool have = false;
+        float lo = 0.f, hi = 0.f;
+        
+        for (int g = full0; g < full1; ++g) {
+            float gmax = maxima[g - first], gmin = minima[g - first];
+            if (!have || gmax > hi) hi = gmax;
+            if (!have || gmin < lo) lo = gmin;
+            have = true;
+        }
+
+        int edges[2][2] = { { b0, head1 }, { tail0, b1 } };
+        for (auto &e: edges) {
+            if (e[1] <= e[0]) continue;
+            fetchColumn(sx, e[0], e[1] - e[0], context.peakCacheIndex,
+                        scratch.source);
+            for (float v: scratch.source) {
+                if (!have || v > hi) hi = v;
+                if (!have || v < lo) lo = v;
+                have = true;
+            }
+        }
+
+        // Then the gain and normalisation, as scaleColumn would apply
+        // them to every bin
+        
+        float gain = float(m_params.scaleFactor);
+        lo *= gain;
+        hi *= gain;
+        
+        float shift = 0.f, scale = 1.f;
+        if (m_params.normalization != ColumnNormalization::None) {
+            getNormalizationForRange(lo, hi, m_params.normalization,
+                                     shift, scale);
+        }
+
+        for (int i = 0; i < count; ++i) {
+            maxima[i] = (maxima[i] * gain + shift) * scale;
+        }
+        
+        range = MagnitudeRange((lo + shift) * scale, (hi + shift) * scale);
+    }
+
+    const float *in = scratch.reduced.data();
+    int groups = int(scratch.reduced.size());
+    
+    int h = context.h;
+    const vector<double> &binfory = *context.binfory;
+    double minbin = context.minbin;
+    
+    scratch.prepared.resize(h);
+    float *out = scratch.prepared.data();
+
+    if (groups == 0) {
+        std::fill(out, out + h, 0.f);
+        return range;
+    }
+    
+    for (int y = 0; y < h; ++y) {
+
+        int by0 = int(binfory[y] - minbin + 0.0001);
+        int by1 = by0 + 1;
+        if (y + 1 < h) {
+            by1 = int(binfory[y+1] - minbin + 0.0001);
+            if (by1 <= by0) by1 = by0 + 1;
+        }
+        if (by0 < 0) by0 = 0;
+        if (by1 >= bins) by1 = bins - 1; // as in prepareColumn
+
+        if (by0 >= by1) {
+            out[y] = 0.f;
+            continue;
+        }
+
+        int g0 = (offset + by0) >> level;
+        int g1 = (offset + by1 - 1) >> level;
+        if (g1 >= groups) g1 = groups - 1;
+        
+        float value = in[g0];
+        for (int g = g0 + 1; g <= g1; ++g) {
+            value = (in[g] > value ? in[g] : value);
+        }
+
+        out[y] = value;
+    }
+
+    return range;
 }
 
 MagnitudeRange
@@ -451,8 +2165,11 @@ Colour3DPlotRenderer::renderDirectTranslucent(const LayerGeometryProvider *v,
 
             // this does the first three:
             preparedColumn = getColumn(sx, minbin, nbins, -1);
-            
-            magRange.sample(preparedColumn);
+
+            MagnitudeRange columnRange;
+            columnRange.sample(preparedColumn);
+            recordColumnRange(sx, 1, columnRange);
+            magRange.sample(columnRange);
 
             if (m_params.binDisplay == BinDisplay::PeakBins) {
                 preparedColumn = ColumnOp::peakPick(preparedColumn);
@@ -491,7 +2208,7 @@ Colour3DPlotRenderer::renderDirectTranslucent(const LayerGeometryProvider *v,
             QRect r(rx0, ry1, rw, ry0 - ry1);
 
             float value = preparedColumn[sy - minbin];
-            QColor colour = m_params.colourScale.getColour(value,
+            QColor colour = m_colourScale.getColour(value,
                                                            m_params.colourRotation);
 
             if (rw == 1) {
@@ -546,6 +2263,14 @@ void
 Colour3DPlotRenderer::getPreferredPeakCache(const LayerGeometryProvider *v,
                                             int &peakCacheIndex,
                                             int &binsPerPeak) const
+{
+    getPreferredPeakCache(v->getZoomLevel(), peakCacheIndex, binsPerPeak);
+}
+
+void
+Colour3DPlotRenderer::getPreferredPeakCache(int zoomLevel,
+                                            int &peakCacheIndex,
+                                            int &binsPerPeak) const
 {
     peakCacheIndex = -1;
     binsPerPeak = -1;
@@ -553,32 +2278,149 @@ Colour3DPlotRenderer::getPreferredPeakCache(const LayerGeometryProvider *v,
     const DenseThreeDimensionalModel *model = m_sources.source;
     if (!model) return;
     if (m_params.binDisplay == BinDisplay::PeakFrequencies) return;
-    if (m_params.colourScale.getScale() == ColourScaleType::Phase) return;
+    if (m_phase) return;
+    
+    int binResolution = model->getResolution();
+    
+    for (int ix = 0; in_range_for(m_sources.peakCaches, ix); ++ix) {
+        int bpp = getPeakCacheDivisor(ix);
+        int equivZoom = binResolution * bpp;
+        if (zoomLevel >= equivZoom) {
+            // this peak cache would work, though it might not be best
+            if (bpp > binsPerPeak) {
+                // ok, it's better than the best one we've found so far
+                peakCacheIndex = ix;
+                binsPerPeak = bpp;
+            }
+        }
+    }
+
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "getPreferredPeakCache: zoomLevel = " << zoomLevel
+            << ", binResolution " << binResolution 
+            << ", binsPerPeak " << binsPerPeak
+            << ", peakCacheIndex " << peakCacheIndex
+            << ", peakCaches " << m_sources.peakCaches.size()
+            << endl;
+#endif
+}
+
+int
+Colour3DPlotRenderer::getPeakCacheDivisor(int peakCacheIndex) const
+{
+    return m_sources.peakCaches[peakCacheIndex]->getResolution() /
+        m_sources.source->getResolution();
+}
+
+void
+Colour3DPlotRenderer::getPixelResolutionBins(const LayerGeometryProvider *v,
+                                             int x0, int repaintWidth, int h,
+                                             vector<int> &binforx,
+                                             vector<double> &binfory,
+                                             int step) const
+{
+    getBinForXTable(v, x0, repaintWidth, step, binforx);
+    getBinForYTable(v, h, binfory);
+}
+
+void
+Colour3DPlotRenderer::getBinForYTable(const LayerGeometryProvider *v, int h,
+                                      vector<double> &binfory) const
+{
+    static HitCount count("Colour3DPlotRenderer: binfory tables");
+
+    if (h <= 0) {
+        binfory.clear();
+        return;
+    }
+    
+    const VerticalBinLayer *layer = m_sources.verticalBinLayer;
+    
+    if (int(m_binforyMemo.size()) == h &&
+        m_binforyMemo[0] == layer->getBinForY(v, h - 1) &&
+        m_binforyMemo[h-1] == layer->getBinForY(v, 0)) {
+        count.hit();
+    } else {
+        count.miss();
+        m_binforyMemo.resize(h);
+        for (int y = 0; y < h; ++y) {
+            m_binforyMemo[y] = layer->getBinForY(v, h - y - 1);
+        }
+    }
+
+    binfory = m_binforyMemo;
+}
+
+void
+Colour3DPlotRenderer::getBinForXTable(const LayerGeometryProvider *v,
+                                      int x0, int repaintWidth, int step,
+                                      vector<int> &binforx) const
+{
+    static HitCount count("Colour3DPlotRenderer: binforx tables");
+    
+    const DenseThreeDimensionalModel *model = m_sources.source;
+    sv_frame_t modelStart = model->getStartFrame();
+    int binResolution = model->getResolution();
     
+    binforx.resize(repaintWidth);
+    
+    auto binForX = [&](int x) {
+        sv_frame_t f0 = v->getFrameForX(x);
+        double s0 = double(f0 - modelStart) / binResolution;
+        return int(s0 + 0.0001);
+    };
+
     int zoomLevel = v->getZoomLevel();
-    int binResolution = model->getResolution();
+
+    // The table is indexed by global pixel, which identifies the
+    // same frame for as long as the zoom level is unchanged only if
+    // the view's start frame is aligned to a pixel boundary. Preview
+    // renders use every step'th pixel and are not worth memoising.
     
-    for (int ix = 0; in_range_for(m_sources.peakCaches, ix); ++ix) {
-        int bpp = m_sources.peakCaches[ix]->getColumnsPerPeak();
-        int equivZoom = binResolution * bpp;
-        if (zoomLevel >= equivZoom) {
-            // this peak cache would work, though it might not be best
-            if (bpp > binsPerPeak) {
-                // ok, it's better than the best one we've found so far
-                peakCacheIndex = ix;
-                binsPerPeak = bpp;
+    if (step != 1 || v->getStartFrame() % zoomLevel != 0) {
+        for (int x = 0; x < repaintWidth; ++x) {
+            binforx[x] = binForX(x0 + x * step);
+        }
+        return;
+    }
+
+    sv_frame_t origin = -sv_frame_t(v->getXForFrame(0));
+    sv_frame_t left = origin + x0;
+    sv_frame_t right = left + repaintWidth;
+
+    sv_frame_t memoLeft = m_binforxMemoLeft;
+    sv_frame_t memoRight = memoLeft + sv_frame_t(m_binforxMemo.size());
+
+    if (m_binforxMemo.empty() ||
+        m_binforxMemoZoomLevel != zoomLevel ||
+        m_binforxMemoModelStart != modelStart ||
+        max(right, memoRight) - min(left, memoLeft) > maxBinforxMemoWidth) {
+        m_binforxMemo.clear();
+        m_binforxMemoZoomLevel = zoomLevel;
+        m_binforxMemoModelStart = modelStart;
+        memoLeft = memoRight = left;
+    }
+
+    if (left >= memoLeft && right <= memoRight) {
+        count.hit();
+    } else {
+        count.miss();
+        sv_frame_t newLeft = min(left, memoLeft);
+        sv_frame_t newRight = max(right, memoRight);
+        vector<int> memo(newRight - newLeft);
+        for (sv_frame_t p = newLeft; p < newRight; ++p) {
+            if (p >= memoLeft && p < memoRight) {
+                memo[p - newLeft] = m_binforxMemo[p - memoLeft];
+            } else {
+                memo[p - newLeft] = binForX(int(p - origin));
             }
         }
+        m_binforxMemo = memo;
+        m_binforxMemoLeft = newLeft;
     }
 
-#ifdef DEBUG_COLOUR_PLOT_REPAINT
-    SVDEBUG << "getPreferredPeakCache: zoomLevel = " << zoomLevel
-            << ", binResolution " << binResolution 
-            << ", binsPerPeak " << binsPerPeak
-            << ", peakCacheIndex " << peakCacheIndex
-            << ", peakCaches " << m_sources.peakCaches.size()
-            << endl;
-#endif
+    const int *from = m_binforxMemo.data() + (left - m_binforxMemoLeft);
+    std::copy(from, from + repaintWidth, binforx.begin());
 }
 
 void
@@ -605,25 +2447,24 @@ Colour3DPlotRenderer::renderToCachePixelResolution(const LayerGeometryProvider *
 
     clearDrawBuffer(repaintWidth, h);
 
-    vector<int> binforx(repaintWidth);
-    vector<double> binfory(h);
-    
-    int binResolution = model->getResolution();
-
-    for (int x = 0; x < repaintWidth; ++x) {
-        sv_frame_t f0 = v->getFrameForX(x0 + x);
-        double s0 = double(f0 - model->getStartFrame()) / binResolution;
-        binforx[x] = int(s0 + 0.0001);
+    bool retain = (m_params.retainValues &&
+                   m_params.binDisplay != BinDisplay::PeakFrequencies);
+    if (retain) {
+        // no need to clear: only columns that are rendered are read
+        m_drawValues.resize(size_t(repaintWidth) * h);
+    } else {
+        m_drawValues.clear();
     }
 
+    vector<int> binforx;
+    vector<double> binfory;
+
+    getPixelResolutionBins(v, x0, repaintWidth, h, binforx, binfory);
+    
     int peakCacheIndex = -1;
     int binsPerPeak = -1;
 
     getPreferredPeakCache(v, peakCacheIndex, binsPerPeak);
-    
-    for (int y = 0; y < h; ++y) {
-        binfory[y] = m_sources.verticalBinLayer->getBinForY(v, h - y - 1);
-    }
 
     int attainedWidth;
 
@@ -659,8 +2500,23 @@ Colour3DPlotRenderer::renderToCachePixelResolution(const LayerGeometryProvider *
                       m_drawBuffer,
                       paintedLeft - x0, attainedWidth);
 
-    for (int i = 0; in_range_for(m_magRanges, i); ++i) {
-        m_magCache.sampleColumn(i, m_magRanges.at(i));
+    for (int i = 0; i < attainedWidth; ++i) {
+        int x = paintedLeft - x0 + i;
+        bool set = (in_range_for(m_magRanges, x) && m_magRanges[x].isSet());
+        if (set) {
+            m_magCache.sampleColumn(paintedLeft + i, m_magRanges[x]);
+        }
+        if (!m_params.retainValues) {
+            continue;
+        }
+        if (!retain) {
+            m_valueCache.unsetColumn(paintedLeft + i);
+        } else if (set) {
+            m_valueCache.setColumn(paintedLeft + i,
+                                   m_drawValues.data() + size_t(x) * h);
+        } else {
+            m_valueCache.setColumnBlank(paintedLeft + i);
+        }
     }
 }
 
@@ -690,6 +2546,10 @@ Colour3DPlotRenderer::scaleDrawBufferImage(QImage image,
         throw std::logic_error("Colour3DPlotRenderer::scaleDrawBufferImage: Target image is empty");
     }        
 
+    if (m_cache.isIndexed()) {
+        return scaleIndexedImage(image, targetWidth, targetHeight);
+    }
+    
     // This function exists because of some unpredictable behaviour
     // from Qt when scaling images with FastTransformation mode. We
     // continue to use Qt's scaler for SmoothTransformation but let's
@@ -724,6 +2584,73 @@ Colour3DPlotRenderer::scaleDrawBufferImage(QImage image,
     return target;
 }
 
+QImage
+Colour3DPlotRenderer::scaleIndexedImage(QImage image,
+                                        int targetWidth,
+                                        int targetHeight) const
+{
+    // As scaleDrawBufferImage, but producing an indexed image to go
+    // into an indexed cache. When interpolating, we interpolate
+    // bilinearly between pixel indices, sampling at pixel centres as
+    // Qt's smooth scaling does. Because indices increase with value,
+    // this approximates interpolating the underlying values.
+    
+    int sourceWidth = image.width();
+    int sourceHeight = image.height();
+
+    QImage target(targetWidth, targetHeight, QImage::Format_Indexed8);
+    target.setColorTable(image.colorTable());
+
+    if (!m_params.interpolate) {
+        for (int y = 0; y < targetHeight; ++y) {
+            uchar *targetLine = target.scanLine(y);
+            int sy = int((uint64_t(y) * sourceHeight) / targetHeight);
+            if (sy == sourceHeight) --sy;
+            const uchar *sourceLine = image.constScanLine(sy);
+            for (int x = 0; x < targetWidth; ++x) {
+                int sx = int((uint64_t(x) * sourceWidth) / targetWidth);
+                if (sx == sourceWidth) --sx;
+                targetLine[x] = sourceLine[sx];
+            }
+        }
+        return target;
+    }
+
+    vector<int> sx0(targetWidth), sx1(targetWidth);
+    vector<double> px(targetWidth);
+    
+    for (int x = 0; x < targetWidth; ++x) {
+        double sx = ((x + 0.5) * sourceWidth) / targetWidth - 0.5;
+        if (sx < 0.0) sx = 0.0;
+        if (sx > sourceWidth - 1) sx = sourceWidth - 1;
+        sx0[x] = int(sx);
+        sx1[x] = std::min(sx0[x] + 1, sourceWidth - 1);
+        px[x] = sx - sx0[x];
+    }
+    
+    for (int y = 0; y < targetHeight; ++y) {
+
+        double sy = ((y + 0.5) * sourceHeight) / targetHeight - 0.5;
+        if (sy < 0.0) sy = 0.0;
+        if (sy > sourceHeight - 1) sy = sourceHeight - 1;
+        int sy0 = int(sy);
+        int sy1 = std::min(sy0 + 1, sourceHeight - 1);
+        double py = sy - sy0;
+        
+        const uchar *line0 = image.constScanLine(sy0);
+        const uchar *line1 = image.constScanLine(sy1);
+        uchar *targetLine = target.scanLine(y);
+        
+        for (int x = 0; x < targetWidth; ++x) {
+            double top = line0[sx0[x]] + px[x] * (line0[sx1[x]] - line0[sx0[x]]);
+            double bottom = line1[sx0[x]] + px[x] * (line1[sx1[x]] - line1[sx0[x]]);
+            targetLine[x] = uchar(top + py * (bottom - top) + 0.5);
+        }
+    }
+
+    return target;
+}
+
 void
 Colour3DPlotRenderer::renderToCacheBinResolution(const LayerGeometryProvider *v,
                                                  int x0, int repaintWidth)
@@ -789,8 +2716,11 @@ Colour3DPlotRenderer::renderToCacheBinResolution(const LayerGeometryProvider *v,
     
     recreateDrawBuffer(drawBufferWidth, h);
 
+    // values are not retained for columns that are scaled up
+    m_drawValues.clear();
+
     vector<int> binforx(drawBufferWidth);
-    vector<double> binfory(h);
+    vector<double> binfory;
     
     for (int x = 0; x < drawBufferWidth; ++x) {
         binforx[x] = int(leftBoundaryFrame / binResolution) + x;
@@ -799,10 +2729,8 @@ Colour3DPlotRenderer::renderToCacheBinResolution(const LayerGeometryProvider *v,
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
     SVDEBUG << "[BIN] binResolution " << binResolution << endl;
 #endif
-    
-    for (int y = 0; y < h; ++y) {
-        binfory[y] = m_sources.verticalBinLayer->getBinForY(v, h - y - 1);
-    }
+
+    getBinForYTable(v, h, binfory);
 
     int attainedWidth = renderDrawBuffer(drawBufferWidth,
                                          h,
@@ -829,14 +2757,16 @@ Colour3DPlotRenderer::renderToCacheBinResolution(const LayerGeometryProvider *v,
     int scaledLeftCrop = v->getXForFrame(leftCropFrame);
     int scaledRightCrop = v->getXForFrame(rightCropFrame);
     
+    int margin = m_cache.getMargin();
+    
     int targetLeft = scaledLeftCrop;
-    if (targetLeft < 0) {
-        targetLeft = 0;
+    if (targetLeft < -margin) {
+        targetLeft = -margin;
     }
     
     int targetWidth = scaledRightCrop - targetLeft;
-    if (targetLeft + targetWidth > m_cache.getSize().width()) {
-        targetWidth = m_cache.getSize().width() - targetLeft;
+    if (targetLeft + targetWidth > m_cache.getSize().width() + margin) {
+        targetWidth = m_cache.getSize().width() + margin - targetLeft;
     }
     
     int sourceLeft = targetLeft - scaledLeft;
@@ -861,8 +2791,12 @@ Colour3DPlotRenderer::renderToCacheBinResolution(const LayerGeometryProvider *v,
         // but the mag range vector has not been scaled
         int sourceIx = int((double(i + sourceLeft) / scaled.width())
                            * int(m_magRanges.size()));
-        if (in_range_for(m_magRanges, sourceIx)) {
-            m_magCache.sampleColumn(i, m_magRanges.at(sourceIx));
+        if (in_range_for(m_magRanges, sourceIx) &&
+            m_magRanges[sourceIx].isSet()) {
+            m_magCache.sampleColumn(targetLeft + i, m_magRanges[sourceIx]);
+        }
+        if (m_params.retainValues) {
+            m_valueCache.unsetColumn(targetLeft + i);
         }
     }
 }
@@ -884,18 +2818,11 @@ Colour3DPlotRenderer::renderDrawBuffer(int w, int h,
                       RenderTimer::NoTimeout);
 
     Profiler profiler("Colour3DPlotRenderer::renderDrawBuffer");
-    
-    int divisor = 1;
-    const DenseThreeDimensionalModel *sourceModel = m_sources.source;
-    if (peakCacheIndex >= 0) {
-        divisor = m_sources.peakCaches[peakCacheIndex]->getColumnsPerPeak();
-        sourceModel = m_sources.peakCaches[peakCacheIndex];
-    }
 
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
     SVDEBUG << "renderDrawBuffer: w = " << w << ", h = " << h
-            << ", peakCacheIndex = " << peakCacheIndex << " (divisor = "
-            << divisor << "), rightToLeft = " << rightToLeft
+            << ", peakCacheIndex = " << peakCacheIndex
+            << ", rightToLeft = " << rightToLeft
             << ", timeConstrained = " << timeConstrained << endl;
     SVDEBUG << "renderDrawBuffer: normalization = " << int(m_params.normalization)
             << ", binDisplay = " << int(m_params.binDisplay)
@@ -903,23 +2830,50 @@ Colour3DPlotRenderer::renderDrawBuffer(int w, int h,
             << ", alwaysOpaque = " << m_params.alwaysOpaque
             << ", interpolate = " << m_params.interpolate << endl;
 #endif
+
+    DrawBufferColumnContext context;
+    initColumnContext(context, w, h, binforx, binfory, peakCacheIndex);
     
-    int sh = sourceModel->getHeight();
+    // Obtain the scanlines up front, so that columns can be written
+    // without going back to the QImage (which is not safe to do from
+    // more than one thread at once)
+    context.lines.resize(h);
+    for (int y = 0; y < h; ++y) {
+        context.lines[y] = m_drawBuffer.scanLine(y);
+    }
+    context.ranges = m_magRanges.data();
+    context.values = (m_drawValues.empty() ? 0 : m_drawValues.data());
     
-    int minbin = int(binfory[0] + 0.0001);
-    if (minbin >= sh) minbin = sh - 1;
-    if (minbin < 0) minbin = 0;
-
-    int nbins  = int(binfory[h-1] + 0.0001) - minbin + 1;
-    if (minbin + nbins > sh) nbins = sh - minbin;
-
+    int stripes = std::min(getRenderThreadCount(), w / minStripeWidth);
+    
+    if (stripes > 1) {
+
+        // Render in parallel, in chunks if time-constrained so as to
+        // be able to check the time between them. The chunks work
+        // inward from the edge that the serial loop below would
+        // start at.
+
+        int chunkWidth = (timeConstrained ? stripes * minStripeWidth : w);
+        int done = 0;
+
+        while (done < w) {
+            int n = std::min(chunkWidth, w - done);
+            int x0 = (rightToLeft ? w - done - n : done);
+            renderDrawBufferParallel(context, x0, x0 + n, stripes);
+            done += n;
+            if (timeConstrained && done < w &&
+                timer.outOfTime(double(done) / double(w))) {
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
-    SVDEBUG << "minbin = " << minbin << ", nbins = " << nbins << ", last binfory = "
-         << binfory[h-1] << " (rounds to " << int(binfory[h-1]) << ") (model height " << sh << ")" << endl;
+                SVDEBUG << "out of time" << endl;
 #endif
-    
-    int psx = -1;
+                break;
+            }
+        }
 
+        updateTimings(timer, done);
+        return done;
+    }
+    
     int start = 0;
     int finish = w;
     int step = 1;
@@ -932,112 +2886,291 @@ Colour3DPlotRenderer::renderDrawBuffer(int w, int h,
 
     int xPixelCount = 0;
     
-    vector<float> preparedColumn;
+    ColumnScratch scratch;
 
-    int modelWidth = sourceModel->getWidth();
+    for (int x = start; x != finish; x += step) {
+
+        ++xPixelCount;
 
+        renderDrawBufferColumn(context, x, scratch);
+        
+        double fractionComplete = double(xPixelCount) / double(w);
+        if (timer.outOfTime(fractionComplete)) {
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
-    SVDEBUG << "modelWidth " << modelWidth << ", divisor " << divisor << endl;
+            SVDEBUG << "out of time" << endl;
 #endif
+            updateTimings(timer, xPixelCount);
+            return xPixelCount;
+        }
+    }
+
+    updateTimings(timer, xPixelCount);
+    return xPixelCount;
+}
+
+void
+Colour3DPlotRenderer::initColumnContext(DrawBufferColumnContext &context,
+                                        int w, int h,
+                                        const vector<int> &binforx,
+                                        const vector<double> &binfory,
+                                        int peakCacheIndex) const
+{
+    int divisor = 1;
+    int sh = m_sources.source->getHeight();
+    int sw = m_sources.source->getWidth();
+    if (peakCacheIndex >= 0) {
+        divisor = getPeakCacheDivisor(peakCacheIndex);
+        sh = m_sources.peakCaches[peakCacheIndex]->getHeight();
+        sw = m_sources.peakCaches[peakCacheIndex]->getWidth();
+    }
     
-    for (int x = start; x != finish; x += step) {
+    int minbin = int(binfory[0] + 0.0001);
+    if (minbin >= sh) minbin = sh - 1;
+    if (minbin < 0) minbin = 0;
 
-        // x is the on-canvas pixel coord; sx (later) will be the
-        // source column index
-        
-        ++xPixelCount;
-        
-        if (binforx[x] < 0) continue;
+    int nbins  = int(binfory[h-1] + 0.0001) - minbin + 1;
+    if (minbin + nbins > sh) nbins = sh - minbin;
 
-        int sx0 = binforx[x] / divisor;
-        int sx1 = sx0;
-        if (x+1 < w) sx1 = binforx[x+1] / divisor;
-        if (sx0 < 0) sx0 = sx1 - 1;
-        if (sx0 < 0) continue;
-        if (sx1 <= sx0) sx1 = sx0 + 1;
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "minbin = " << minbin << ", nbins = " << nbins << ", last binfory = "
+         << binfory[h-1] << " (rounds to " << int(binfory[h-1]) << ") (model height " << sh << ")" << endl;
+#endif
 
+    context.generation = -1;
+    context.w = w;
+    context.h = h;
+    context.binforx = &binforx;
+    context.binfory = &binfory;
+    context.minbin = minbin;
+    context.nbins = nbins;
+    context.divisor = divisor;
+    context.peakCacheIndex = peakCacheIndex;
+    context.reductionLevel = 0;
+    context.modelWidth = sw;
+    context.ranges = 0;
+    context.values = 0;
+    context.sampled = false;
+    context.colourScale = &m_colourScale;
+    
+    // If every pixel row spans several bins, reduce the bins in
+    // groups of up to half the smallest number per row, so that a
+    // group straddling a row boundary extends a row's range by less
+    // than half a row. Peak-bin display needs the unreduced column,
+    // to find its peaks.
+    
+    if (m_params.binDisplay == BinDisplay::AllBins && h > 1) {
+        double minPerRow = binfory[1] - binfory[0];
+        for (int y = 1; y + 1 < h; ++y) {
+            double perRow = binfory[y+1] - binfory[y];
+            if (perRow < minPerRow) minPerRow = perRow;
+        }
+        if (minPerRow >= minBinsPerRowToReduce) {
+            int level = 0;
+            while ((2 << level) <= minPerRow / 2) {
+                ++level;
+            }
+            context.reductionLevel = level;
+        }
+    }
+    
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
-//        SVDEBUG << "x = " << x << ", binforx[x] = " << binforx[x] << ", sx range " << sx0 << " -> " << sx1 << endl;
+    SVDEBUG << "modelWidth " << context.modelWidth << ", divisor " << divisor
+            << ", reductionLevel " << context.reductionLevel << endl;
 #endif
+}
 
-        vector<float> pixelPeakColumn;
-        MagnitudeRange magRange;
-        
-        for (int sx = sx0; sx < sx1; ++sx) {
+void
+Colour3DPlotRenderer::renderDrawBufferColumn(const DrawBufferColumnContext &context,
+                                             int x, ColumnScratch &scratch)
+{
+    // x is the on-canvas pixel coord; sx (later) will be the source
+    // column index
 
-            if (sx < 0 || sx >= modelWidth) {
-                continue;
-            }
+    const vector<int> &binforx = *context.binforx;
+    
+    if (binforx[x] < 0) return;
 
-            if (sx != psx) {
-                
-                // order:
-                // get column -> scale -> normalise -> record extents ->
-                // peak pick -> distribute/interpolate -> apply display gain
+    int sx0 = binforx[x] / context.divisor;
+    int sx1 = sx0;
+    if (x+1 < context.w) sx1 = binforx[x+1] / context.divisor;
+    if (sx0 < 0) sx0 = sx1 - 1;
+    if (sx0 < 0) return;
+    if (sx1 <= sx0 || context.sampled) sx1 = sx0 + 1;
 
-                // this does the first three:
-                ColumnOp::Column column = getColumn(sx, minbin, nbins,
-                                                    peakCacheIndex);
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+//    SVDEBUG << "x = " << x << ", binforx[x] = " << binforx[x] << ", sx range " << sx0 << " -> " << sx1 << endl;
+#endif
 
-                magRange.sample(column);
+    int h = context.h;
+    bool havePixel = false;
+    MagnitudeRange magRange;
+        
+    for (int sx = sx0; sx < sx1; ++sx) {
 
-                if (m_params.binDisplay == BinDisplay::PeakBins) {
-                    column = ColumnOp::peakPick(column);
-                }
+        if (sx < 0 || sx >= context.modelWidth) {
+            continue;
+        }
 
-                preparedColumn =
-                    ColumnOp::distribute(column,
-                                         h,
-                                         binfory,
-                                         minbin,
-                                         m_params.interpolate);
+        if (isCancelled(context)) {
+            return;
+        }
 
-                // Display gain belongs to the colour scale and is
-                // applied by the colour scale object when mapping it
-                
-                psx = sx;
+        if (sx != scratch.psx) {
+            MagnitudeRange columnRange = prepareColumn(context, sx, scratch);
+            if (isCancelled(context)) {
+                // don't record anything read after a change of source
+                return;
             }
+            recordColumnRange(sx, context.divisor, columnRange);
+            magRange.sample(columnRange);
+            scratch.psx = sx;
+        }
 
-            if (sx == sx0) {
-                pixelPeakColumn = preparedColumn;
-            } else {
-                for (int i = 0; in_range_for(pixelPeakColumn, i); ++i) {
-                    pixelPeakColumn[i] = std::max(pixelPeakColumn[i],
-                                                  preparedColumn[i]);
-                }
+        const float *prepared = scratch.prepared.data();
+        
+        if (!havePixel) {
+            scratch.pixelPeak.assign(prepared, prepared + h);
+            havePixel = true;
+        } else {
+            float *peak = scratch.pixelPeak.data();
+            for (int i = 0; i < h; ++i) {
+                peak[i] = (prepared[i] > peak[i] ? prepared[i] : peak[i]);
             }
         }
+    }
 
-        if (!pixelPeakColumn.empty()) {
+    if (havePixel) {
 
-            for (int y = 0; y < h; ++y) {
-                int py;
-                if (m_params.invertVertical) {
-                    py = y;
-                } else {
-                    py = h - y - 1;
-                }
-                m_drawBuffer.setPixel
-                    (x,
-                     py,
-                     m_params.colourScale.getPixel(pixelPeakColumn[y]));
+        scratch.pixels.resize(h);
+        context.colourScale->getPixels(scratch.pixelPeak.data(), h,
+                                       scratch.pixels.data());
+
+        const unsigned char *pixels = scratch.pixels.data();
+        
+        for (int y = 0; y < h; ++y) {
+            int py;
+            if (m_params.invertVertical) {
+                py = y;
+            } else {
+                py = h - y - 1;
             }
+            context.lines[py][x] = pixels[y];
+        }
+
+        if (context.values) {
+            std::copy(scratch.pixelPeak.begin(), scratch.pixelPeak.end(),
+                      context.values + size_t(x) * h);
+        }
             
-            m_magRanges.push_back(magRange);
+        context.ranges[x] = magRange;
+    }
+}
+
+namespace {
+
+class StripeTask : public QRunnable
+{
+public:
+    StripeTask(std::function<void()> f) : m_f(f) { }
+    void run() override { m_f(); }
+private:
+    std::function<void()> m_f;
+};
+
+}
+
+QThreadPool *
+Colour3DPlotRenderer::getStripePool(int threads)
+{
+    // Shared by all renderers and never deleted, so that a parallel
+    // render doesn't have to start any threads. Its threads expire
+    // when idle for a while, as usual for a QThreadPool
+    static QThreadPool *pool = new QThreadPool;
+    if (pool->maxThreadCount() < threads) {
+        pool->setMaxThreadCount(threads);
+    }
+    return pool;
+}
+
+void
+Colour3DPlotRenderer::renderDrawBufferParallel(const DrawBufferColumnContext &context,
+                                               int x0, int x1, int stripes)
+{
+    Profiler profiler("Colour3DPlotRenderer::renderDrawBufferParallel");
+
+    // Each stripe is a contiguous range of draw buffer columns. The
+    // columns (and their range slots) are disjoint between stripes,
+    // so the workers share nothing writable except through
+    // fetchColumn, which serialises its access to the source models.
+    
+    int w = x1 - x0;
+    
+    vector<exception_ptr> errors(stripes);
+    
+    auto renderStripe = [&](int stripe) {
+        try {
+            int sx0 = x0 + int((int64_t(w) * stripe) / stripes);
+            int sx1 = x0 + int((int64_t(w) * (stripe + 1)) / stripes);
+            ColumnScratch scratch;
+            for (int x = sx0; x < sx1; ++x) {
+                if (isCancelled(context)) break;
+                renderDrawBufferColumn(context, x, scratch);
+            }
+        } catch (...) {
+            errors[stripe] = current_exception();
         }
+    };
 
-        double fractionComplete = double(xPixelCount) / double(w);
-        if (timer.outOfTime(fractionComplete)) {
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
-            SVDEBUG << "out of time" << endl;
+    SVDEBUG << "renderDrawBufferParallel: rendering width " << w
+            << " in " << stripes << " stripes" << endl;
 #endif
-            updateTimings(timer, xPixelCount);
-            return xPixelCount;
-        }
+    
+    QThreadPool *pool = getStripePool(stripes - 1);
+
+    QSemaphore done;
+    
+    for (int stripe = 1; stripe < stripes; ++stripe) {
+        pool->start(new StripeTask([&, stripe]() {
+                    renderStripe(stripe);
+                    done.release();
+                }));
     }
 
-    updateTimings(timer, xPixelCount);
-    return xPixelCount;
+    // The calling thread takes the first stripe itself
+    renderStripe(0);
+
+    done.acquire(stripes - 1);
+
+    for (auto &e: errors) {
+        if (e) rethrow_exception(e);
+    }
+}
+
+void
+Colour3DPlotRenderer::recordColumnRange(int sx, int divisor,
+                                        const MagnitudeRange &range) const
+{
+    if (m_sources.columnRanges) {
+        QMutexLocker locker(getSourceMutex());
+        m_sources.columnRanges->sample(sx * divisor, (sx + 1) * divisor,
+                                       range);
+    }
+}
+
+int
+Colour3DPlotRenderer::getRenderThreadCount() const
+{
+    if (m_params.binDisplay == BinDisplay::PeakFrequencies) {
+        // This is dominated by FFT model access, which is serialised
+        // anyway, and it maps frequency to y through the view, which
+        // we must only do from the GUI thread
+        return 1;
+    }
+    if (m_params.threadCount < 1) {
+        return 1;
+    }
+    return m_params.threadCount;
 }
 
 int
@@ -1069,8 +3202,6 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
 
     FFTModel::PeakSet peakfreqs;
 
-    int psx = -1;
-    
     int start = 0;
     int finish = w;
     int step = 1;
@@ -1083,7 +3214,7 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
     
     int xPixelCount = 0;
     
-    vector<float> preparedColumn;
+    ColumnScratch scratch;
 
     int modelWidth = fft->getWidth();
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
@@ -1118,7 +3249,7 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
         if (sx0 < 0) continue;
         if (sx1 <= sx0) sx1 = sx0 + 1;
 
-        vector<float> pixelPeakColumn;
+        bool havePixel = false;
         MagnitudeRange magRange;
         
         for (int sx = sx0; sx < sx1; ++sx) {
@@ -1127,25 +3258,31 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
                 continue;
             }
 
-            if (sx != psx) {
-                preparedColumn = getColumn(sx, minbin, nbins, -1);
-                magRange.sample(preparedColumn);
-                psx = sx;
+            if (sx != scratch.psx) {
+                fetchColumn(sx, minbin, nbins, -1, scratch.source);
+                MagnitudeRange columnRange = scaleColumn(scratch.source);
+                recordColumnRange(sx, 1, columnRange);
+                magRange.sample(columnRange);
+                scratch.psx = sx;
             }
 
+            const float *prepared = scratch.source.data();
+            
             if (sx == sx0) {
-                pixelPeakColumn = preparedColumn;
+                scratch.pixelPeak.assign(prepared, prepared + nbins);
+                havePixel = true;
+                QMutexLocker locker(getSourceMutex());
                 peakfreqs = fft->getPeakFrequencies(FFTModel::AllPeaks, sx,
                                                     minbin, minbin + nbins - 1);
-            } else {
-                for (int i = 0; in_range_for(pixelPeakColumn, i); ++i) {
-                    pixelPeakColumn[i] = std::max(pixelPeakColumn[i],
-                                                  preparedColumn[i]);
+            } else if (havePixel) {
+                float *peak = scratch.pixelPeak.data();
+                for (int i = 0; i < nbins; ++i) {
+                    peak[i] = (prepared[i] > peak[i] ? prepared[i] : peak[i]);
                 }
             }
         }
 
-        if (!pixelPeakColumn.empty()) {
+        if (havePixel) {
 
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
 //            SVDEBUG << "found " << peakfreqs.size() << " peak freqs at column "
@@ -1161,7 +3298,7 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
                 if (bin < minbin) continue;
                 if (bin >= minbin + nbins) break;
             
-                double value = pixelPeakColumn[bin - minbin];
+                double value = scratch.pixelPeak[bin - minbin];
             
                 double y = v->getYForFrequency
                     (freq, minFreq, maxFreq, logarithmic);
@@ -1169,7 +3306,7 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
                 int iy = int(y + 0.5);
                 if (iy < 0 || iy >= h) continue;
 
-                auto pixel = m_params.colourScale.getPixel(value);
+                auto pixel = m_colourScale.getPixel(value);
 
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
 //                SVDEBUG << "frequency " << freq << " for bin " << bin
@@ -1180,7 +3317,7 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
                 m_drawBuffer.setPixel(x, iy, pixel);
             }
 
-            m_magRanges.push_back(magRange);
+            m_magRanges[x] = magRange;
 
         } else {
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
@@ -1206,6 +3343,10 @@ Colour3DPlotRenderer::renderDrawBufferPeakFrequencies(const LayerGeometryProvide
 void
 Colour3DPlotRenderer::updateTimings(const RenderTimer &timer, int xPixelCount)
 {
+    // This is wall-clock time, however many threads were used: the
+    // speedup from rendering in parallel depends on the machine and
+    // on how much of the work is serialised on the sources, so we
+    // predict only from what we have observed
     double secondsPerXPixel = timer.secondsPerItem(xPixelCount);
 
     // valid if we have enough data points, or if the overall time is
@@ -1215,6 +3356,7 @@ Colour3DPlotRenderer::updateTimings(const RenderTimer &timer, int xPixelCount)
     if (valid) {
         m_secondsPerXPixel = secondsPerXPixel;
         m_secondsPerXPixelValid = true;
+        updatePreviewStep();
     
 #ifdef DEBUG_COLOUR_PLOT_REPAINT
     SVDEBUG << "across " << xPixelCount << " x-pixels, seconds per x-pixel = "
@@ -1228,15 +3370,11 @@ Colour3DPlotRenderer::recreateDrawBuffer(int w, int h)
 {
     m_drawBuffer = QImage(w, h, QImage::Format_Indexed8);
 
-    for (int pixel = 0; pixel < 256; ++pixel) {
-        m_drawBuffer.setColor
-            ((unsigned char)pixel,
-             m_params.colourScale.getColourForPixel
-             (pixel, m_params.colourRotation).rgb());
-    }
+    m_drawBuffer.setColorTable
+        (m_colourScale.getPalette(m_params.colourRotation));
 
     m_drawBuffer.fill(0);
-    m_magRanges.clear();
+    m_magRanges = vector<MagnitudeRange>(w);
 }
 
 void
@@ -1246,8 +3384,61 @@ Colour3DPlotRenderer::clearDrawBuffer(int w, int h)
         recreateDrawBuffer(w, h);
     } else {
         m_drawBuffer.fill(0);
-        m_magRanges.clear();
+        m_magRanges = vector<MagnitudeRange>(w);
+    }
+}
+
+size_t
+Colour3DPlotRenderer::getCacheBytes() const
+{
+    const QImage &image = m_cache.getImage();
+    size_t bytes = size_t(image.bytesPerLine()) * image.height();
+    bytes += m_valueCache.getBytes();
+    bytes += m_tileCache.getBytes();
+    bytes += size_t(m_preview.bytesPerLine()) * m_preview.height();
+    bytes += size_t(m_drawBuffer.bytesPerLine()) * m_drawBuffer.height();
+    bytes += m_drawValues.capacity() * sizeof(float);
+    return bytes;
+}
+
+double
+Colour3DPlotRenderer::getCacheRebuildCost() const
+{
+    if (!m_secondsPerXPixelValid) {
+        return 0.0;
     }
+    int columns = m_cache.getValidWidth() +
+        m_tileCache.getTileCount() * m_tileCache.getTileWidth();
+    return m_secondsPerXPixel * columns;
+}
+
+bool
+Colour3DPlotRenderer::isCacheDormant() const
+{
+    return !m_lastUsed.isValid() ||
+        m_lastUsed.elapsed() > CacheGovernor::dormancyTimeout;
+}
+
+void
+Colour3DPlotRenderer::releaseCache()
+{
+#ifdef DEBUG_COLOUR_PLOT_REPAINT
+    SVDEBUG << "releaseCache: releasing " << getCacheBytes() << " bytes"
+            << endl;
+#endif
+    
+    // Everything is recreated at the next render, as the cache
+    // geometry will no longer match the view. The magnitude cache is
+    // small and stays, as it does whenever the image cache is
+    // invalidated.
+    discardAsyncWork();
+    m_cache.resize(QSize());
+    m_valueCache.resize(0, 0);
+    m_tileCache.clear();
+    m_preview = QImage();
+    m_drawBuffer = QImage();
+    m_magRanges = vector<MagnitudeRange>();
+    m_drawValues = vector<float>();
 }
 
 QRect
@@ -1255,6 +3446,10 @@ Colour3DPlotRenderer::findSimilarRegionExtents(QPoint p) const
 {
     QImage image = m_cache.getImage();
     ImageRegionFinder finder;
-    QRect rect = finder.findRegionExtents(&image, p);
+    int margin = m_cache.getMargin();
+    QRect rect = finder.findRegionExtents(&image, p + QPoint(margin, 0));
+    if (rect.isValid()) {
+        rect.translate(-margin, 0);
+    }
     return rect;
 }
@@ -19,6 +19,10 @@
 #include "ColourScale.h"
 #include "ScrollableImageCache.h"
 #include "ScrollableMagRangeCache.h"
+#include "ScrollableValueCache.h"
+#include "ZoomTileCache.h"
+#include "MagnitudeRangeTree.h"
+#include "CacheGovernor.h"
 
 #include "base/ColumnOp.h"
 #include "base/MagnitudeRange.h"
@@ -26,13 +30,30 @@
 #include <QRect>
 #include <QPainter>
 #include <QImage>
+#include <QMutex>
+#include <QWaitCondition>
+#include <QElapsedTimer>
+#include <QObject>
+#include <QPointer>
+
+#include <deque>
+#include <map>
+#include <functional>
+#include <thread>
+#include <atomic>
 
 class LayerGeometryProvider;
+class View;
 class VerticalBinLayer;
 class DenseThreeDimensionalModel;
-class Dense3DModelPeakCache;
+class PeakColumnCache;
+class CompactColumnCache;
+class BinReductionCache;
 class FFTModel;
 class RenderTimer;
+class Colour3DPlotRenderer;
+class QTimer;
+class QThreadPool;
 
 enum class BinDisplay {
     AllBins,
@@ -45,17 +66,70 @@ enum class BinScale {
     Log
 };
 
-class Colour3DPlotRenderer
+/**
+ * Object through which Colour3DPlotRenderer reports, from its
+ * background render thread, that newly rendered columns are waiting
+ * to be taken into its cache, and receives the idle timer that
+ * drives its prefetching. \see Colour3DPlotRenderer::connectRenderReady
+ */
+class Colour3DPlotRenderNotifier : public QObject
+{
+    Q_OBJECT
+
+public:
+    Colour3DPlotRenderNotifier(Colour3DPlotRenderer *renderer) :
+        m_renderer(renderer) { }
+
+signals:
+    void renderReady();
+
+private slots:
+    void prefetchTimeout();
+
+private:
+    Colour3DPlotRenderer *m_renderer;
+};
+
+class Colour3DPlotRenderer : public CacheGovernor::Client
 {
 public:
     struct Sources {
-        Sources() : verticalBinLayer(0), source(0), fft(0) { }
+        Sources() : verticalBinLayer(0), source(0), fft(0),
+                    compactCache(0), columnRanges(0), sourceMutex(0) { }
         
         // These must all outlive this class
         const VerticalBinLayer *verticalBinLayer;  // always
         const DenseThreeDimensionalModel *source;  // always
         const FFTModel *fft;                       // optionally
-        std::vector<Dense3DModelPeakCache *> peakCaches; // zero or more
+        std::vector<PeakColumnCache *> peakCaches; // zero or more
+
+        // Optionally, a quantised whole-model cache of source, read
+        // in place of source for magnitudes at full resolution.
+        const CompactColumnCache *compactCache;
+
+        // Optionally, bin reductions of the source (at index 0) and
+        // of each peak cache (at index i + 1 for peakCaches[i]), used
+        // when there are many bins to every pixel row. A null entry,
+        // or a missing one, means that columns from that source are
+        // reduced as they are read and not kept.
+        std::vector<BinReductionCache *> binReductions;
+
+        // The peak caches, compact cache and bin reductions are read
+        // without sourceMutex, so any that read from a source shared
+        // with other readers must have been given that mutex to hold
+        // while doing so
+
+        // Optionally, a record into which the magnitude range of
+        // every source column is sampled as it is rendered, indexed
+        // by column of the source model (not of any peak cache)
+        MagnitudeRangeTree *columnRanges;
+
+        // Optionally, a mutex held by every reader of the sources
+        // above (including columnRanges), shared between all the
+        // renderers that use them. If null, the renderer serialises
+        // only its own reads, which is safe only if it has the
+        // sources to itself.
+        QMutex *sourceMutex;
     };        
 
     struct Parameters {
@@ -68,7 +142,12 @@ public:
             interpolate(false),
             invertVertical(false),
             scaleFactor(1.0),
-            colourRotation(0) { }
+            colourRotation(0),
+            threadCount(1),
+            overscan(0),
+            asynchronous(false),
+            retainValues(false),
+            indexedCache(false) { }
 
         /** A complete ColourScale object by value, used for colour
          *  map conversion. Note that the final display gain setting is
@@ -108,14 +187,61 @@ public:
 
         /** Colourmap rotation, in the range 0-255. */
         int colourRotation;
+
+        /** Number of threads to use when rendering columns to the
+         *  draw buffer. If greater than 1, a render that does not
+         *  need to be time-constrained is split into disjoint column
+         *  stripes that are rendered concurrently. Access to the
+         *  source models is serialised internally, so the sources
+         *  need not be thread-safe. Peak-frequency rendering is
+         *  always single-threaded. */
+        int threadCount;
+
+        /** Width of the off-screen margin held in the image cache at
+         *  each side of the view, as a multiple of the view width. At
+         *  1, the cache spans three times the view width. The margin
+         *  is filled in the current scroll direction by prefetch(),
+         *  so that scrolling into it needs no rendering. 0 for no
+         *  margin. */
+        int overscan;
+
+        /** Whether renderTimeConstrained() should hand slow renders
+         *  to a background thread rather than carrying them out in
+         *  slices on the calling thread. If true, an area that cannot
+         *  be rendered quickly is queued and the call returns at
+         *  once, painting only what is already in the cache; the
+         *  notifier is signalled as further columns become ready.
+         *  This applies to pixel-resolution rendering other than
+         *  peak frequencies, which is always done on the calling
+         *  thread. The sources must be safe to read from a thread
+         *  other than the GUI thread. */
+        bool asynchronous;
+
+        /** Whether to keep, alongside the image cache, the value of
+         *  every cached pixel before colour mapping. If true, a call
+         *  to setColourScale() recolours the cached image from these
+         *  values instead of discarding it, so that a change of gain,
+         *  threshold or colour map needs no further reads from the
+         *  source models. This costs one float per pixel of the
+         *  cache. Values are kept only for pixel-resolution
+         *  rendering other than peak frequencies; other areas are
+         *  re-rendered as before. */
+        bool retainValues;
+
+        /** Whether to keep the image cache in indexed (8-bit
+         *  palette) form, converting to colour only when painting
+         *  from it, rather than as ARGB. An indexed cache uses a
+         *  quarter of the memory, and a change of colour map or
+         *  colour rotation then needs only a new colour table, with
+         *  no re-rendering at all; painting from the cache is a
+         *  little slower. When interpolating, bin-resolution areas
+         *  are smoothed between colour indices rather than between
+         *  colours. */
+        bool indexedCache;
     };
     
-    Colour3DPlotRenderer(Sources sources, Parameters parameters) :
-        m_sources(sources),
-        m_params(parameters),
-        m_secondsPerXPixel(0.0),
-        m_secondsPerXPixelValid(false)
-    { }
+    Colour3DPlotRenderer(Sources sources, Parameters parameters);
+    ~Colour3DPlotRenderer();
 
     struct RenderResult {
         /**
@@ -206,6 +332,77 @@ public:
      */
     QRect getLargestUncachedRect(const LayerGeometryProvider *v);
 
+    /**
+     * Arrange for the off-screen overscan margin (see
+     * Parameters::overscan) to be filled on the side toward which
+     * the view has recently been scrolling. This does nothing unless
+     * the visible area is already completely cached, following a
+     * preceding render() call with the same geometry.
+     *
+     * The margin is queued for the background thread if rendering
+     * asynchronously. Otherwise it is rendered on this thread in
+     * short chunks, one each time the event loop is idle, for as
+     * long as the view's geometry stays the same. Either way this
+     * returns at once, and the caller need not repaint, as nothing
+     * on display changes.
+     */
+    void prefetch(const LayerGeometryProvider *v);
+
+    /**
+     * Return true if an asynchronous render (see
+     * Parameters::asynchronous) is queued or in progress, or has
+     * results that have not yet been taken into the cache by a
+     * subsequent render() or prefetch() call. While this is true,
+     * the caller need not schedule repaints of its own in order to
+     * complete the view: the notifier will be signalled when there
+     * is more to paint.
+     */
+    bool hasPendingRender() const;
+
+    /**
+     * Abandon any queued or in-progress asynchronous render, and any
+     * of its results not yet taken into the cache. Nothing already
+     * in the cache is lost. This does not wait: the background
+     * thread gives up any job in progress within a column, but may
+     * still be reading the sources on return, so they must remain
+     * valid until the renderer is deleted.
+     */
+    void cancelPendingRender();
+
+    /**
+     * Discard whatever has been rendered from the frames from
+     * startFrame up to but not including endFrame, following a
+     * change to the sources within that range. The rest of the cache
+     * remains valid, so that the next render only needs to fill in
+     * the affected columns. Any asynchronous render is abandoned.
+     *
+     * The caller is responsible for widening the range to cover
+     * every frame whose rendering depends on the changed data, for
+     * example by a window's worth either side for an FFT model.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
+
+    /**
+     * Paint into rect whatever this renderer already has for the
+     * view, without reading from the sources at all: the valid part
+     * of the image cache, scaled horizontally to the view's zoom
+     * level and vertically to its height if they have changed, or
+     * failing that any preview or tiles. Areas for which there is
+     * nothing are left unpainted. This is for showing the last
+     * render from sources that are about to be replaced, while the
+     * replacements are made ready.
+     */
+    void paintFromCache(const LayerGeometryProvider *v,
+                        QPainter &paint, QRect rect);
+
+    /**
+     * Connect the notifier that is signalled, using a queued
+     * connection, whenever results of an asynchronous render become
+     * available. The receiver should respond by repainting, which
+     * will take the results into the cache.
+     */
+    void connectRenderReady(const QObject *receiver, const char *slot);
+
     /**
      * Return true if the provider's geometry differs from the cache,
      * or if we are not using a cache. i.e. if the cache will be
@@ -229,20 +426,68 @@ public:
      * \see ColourScale::getColour
      */
     QColor getColour(double value) const {
-        return m_params.colourScale.getColour(value, m_params.colourRotation);
+        return m_colourScale.getColour(value, m_params.colourRotation);
     }
 
+    /**
+     * Replace the colour scale, for example to change its value
+     * range, gain, threshold or colour map. This must not change the
+     * scale to or from a phase scale. Magnitude ranges and render
+     * timings are retained, and so, if values are being retained
+     * (see Parameters::retainValues), is as much of the image cache
+     * as can be recoloured from them; everything else that depends
+     * on colour is discarded. This is much cheaper than constructing
+     * a new renderer.
+     */
+    void setColourScale(const ColourScale &colourScale);
+
+    /**
+     * Change the colour rotation (in the range 0-255). As with
+     * setColourScale(), this is much cheaper than constructing a new
+     * renderer, and, with an indexed cache (see
+     * Parameters::indexedCache), it is almost free.
+     */
+    void setColourRotation(int rotation);
+
+    typedef std::map<int, Colour3DPlotRenderer *> ViewRendererMap; // key is view id
+
+    /**
+     * Give each of the given renderers the colour scale returned by
+     * makeColourScale for its view id, as a layer does for a change
+     * that affects only the mapping from value to colour.
+     */
+    static void setColourScales(const ViewRendererMap &renderers,
+                                std::function<ColourScale(int)> makeColourScale);
+
     /**
      * Return the enclosing rectangle for the region of similar colour
      * to the given point within the cache. Return an empty QRect if
      * this is not possible. \see ImageRegionFinder
      */
     QRect findSimilarRegionExtents(QPoint point) const;
+
+    /**
+     * CacheGovernor::Client methods. The renderer registers with the
+     * governor on construction, and its caches may be released while
+     * it is not in use; they are rebuilt by subsequent renders.
+     */
+    virtual size_t getCacheBytes() const override;
+    virtual double getCacheRebuildCost() const override;
+    virtual bool isCacheDormant() const override;
+    virtual void releaseCache() override;
     
 private:
     Sources m_sources;
     Parameters m_params;
 
+    // The colour scale in use, initially the one in m_params, which
+    // is not updated thereafter. This is only used on the calling
+    // thread: a background render has its own copy. Whether it is a
+    // phase scale cannot change, and is recorded separately so that
+    // it can be read from any thread.
+    ColourScale m_colourScale;
+    bool m_phase;
+
     // Draw buffer is the target of each partial repaint. It is always
     // at view height (not model height) and is cleared and repainted
     // on each fragment render. The only reason it's stored as a data
@@ -251,17 +496,32 @@ private:
 
     // A temporary store of magnitude ranges per-column, used when
     // rendering to the draw buffer. This always has the same length
-    // as the width of the draw buffer, and the x coordinates of the
-    // two containers are equivalent.
+    // as the rendered width of the draw buffer, and the x coordinates
+    // of the two containers are equivalent. Columns that have not
+    // been rendered have unset ranges.
     std::vector<MagnitudeRange> m_magRanges;
+
+    // Pre-colour pixel values for the draw buffer, h per column, if
+    // retaining values in a pixel-resolution render; otherwise empty
+    std::vector<float> m_drawValues;
+
+    // Serialises access to the source models, which are not assumed
+    // to be safe for concurrent reads, when rendering columns from
+    // more than one thread. Used only if the sources don't supply a
+    // shared mutex of their own; see getSourceMutex().
+    mutable QMutex m_sourceMutex;
+    QMutex *getSourceMutex() const {
+        return m_sources.sourceMutex ? m_sources.sourceMutex : &m_sourceMutex;
+    }
     
     // The image cache is our persistent record of the visible
     // area. It is always the same size as the view (i.e. the paint
-    // size reported by the LayerGeometryProvider) and is scrolled and
-    // partially repainted internally as appropriate. A render request
-    // is carried out by repainting to cache (via the draw buffer) any
-    // area that is being requested but is not valid in the cache, and
-    // then repainting from cache to the requested painter.
+    // size reported by the LayerGeometryProvider), plus any overscan
+    // margins, and is scrolled and partially repainted internally as
+    // appropriate. A render request is carried out by repainting to
+    // cache (via the draw buffer) any area that is being requested
+    // but is not valid in the cache, and then repainting from cache
+    // to the requested painter.
     ScrollableImageCache m_cache;
 
     // The mag range cache is our record of the column magnitude
@@ -273,8 +533,196 @@ private:
     // versa (as the image cache is limited to contiguous ranges).
     ScrollableMagRangeCache m_magCache;
 
+    // The value cache, used only if m_params.retainValues is set,
+    // holds the pre-colour pixel values for columns of the image
+    // cache. It has the same geometry as the image cache and the
+    // column indices match up, but only columns that were rendered
+    // at pixel resolution have values, and values may remain for
+    // columns that are no longer valid in the image cache. So a
+    // column can be recoloured from it only if it is both valid in
+    // the image cache and set in the value cache.
+    ScrollableValueCache m_valueCache;
+
+    // The tile cache holds columns of the image cache, and their
+    // magnitude ranges, in fixed-width tiles for each zoom level
+    // recently displayed. Whenever the image cache is invalid or
+    // incomplete, it is first extended from any stored tiles, so that
+    // returning to a zoom level is fast. Tiles from the nearest other
+    // zoom level are also used to paint a scaled placeholder for any
+    // area that a time-constrained render has not reached. Its budget
+    // is enough tiles to cover the view tileCacheViews times over, and
+    // is reset whenever the view size changes.
+    ZoomTileCache m_tileCache;
+    static const int tileWidth = 256;
+    static const int tileCacheViews = 16;
+
+    // Columns are read from the bin reductions in the sources,
+    // reduced in the bin direction to roughly the density of the
+    // view's pixel rows, when there are at least
+    // minBinsPerRowToReduce bins to every pixel row, so that renders
+    // of tall models read a few values per row instead of every bin
+    // of every column.
+    static const int minBinsPerRowToReduce = 4;
+
     double m_secondsPerXPixel;
     bool m_secondsPerXPixelValid;
+
+    // The end frame of the source model as of the last render, or -1
+    // if there hasn't been one. Everything beyond it was rendered
+    // blank, so when the model grows at the end, as while recording
+    // or while a transform is running, only the columns from a little
+    // before the old end onward need to be rendered again: the valid
+    // area of the cache is cut back to there and then extended,
+    // rather than being discarded.
+    sv_frame_t m_renderedEndFrame;
+    void checkForModelGrowth(const LayerGeometryProvider *v);
+    sv_frame_t getCacheEndFrame() const;
+
+    // Restarted by every render() or prefetch() call. We can't tell
+    // whether our view is on display, so we are dormant if it hasn't
+    // asked us for anything for a while.
+    QElapsedTimer m_lastUsed;
+
+    // Stripes narrower than this aren't worth a thread of their own
+    static const int minStripeWidth = 16;
+
+    struct DrawBufferColumnContext {
+        int w;
+        int h;
+        const std::vector<int> *binforx;
+        const std::vector<double> *binfory;
+        int minbin;
+        int nbins;
+        int divisor;
+        int peakCacheIndex;
+        int reductionLevel;         // bin reduction level, 0 for none
+        int modelWidth;
+        std::vector<uchar *> lines; // draw buffer scanlines, by y
+        MagnitudeRange *ranges;     // per-column ranges, by x
+        float *values;              // h pre-colour values per x, or null
+        bool sampled;               // read one source column per x only
+        const ColourScale *colourScale;
+        int generation;             // async job generation, or -1
+    };
+
+    // True if the context belongs to an asynchronous job that has
+    // been abandoned. Checked before every column, so that the worker
+    // stops promptly without anyone having to wait for it
+    bool isCancelled(const DrawBufferColumnContext &context) const {
+        return context.generation >= 0 &&
+            (m_asyncExiting || m_asyncGeneration != context.generation);
+    }
+
+    // Asynchronous rendering. Each job renders a span of columns,
+    // identified by global pixel index (counted from frame 0 at the
+    // job's zoom level) so that it remains meaningful if the view
+    // scrolls. Everything a job needs from the view, and from the
+    // vertical bin layer, is worked out on the GUI thread when it is
+    // queued. The worker renders it in chunks and queues each chunk
+    // as a result, which the GUI thread copies into the cache at its
+    // next render() or prefetch() call. The generation count is
+    // incremented whenever queued work becomes useless (because the
+    // zoom level or height have changed, or the sources have changed)
+    // and the worker, which checks it before every column, then gives
+    // up on its current job by itself. Nothing on the GUI thread waits
+    // for that, except the destructor when it joins the worker.
+    struct AsyncJob {
+        AsyncJob() : colourScale(ColourScale::Parameters()) { }
+        int generation;
+        int zoomLevel;
+        int height;
+        sv_frame_t pixelLeft;
+        bool rightToLeft;
+        std::vector<int> binforx;
+        std::vector<double> binfory;
+        ColourScale colourScale;
+        QVector<QRgb> palette;
+        DrawBufferColumnContext context;
+    };
+
+    struct AsyncResult {
+        int zoomLevel;
+        sv_frame_t pixelLeft;
+        QImage image;
+        std::vector<MagnitudeRange> ranges; // one per column of image
+        std::vector<float> values; // h per column of image, if retaining
+        double secondsPerXPixel; // as if rendered on one thread
+    };
+
+    Colour3DPlotRenderNotifier *m_notifier;
+
+    // Synchronous prefetching, when the margin can't be handed to the
+    // background thread. A single-shot zero-interval timer, so that
+    // each chunk is rendered only once the event loop has nothing
+    // else to do; it is restarted after each chunk until the margin
+    // is full or the view has moved on.
+    friend class Colour3DPlotRenderNotifier;
+    QTimer *m_prefetchTimer;
+    QPointer<const View> m_prefetchView;
+    void prefetchStep();
+    bool getPrefetchArea(const LayerGeometryProvider *v,
+                         int &x0, int &width, int &direction);
+
+    std::thread *m_asyncThread;
+    mutable QMutex m_asyncMutex;
+    QWaitCondition m_asyncCondition;
+    std::deque<AsyncJob> m_asyncJobs;
+    std::deque<AsyncResult> m_asyncResults;
+    bool m_asyncBusy;           // worker has a job in progress
+    int m_asyncBusyZoomLevel;   // and these describe it
+    int m_asyncBusyHeight;
+    sv_frame_t m_asyncBusyLeft;
+    sv_frame_t m_asyncBusyRight;
+    std::atomic<bool> m_asyncExiting;
+    std::atomic<int> m_asyncGeneration;
+
+    // The preview is a low-resolution render of the whole view, made
+    // when a time-constrained render is unlikely to fill most of it
+    // in one go, and painted stretched across whatever part of the
+    // view has not yet been rendered in full. It has one column for
+    // every m_previewPixelStep pixels, starting from global pixel
+    // index m_previewPixelLeft. The step for the next preview,
+    // m_previewStep, is chosen from the measured render speed.
+    QImage m_preview;
+    int m_previewZoomLevel;
+    sv_frame_t m_previewPixelLeft;
+    int m_previewPixelStep;
+    int m_previewStep;
+    static const int maxPreviewStep = 16;
+
+    // Memoised bin mappings, which are otherwise recalculated for
+    // every render pass. The source bin for each pixel row is kept
+    // for a single height, and is checked against the vertical bin
+    // layer at the top and bottom rows before reuse, in case the
+    // vertical extents have changed. The source column for each
+    // pixel is kept for a span of global pixel indices at a single
+    // zoom level, and extended as renders reach beyond it. These are
+    // used from the GUI thread only.
+    mutable std::vector<double> m_binforyMemo;
+    mutable std::vector<int> m_binforxMemo;
+    mutable int m_binforxMemoZoomLevel;
+    mutable sv_frame_t m_binforxMemoModelStart;
+    mutable sv_frame_t m_binforxMemoLeft; // global pixel index
+    static const int maxBinforxMemoWidth = 65536;
+
+    void getBinForYTable(const LayerGeometryProvider *v, int h,
+                         std::vector<double> &binfory) const;
+    void getBinForXTable(const LayerGeometryProvider *v,
+                         int x0, int repaintWidth, int step,
+                         std::vector<int> &binforx) const;
+
+    void renderPreview(const LayerGeometryProvider *v);
+    bool paintPreview(const LayerGeometryProvider *v,
+                      QPainter &paint, QRect rect); // false if not covered
+    void updatePreviewStep();
+
+    void queueAsyncRender(const LayerGeometryProvider *v, int x0,
+                          int repaintWidth, bool rightToLeft,
+                          bool urgent); // urgent => ahead of other jobs
+    void integrateAsyncResults(const LayerGeometryProvider *v);
+    void discardAsyncWork();
+    void asyncRenderLoop();
+    void renderAsyncJob(AsyncJob &job);
     
     RenderResult render(const LayerGeometryProvider *v,
                         QPainter &paint, QRect rect, bool timeConstrained);
@@ -296,6 +744,86 @@ private:
                          bool rightToLeft,
                          bool timeConstrained);
 
+    // Set up a column context for the given bin tables, without
+    // scanlines or range storage
+    void initColumnContext(DrawBufferColumnContext &context,
+                           int w, int h,
+                           const std::vector<int> &binforx,
+                           const std::vector<double> &binfory,
+                           int peakCacheIndex) const;
+
+    // Calculate the source column for each of repaintWidth pixels
+    // from x0 (or for every step'th pixel), and the source bin for
+    // each pixel row
+    void getPixelResolutionBins(const LayerGeometryProvider *v,
+                                int x0, int repaintWidth, int h,
+                                std::vector<int> &binforx,
+                                std::vector<double> &binfory,
+                                int step = 1) const;
+
+    // Working buffers for preparing columns. Each rendering thread
+    // owns one of these and reuses it from one column to the next,
+    // so that preparing a column does not allocate once the buffers
+    // have reached their working size.
+    struct ColumnScratch {
+        ColumnScratch() : psx(-1) { }
+        int psx;                        // source column now in prepared
+        ColumnOp::Column source;        // nbins values from source model
+        ColumnOp::Column reduced;       // bin-reduced source values
+        ColumnOp::Column reducedMin;    // and their group minima
+        ColumnOp::Column prepared;      // h values, distributed to pixels
+        ColumnOp::Column pixelPeak;     // h values, max across columns
+        std::vector<unsigned char> pixels; // h colour scale pixels
+    };
+
+    // Render the single draw buffer column x, writing into its
+    // scanline pixels and its slots in the ranges and values and
+    // touching no other shared state.
+    void renderDrawBufferColumn(const DrawBufferColumnContext &context,
+                                int x, ColumnScratch &scratch);
+
+    // Fetch source column sx and prepare it for display, leaving h
+    // pixel values in scratch.prepared. This is the fused equivalent
+    // of getColumn followed by ColumnOp::peakPick and
+    // ColumnOp::distribute. Returns the magnitude range of the
+    // column after scaling and normalisation.
+    MagnitudeRange prepareColumn(const DrawBufferColumnContext &context,
+                                 int sx, ColumnScratch &scratch) const;
+
+    // The equivalent of prepareColumn for a context with a non-zero
+    // reduction level, reading the group maxima and minima from the
+    // source's bin reductions and applying the gain and normalisation
+    // to those. With no reductions for the source, or a normalisation
+    // that needs every bin, the column is read and reduced instead.
+    MagnitudeRange prepareReducedColumn(const DrawBufferColumnContext &context,
+                                        int sx, ColumnScratch &scratch) const;
+
+    // Fetch the unscaled values of bins minbin to minbin+nbins-1 of
+    // source column sx into the given column, which is resized to
+    // nbins (reusing its existing capacity).
+    void fetchColumn(int sx, int minbin, int nbins, int peakCacheIndex,
+                     ColumnOp::Column &column) const;
+
+    // Apply the initial scale factor and column normalisation to the
+    // given column in place, returning the magnitude range of the
+    // result. Phase columns are left unchanged.
+    MagnitudeRange scaleColumn(ColumnOp::Column &column) const;
+
+    // Render draw buffer columns x0 to x1-1 in the given number of
+    // concurrent stripes, the first on the calling thread and the
+    // rest on the shared stripe pool
+    void renderDrawBufferParallel(const DrawBufferColumnContext &context,
+                                  int x0, int x1, int stripes);
+    static QThreadPool *getStripePool(int threads);
+
+    int getRenderThreadCount() const;
+
+    // Sample into the column range record, if we have one, the range
+    // of column sx of the source or of the peak cache with the given
+    // number of columns per peak
+    void recordColumnRange(int sx, int divisor,
+                           const MagnitudeRange &range) const;
+    
     int renderDrawBufferPeakFrequencies(const LayerGeometryProvider *v,
                                         int w, int h,
                                         const std::vector<int> &binforx,
@@ -314,16 +842,46 @@ private:
 
     RenderType decideRenderType(const LayerGeometryProvider *) const;
 
+    bool useAsynchronousRender(RenderType type, bool timeConstrained) const;
+
     QImage scaleDrawBufferImage(QImage source, int targetWidth, int targetHeight)
         const;
+    QImage scaleIndexedImage(QImage source, int targetWidth, int targetHeight)
+        const;
     
     ColumnOp::Column getColumn(int sx, int minbin, int nbins,
                                int peakCacheIndex) const; // -1 => don't use cache
 
     void getPreferredPeakCache(const LayerGeometryProvider *,
                                int &peakCacheIndex, int &binsPerPeak) const;
+    void getPreferredPeakCache(int zoomLevel,
+                               int &peakCacheIndex, int &binsPerPeak) const;
+
+    // Return the number of source columns per column of the given
+    // peak cache. A peak cache may be taken from another peak cache,
+    // so this is not necessarily its own getColumnsPerPeak()
+    int getPeakCacheDivisor(int peakCacheIndex) const;
 
     void updateTimings(const RenderTimer &timer, int xPixelCount);
+
+    void setCacheGeometry(const LayerGeometryProvider *v);
+
+    // Redraw the longest run of image cache columns for which we
+    // have values using the current colour scale, and invalidate the
+    // rest of the image cache. Return false, having done nothing, if
+    // there is no such run.
+    bool recolourCache();
+
+    // Apply the palette for the current colour scale and rotation,
+    // following a change that leaves pixel indices unchanged
+    void updatePalette();
+    
+    void storeTiles(const LayerGeometryProvider *v);
+    void restoreFromTiles(const LayerGeometryProvider *v, int x0);
+    bool restoreTile(const LayerGeometryProvider *v, int tileIndex);
+    void paintPlaceholder(const LayerGeometryProvider *v,
+                          QPainter &paint, QRect rect);
+    int getPrefetchWidth() const;
 };
 
 #endif
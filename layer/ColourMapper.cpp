@@ -22,8 +22,12 @@
 #include "base/Debug.h"
 
 #include <vector>
+#include <map>
+#include <tuple>
 
 #include <QPainter>
+#include <QMutex>
+#include <QMutexLocker>
 
 using namespace std;
 
@@ -347,4 +351,36 @@ ColourMapper::getExamplePixmap(QSize size) const
     return pmap;
 }
 
+QVector<QRgb>
+ColourMapper::getPalette(int map, int rotation, QRgb background)
+{
+    const int maxPixel = 255;
+    
+    rotation %= maxPixel;
+    if (rotation < 0) rotation += maxPixel;
+    
+    typedef std::tuple<int, int, QRgb> Key;
+    static std::map<Key, QVector<QRgb>> palettes;
+    static QMutex mutex;
+
+    QMutexLocker locker(&mutex);
+
+    Key key(map, rotation, background);
+    auto itr = palettes.find(key);
+    if (itr != palettes.end()) {
+        return itr->second;
+    }
+
+    ColourMapper mapper(map, 1.0, double(maxPixel));
+    
+    QVector<QRgb> palette(maxPixel + 1);
+    palette[0] = background;
+    for (int pixel = 1; pixel <= maxPixel; ++pixel) {
+        int target = (pixel - 1 + rotation) % maxPixel + 1;
+        palette[pixel] = mapper.map(double(target)).rgb();
+    }
+
+    palettes[key] = palette;
+    return palette;
+}
 
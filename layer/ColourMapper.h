@@ -20,6 +20,7 @@
 #include <QColor>
 #include <QString>
 #include <QPixmap>
+#include <QVector>
 
 /**
  * A class for mapping intensity values onto various colour maps.
@@ -61,6 +62,15 @@ public:
     bool hasLightBackground() const;
 
     QPixmap getExamplePixmap(QSize size) const;
+
+    /**
+     * Return a 256-entry colour table, suitable for an indexed image,
+     * in which entry 0 is the given background colour and entries
+     * 1-255 span the whole of the given colour map, rotated by the
+     * given number of entries. Tables are calculated once and shared
+     * across the process, so this is cheap to call repeatedly.
+     */
+    static QVector<QRgb> getPalette(int map, int rotation, QRgb background);
     
 protected:
     int m_map;
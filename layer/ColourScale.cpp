@@ -18,8 +18,16 @@
 #include "base/AudioLevel.h"
 #include "base/LogRange.h"
 
+#include <QMutex>
+#include <QMutexLocker>
+
 #include <cmath>
+#include <cstring>
+#include <cstdint>
+#include <limits>
 #include <iostream>
+#include <map>
+#include <tuple>
 
 using namespace std;
 
@@ -86,6 +94,16 @@ ColourScale::ColourScale(Parameters parameters) :
              << ", mapped maxValue = " << m_mappedMax << endl;
         throw std::logic_error("maxValue must be greater than minValue [after mapping]");
     }
+
+    buildBreakpoints();
+
+    QRgb background;
+    if (m_mapper.hasLightBackground()) {
+        background = QColor(Qt::white).rgb();
+    } else {
+        background = QColor(Qt::black).rgb();
+    }
+    m_palette = ColourMapper::getPalette(m_params.colourMap, 0, background);
 }
 
 ColourScale::~ColourScale()
@@ -98,8 +116,72 @@ ColourScale::getScale() const
     return m_params.scaleType;
 }
 
+bool
+ColourScale::hasSamePixels(const ColourScale &other) const
+{
+    const Parameters &p = other.m_params;
+    return (m_params.scaleType == p.scaleType &&
+            m_params.minValue == p.minValue &&
+            m_params.maxValue == p.maxValue &&
+            m_params.threshold == p.threshold &&
+            m_params.gain == p.gain &&
+            m_params.multiple == p.multiple);
+}
+
 int
 ColourScale::getPixel(double value) const
+{
+    if (m_breakpoints.empty()) {
+        return getPixelCalculated(value);
+    }
+    
+    value *= m_params.gain;
+    
+    if (value < m_params.threshold) return 0;
+
+    if (m_params.scaleType == ColourScaleType::Log) {
+        if (!(value > 0.0)) {
+            // the table covers positive levels only
+            return getPixelForLevel(value);
+        }
+    } else if (m_params.scaleType == ColourScaleType::Absolute) {
+        value = fabs(value);
+    }
+
+    return lookUpPixel(value);
+}
+
+void
+ColourScale::getPixels(const float *values, int n, unsigned char *pixels) const
+{
+    if (m_breakpoints.empty()) {
+        for (int i = 0; i < n; ++i) {
+            pixels[i] = (unsigned char)getPixelCalculated(values[i]);
+        }
+        return;
+    }
+
+    double gain = m_params.gain;
+    double threshold = m_params.threshold;
+    bool log = (m_params.scaleType == ColourScaleType::Log);
+    bool absolute = (m_params.scaleType == ColourScaleType::Absolute);
+    
+    for (int i = 0; i < n; ++i) {
+        double value = values[i] * gain;
+        int pixel;
+        if (value < threshold) {
+            pixel = 0;
+        } else if (log && !(value > 0.0)) {
+            pixel = getPixelForLevel(value);
+        } else {
+            pixel = lookUpPixel(absolute ? fabs(value) : value);
+        }
+        pixels[i] = (unsigned char)pixel;
+    }
+}
+
+int
+ColourScale::getPixelCalculated(double value) const
 {
     double maxPixF = m_maxPixel;
 
@@ -114,6 +196,17 @@ ColourScale::getPixel(double value) const
     
     if (value < m_params.threshold) return 0;
 
+    return getPixelForLevel(value);
+}
+
+int
+ColourScale::getPixelForLevel(double value) const
+{
+    // value has had gain applied and is known to be at or above the
+    // threshold
+    
+    double maxPixF = m_maxPixel;
+
     double mapped = value;
 
     if (m_params.scaleType == ColourScaleType::Log) {
@@ -153,25 +246,242 @@ ColourScale::getPixel(double value) const
     return pixel;
 }
 
+// Map doubles onto unsigned integers in the same order, so that we
+// can bisect between two doubles exactly
+
+static uint64_t
+orderedKey(double d)
+{
+    const uint64_t sign = 0x8000000000000000ULL;
+    uint64_t u;
+    memcpy(&u, &d, sizeof(u));
+    return (u & sign) ? ~u : (u | sign);
+}
+
+static double
+fromOrderedKey(uint64_t k)
+{
+    const uint64_t sign = 0x8000000000000000ULL;
+    uint64_t u = (k & sign) ? (k & ~sign) : ~k;
+    double d;
+    memcpy(&d, &u, sizeof(d));
+    return d;
+}
+
+void
+ColourScale::buildBreakpoints()
+{
+    m_breakpoints.clear();
+
+    // Phase is a cheap linear mapping anyway. A zero or negative
+    // multiple makes the mapping non-increasing, which the table
+    // can't represent.
+    if (m_params.scaleType == ColourScaleType::Phase ||
+        !(m_params.multiple > 0.0)) {
+        return;
+    }
+
+    // The table depends only on these parameters, not on the gain
+    // (which is applied to a value before it is looked up) nor on the
+    // colour map, so scales that differ only in those, or that are
+    // recreated with the same parameters, can share it
+    
+    typedef std::tuple<int, double, double, double, double> Key;
+    static std::map<Key, std::vector<double>> tables;
+    static QMutex mutex;
+
+    Key key(int(m_params.scaleType), m_params.minValue, m_params.maxValue,
+            m_params.threshold, m_params.multiple);
+
+    {
+        QMutexLocker locker(&mutex);
+        auto itr = tables.find(key);
+        if (itr != tables.end()) {
+            m_breakpoints = itr->second;
+            return;
+        }
+    }
+
+    double lowest = m_params.threshold;
+    if (m_params.scaleType == ColourScaleType::Log) {
+        lowest = std::numeric_limits<double>::denorm_min();
+    } else if (m_params.scaleType == ColourScaleType::Absolute) {
+        lowest = 0.0;
+    }
+    double highest = std::numeric_limits<double>::infinity();
+
+    std::vector<double> breakpoints(m_maxPixel + 1);
+    breakpoints[0] = -highest;
+    breakpoints[1] = -highest;
+
+    double range = m_mappedMax - m_mappedMin;
+    
+    for (int pixel = 2; pixel <= m_maxPixel; ++pixel) {
+
+        // The guess inverts the mapping, but rounding means we
+        // always need to refine it
+
+        double proportion = double(pixel - 1) / m_maxPixel;
+        if (m_params.scaleType == ColourScaleType::Meter) {
+            proportion = AudioLevel::preview_to_multiplier
+                (pixel - 1, m_maxPixel - 1);
+        }
+        double guess = (m_mappedMin + proportion * range) / m_params.multiple;
+        if (m_params.scaleType == ColourScaleType::Log) {
+            guess = pow(10.0, guess);
+        }
+
+        double from = lowest;
+        if (pixel > 2 && breakpoints[pixel-1] > from) {
+            from = breakpoints[pixel-1];
+        }
+        
+        breakpoints[pixel] = refineBreakpoint(pixel, guess, from, highest);
+    }
+
+    m_breakpoints = breakpoints;
+
+    QMutexLocker locker(&mutex);
+
+    // Each table is only 2K, but with a normalised scale the range
+    // may be different every time, so start again if many build up
+    const size_t maxTables = 64;
+    if (tables.size() >= maxTables) {
+        tables.clear();
+    }
+    tables[key] = breakpoints;
+}
+
+double
+ColourScale::refineBreakpoint(int pixel, double guess,
+                              double lowest, double highest) const
+{
+    // The guess is the inverse of the mapping, so for the linear
+    // scales the breakpoint is usually within a step or two of it,
+    // which we can confirm with a couple of calls to the mapping.
+    // Only if it isn't (as with log scales, where rounding in the
+    // exponent puts the guess a few dozen steps away) do we go on to
+    // search for it.
+
+    const int maxSteps = 4;
+    const double inf = std::numeric_limits<double>::infinity();
+    
+    if (!(guess >= lowest)) guess = lowest; // also catches NaN
+    if (!(guess <= highest)) guess = highest;
+
+    double candidate = guess;
+
+    if (getPixelForLevel(candidate) >= pixel) {
+        // Step down to the lowest level that still reaches the pixel
+        for (int i = 0; i < maxSteps; ++i) {
+            if (candidate <= lowest) {
+                return lowest;
+            }
+            double below = nextafter(candidate, -inf);
+            if (below < lowest || getPixelForLevel(below) < pixel) {
+                return candidate;
+            }
+            candidate = below;
+        }
+    } else {
+        // Step up to the first level that reaches it
+        for (int i = 0; i < maxSteps; ++i) {
+            if (candidate >= highest) {
+                break;
+            }
+            candidate = nextafter(candidate, inf);
+            if (getPixelForLevel(candidate) >= pixel) {
+                return candidate;
+            }
+        }
+    }
+
+    return findBreakpoint(pixel, guess, lowest, highest);
+}
+
+double
+ColourScale::findBreakpoint(int pixel, double guess,
+                            double lowest, double highest) const
+{
+    // Return the lowest level in [lowest, highest] that maps to the
+    // given pixel or above, or infinity if there is none. We
+    // start from the guess, widen the search exponentially until it
+    // brackets the breakpoint, then bisect.
+    
+    if (getPixelForLevel(lowest) >= pixel) {
+        return lowest;
+    }
+    if (getPixelForLevel(highest) < pixel) {
+        return std::numeric_limits<double>::infinity();
+    }
+
+    if (!(guess >= lowest)) guess = lowest; // also catches NaN
+    if (!(guess <= highest)) guess = highest;
+    
+    uint64_t klowest = orderedKey(lowest);
+    uint64_t khighest = orderedKey(highest);
+    uint64_t k = orderedKey(guess);
+
+    // Invariant once bracketed: lo maps below pixel, hi maps to it
+    // or above
+    uint64_t lo, hi;
+    uint64_t step = 1;
+
+    if (getPixelForLevel(guess) >= pixel) {
+        hi = k;
+        while (true) {
+            lo = (hi - klowest > step ? hi - step : klowest);
+            if (getPixelForLevel(fromOrderedKey(lo)) < pixel) break;
+            hi = lo;
+            step *= 2;
+        }
+    } else {
+        lo = k;
+        while (true) {
+            hi = (khighest - lo > step ? lo + step : khighest);
+            if (getPixelForLevel(fromOrderedKey(hi)) >= pixel) break;
+            lo = hi;
+            step *= 2;
+        }
+    }
+
+    while (hi - lo > 1) {
+        uint64_t mid = lo + (hi - lo) / 2;
+        if (getPixelForLevel(fromOrderedKey(mid)) >= pixel) {
+            hi = mid;
+        } else {
+            lo = mid;
+        }
+    }
+
+    return fromOrderedKey(hi);
+}
+
 QColor
 ColourScale::getColourForPixel(int pixel, int rotation) const
 {
-    if (pixel < 0) {
-        pixel = 0;
+    if (pixel <= 0) {
+        return QColor(m_palette[0]);
     }
     if (pixel > m_maxPixel) {
         pixel = m_maxPixel;
     }
-    if (pixel == 0) {
-        if (m_mapper.hasLightBackground()) {
-            return Qt::white;
-        } else {
-            return Qt::black;
-        }
-    } else {
-        int target = int(pixel) + rotation;
-        while (target < 1) target += m_maxPixel;
-        while (target > m_maxPixel) target -= m_maxPixel;
-        return m_mapper.map(double(target));
+
+    // As ColourMapper::getPalette rotates the colours, but without
+    // going through its shared table
+    rotation %= m_maxPixel;
+    if (rotation < 0) rotation += m_maxPixel;
+    int target = (pixel - 1 + rotation) % m_maxPixel + 1;
+    
+    return QColor(m_palette[target]);
+}
+
+QVector<QRgb>
+ColourScale::getPalette(int rotation) const
+{
+    if (rotation % m_maxPixel == 0) {
+        return m_palette;
     }
+    return ColourMapper::getPalette(m_params.colourMap, rotation,
+                                    m_palette[0]);
 }
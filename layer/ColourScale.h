@@ -18,6 +18,8 @@
 
 #include "ColourMapper.h"
 
+#include <vector>
+
 enum class ColourScaleType {
     Linear,
     Meter,
@@ -84,15 +86,36 @@ public:
      * Return the general type of scale this is.
      */
     ColourScaleType getScale() const;
+
+    /**
+     * Return true if this scale maps every value to the same pixel
+     * number as the given scale does, so that the two differ at most
+     * in their colour maps and therefore in their palettes.
+     */
+    bool hasSamePixels(const ColourScale &other) const;
     
     /**
      * Return a pixel number (in the range 0-255 inclusive)
      * corresponding to the given value.  The pixel 0 is used only for
      * values below the threshold supplied in the constructor. All
      * other values are mapped onto the range 1-255.
+     *
+     * For most scales this is a lookup in a table of breakpoints
+     * calculated on construction (or shared with an earlier scale
+     * having the same parameters apart from gain and colour map),
+     * and involves no logarithms or
+     * division. The result is always the same as the full
+     * calculation would give.
      */
     int getPixel(double value) const;
 
+    /**
+     * Map n values to pixel numbers, as for getPixel, writing the
+     * results to pixels. This is the form to use when mapping a whole
+     * column at a time.
+     */
+    void getPixels(const float *values, int n, unsigned char *pixels) const;
+
     /**
      * Return the colour for the given pixel number (which must be in
      * the range 0-255). The pixel 0 is always the background
@@ -100,6 +123,14 @@ public:
      * colourmap rotation (which is also a value in the range 0-255).
      */
     QColor getColourForPixel(int pixel, int rotation) const;
+
+    /**
+     * Return the colour table for all 256 pixel numbers, taking into
+     * account the given colourmap rotation. Entry n is the colour
+     * that getColourForPixel(n, rotation) would return. The table is
+     * shared with any other scale using the same colourmap.
+     */
+    QVector<QRgb> getPalette(int rotation) const;
     
     /**
      * Return the colour corresponding to the given value. This is
@@ -115,6 +146,36 @@ private:
     double m_mappedMin;
     double m_mappedMax;
     static int m_maxPixel;
+
+    // The unrotated colour table, from which rotated colours are
+    // looked up directly
+    QVector<QRgb> m_palette;
+
+    // Quantiser: m_breakpoints[i] is the lowest level (i.e. value
+    // after gain, and made absolute for the absolute scale) that maps
+    // to pixel i or above, for i in 1..m_maxPixel, with
+    // m_breakpoints[0] less than any level. Empty if the scale is not
+    // monotonic in level, in which case we calculate each pixel in
+    // full.
+    std::vector<double> m_breakpoints;
+    
+    void buildBreakpoints();
+    double refineBreakpoint(int pixel, double guess,
+                            double lowest, double highest) const;
+    double findBreakpoint(int pixel, double guess,
+                          double lowest, double highest) const;
+    int getPixelForLevel(double level) const;
+    int getPixelCalculated(double value) const;
+    
+    int lookUpPixel(double level) const {
+        // branch-free binary search over the 256 breakpoints
+        const double *bp = m_breakpoints.data();
+        int i = 0;
+        for (int step = 128; step > 0; step >>= 1) {
+            i += (bp[i + step] <= level ? step : 0);
+        }
+        return i;
+    }
 };
 
 #endif
@@ -0,0 +1,91 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ColumnReader.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+#include "data/model/FFTModel.h"
+
+#include <vector>
+#include <algorithm>
+
+using namespace std;
+
+// Clip the range [minbin, minbin + count) to [0, height), zero-fill
+// the parts of values that fall outside it, and return the offset
+// into values and the count of the part that remains
+static void
+clipRange(int height, int &minbin, int &count, float *&values)
+{
+    int end = minbin + count;
+    
+    if (minbin < 0) {
+        int skip = std::min(-minbin, count);
+        fill(values, values + skip, 0.f);
+        values += skip;
+        count -= skip;
+        minbin = 0;
+    }
+
+    if (end > height) {
+        int over = std::min(end - height, count);
+        fill(values + count - over, values + count, 0.f);
+        count -= over;
+    }
+}
+
+void
+ColumnReader::getColumnRange(const DenseThreeDimensionalModel *model,
+                             int x, int minbin, int count,
+                             float *values)
+{
+    if (count <= 0) return;
+    
+    clipRange(model->getHeight(), minbin, count, values);
+    if (count <= 0) return;
+
+    const FFTModel *fft = dynamic_cast<const FFTModel *>(model);
+    if (fft) {
+        fft->getMagnitudesAt(x, values, minbin, count);
+        return;
+    }
+
+    if (count == 1) {
+        // A single value (as for a feature description) is for the
+        // model to look up however it can best do so
+        *values = model->getValueAt(x, minbin);
+        return;
+    }
+
+    vector<float> column = model->getColumn(x);
+    int available = int(column.size()) - minbin;
+    if (available < 0) available = 0;
+    if (available > count) available = count;
+
+    copy(column.data() + minbin, column.data() + minbin + available, values);
+    fill(values + available, values + count, 0.f);
+}
+
+void
+ColumnReader::getPhaseRange(const FFTModel *model,
+                            int x, int minbin, int count,
+                            float *values)
+{
+    if (count <= 0) return;
+    
+    clipRange(model->getHeight(), minbin, count, values);
+    if (count <= 0) return;
+
+    model->getPhasesAt(x, values, minbin, count);
+}
@@ -0,0 +1,57 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef COLUMN_READER_H
+#define COLUMN_READER_H
+
+class DenseThreeDimensionalModel;
+class FFTModel;
+
+/**
+ * Read a contiguous range of bins from a column of a dense 3d model
+ * into a caller-provided buffer. Where the model can supply a bin
+ * range directly (as FFTModel can) only the requested bins are
+ * produced; a single bin of any other model is read using its
+ * getValueAt; otherwise the column is fetched and the range copied
+ * out of it. Either way the caller pays nothing for the full-column
+ * vector it would otherwise have had to slice itself, and a narrow
+ * range of a tall model costs in proportion to its width where the
+ * model allows.
+ *
+ * Any part of the requested range that lies outside the model's
+ * column is filled with zeros.
+ */
+class ColumnReader
+{
+public:
+    /**
+     * Read the values of bins minbin to minbin + count - 1 of
+     * column x of the given model into values, which must have room
+     * for count floats.
+     */
+    static void getColumnRange(const DenseThreeDimensionalModel *model,
+                               int x, int minbin, int count,
+                               float *values);
+
+    /**
+     * Read the phases of bins minbin to minbin + count - 1 of column
+     * x of the given FFT model into values, which must have room for
+     * count floats.
+     */
+    static void getPhaseRange(const FFTModel *model,
+                              int x, int minbin, int count,
+                              float *values);
+};
+
+#endif
@@ -0,0 +1,229 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "CompactColumnCache.h"
+#include "ColumnReader.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+
+#include "base/HitCount.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+CompactColumnCache::CompactColumnCache(const DenseThreeDimensionalModel *source,
+                                       Precision precision,
+                                       QMutex *sourceMutex) :
+    m_source(source),
+    m_sourceMutex(sourceMutex),
+    m_precision(precision),
+    m_width(source->getWidth()),
+    m_height(source->getHeight()),
+    m_generation(0)
+{
+    double rangeDb;
+
+    if (m_precision == Bits8) {
+        m_levels = 255;
+        rangeDb = 120.0;
+        m_values8.resize(size_t(m_width) * m_height, 0);
+    } else {
+        m_levels = 65535;
+        rangeDb = 200.0;
+        m_values16.resize(size_t(m_width) * m_height, 0);
+    }
+
+    m_logRange = rangeDb / 20.0 * log(10.0);
+
+    m_scales.resize(m_width, 0.f);
+    m_filled.resize(m_width, 0);
+
+    // Level 0 is reserved for values below the range, i.e. zero
+    m_levelValues.resize(m_levels + 1, 0.f);
+    for (int q = 1; q <= m_levels; ++q) {
+        m_levelValues[q] = float
+            (exp((double(q) / m_levels - 1.0) * m_logRange));
+    }
+}
+
+size_t
+CompactColumnCache::getBytes() const
+{
+    return getBytesFor(m_width, m_height, m_precision);
+}
+
+size_t
+CompactColumnCache::getBytesFor(int width, int height, Precision precision)
+{
+    size_t valueBytes = (precision == Bits8 ? 1 : 2);
+    return size_t(width) * size_t(height) * valueBytes +
+        size_t(width) * (sizeof(float) + 1);
+}
+
+void
+CompactColumnCache::invalidate()
+{
+    QMutexLocker locker(&m_mutex);
+    fill(m_filled.begin(), m_filled.end(), 0);
+    ++m_generation;
+}
+
+void
+CompactColumnCache::invalidate(int x0, int x1)
+{
+    QMutexLocker locker(&m_mutex);
+    if (x0 < 0) x0 = 0;
+    if (x1 >= m_width) x1 = m_width - 1;
+    for (int x = x0; x <= x1; ++x) {
+        m_filled[x] = 0;
+    }
+    ++m_generation;
+}
+
+float
+CompactColumnCache::quantiseColumn(const float *in, uint16_t *levels) const
+{
+    float max = 0.f;
+    for (int y = 0; y < m_height; ++y) {
+        if (in[y] > max) max = in[y];
+    }
+
+    double perLog = double(m_levels) / m_logRange;
+
+    for (int y = 0; y < m_height; ++y) {
+        float v = in[y];
+        int q = 0;
+        if (v > 0.f) {
+            // levels at max, falling by one per (range / levels)
+            double l = m_levels + log(v / max) * perLog;
+            if (l > 0.5) {
+                q = int(l + 0.5);
+                if (q > m_levels) q = m_levels;
+            }
+        }
+        levels[y] = uint16_t(q);
+    }
+
+    return max;
+}
+
+void
+CompactColumnCache::readSource(int x, int minbin, int count,
+                               float *values) const
+{
+    if (m_sourceMutex) {
+        QMutexLocker locker(m_sourceMutex);
+        ColumnReader::getColumnRange(m_source, x, minbin, count, values);
+    } else {
+        ColumnReader::getColumnRange(m_source, x, minbin, count, values);
+    }
+}
+
+template <typename T>
+void
+CompactColumnCache::dequantise(const T *levels, float scale,
+                               int minbin, int count, float *values) const
+{
+    int end = minbin + count;
+    int y0 = max(minbin, 0);
+    int y1 = min(end, m_height);
+
+    float *out = values;
+    for (int y = minbin; y < y0 && y < end; ++y) {
+        *out++ = 0.f;
+    }
+
+    const float *table = m_levelValues.data();
+    for (int y = y0; y < y1; ++y) {
+        *out++ = table[levels[y]] * scale;
+    }
+
+    while (out < values + count) {
+        *out++ = 0.f;
+    }
+}
+
+void
+CompactColumnCache::getColumnRange(int x, int minbin, int count,
+                                   float *values) const
+{
+    static HitCount counter("CompactColumnCache: columns");
+
+    if (count <= 0) return;
+
+    if (x < 0 || x >= m_width) {
+        readSource(x, minbin, count, values);
+        return;
+    }
+
+    size_t base = size_t(x) * m_height;
+    int generation = 0;
+    
+    {
+        QMutexLocker locker(&m_mutex);
+
+        if (m_filled[x]) {
+            counter.hit();
+            if (m_precision == Bits8) {
+                dequantise(m_values8.data() + base, m_scales[x],
+                           minbin, count, values);
+            } else {
+                dequantise(m_values16.data() + base, m_scales[x],
+                           minbin, count, values);
+            }
+            return;
+        }
+
+        generation = m_generation;
+    }
+
+    counter.miss();
+
+    // Read and quantise the whole column without the lock, so that
+    // other threads can go on reading columns we already have
+    
+    vector<float> column(m_height, 0.f);
+    readSource(x, 0, m_height, column.data());
+
+    vector<uint16_t> levels(m_height, 0);
+    float scale = quantiseColumn(column.data(), levels.data());
+
+    {
+        QMutexLocker locker(&m_mutex);
+
+        // Another thread may have filled the column meanwhile, which
+        // is harmless, or invalidated it, in which case what we have
+        // read is still the best available but may not be stored
+        if (!m_filled[x] && m_generation == generation) {
+            if (m_precision == Bits8) {
+                for (int y = 0; y < m_height; ++y) {
+                    m_values8[base + y] = uint8_t(levels[y]);
+                }
+            } else {
+                copy(levels.begin(), levels.end(),
+                     m_values16.begin() + base);
+            }
+            m_scales[x] = scale;
+            m_filled[x] = 1;
+        }
+    }
+
+    // Return the values as they would have been read from the store,
+    // whether or not we stored them
+    dequantise(levels.data(), scale, minbin, count, values);
+}
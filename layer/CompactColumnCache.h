@@ -0,0 +1,137 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef COMPACT_COLUMN_CACHE_H
+#define COMPACT_COLUMN_CACHE_H
+
+#include <QMutex>
+
+#include <vector>
+#include <cstddef>
+#include <cstdint>
+
+class DenseThreeDimensionalModel;
+
+/**
+ * A whole-model cache of the columns of a dense 3d model of
+ * non-negative magnitudes, such as an FFTModel, held in compact
+ * quantised form. Each value is stored in 8 or 16 bits as a
+ * logarithm of its ratio to the maximum of its column, which is
+ * stored alongside as a per-column scale. Values more than the
+ * dynamic range below the column maximum are stored as zero.
+ *
+ * With 8 bits and a 120dB range the step between levels is under
+ * half a decibel, which is as fine as any colour scale can show, for
+ * a quarter of the memory of a cache of floats. With 16 bits the
+ * quantisation is finer than that of any display, for half the
+ * memory.
+ *
+ * Columns are filled from the source model on first use. The cache
+ * may be read from more than one thread.
+ */
+class CompactColumnCache
+{
+public:
+    enum Precision {
+        Bits8,
+        Bits16
+    };
+
+    /**
+     * Create a cache of the given precision for the given source
+     * model, which must outlive the cache. The cache is sized to the
+     * width and height of the model at construction: columns beyond
+     * that width are read straight from the model.
+     *
+     * If sourceMutex is non-null, it is held while (and only while)
+     * reading from the source, so that a source that is not safe to
+     * read from more than one thread may be shared with other
+     * readers that hold the same mutex. Columns already in the cache
+     * are returned without it.
+     */
+    CompactColumnCache(const DenseThreeDimensionalModel *source,
+                       Precision precision,
+                       QMutex *sourceMutex = 0);
+
+    Precision getPrecision() const {
+        return m_precision;
+    }
+
+    /**
+     * Return the memory that will be used by the cache once full.
+     */
+    size_t getBytes() const;
+
+    /**
+     * Return the memory that would be used by a cache of the given
+     * precision for a model of the given size.
+     */
+    static size_t getBytesFor(int width, int height, Precision precision);
+
+    /**
+     * Mark all columns as needing to be fetched again from the
+     * source.
+     */
+    void invalidate();
+
+    /**
+     * Mark columns x0 to x1 inclusive as needing to be fetched again
+     * from the source.
+     */
+    void invalidate(int x0, int x1);
+
+    /**
+     * Read the values of bins minbin to minbin + count - 1 of column
+     * x into values, which must have room for count floats, in the
+     * manner of ColumnReader::getColumnRange. The values are
+     * dequantised straight into the buffer.
+     */
+    void getColumnRange(int x, int minbin, int count, float *values) const;
+
+private:
+    const DenseThreeDimensionalModel *m_source;
+    QMutex *m_sourceMutex;
+    Precision m_precision;
+    int m_width;
+    int m_height;
+    int m_levels;
+    double m_logRange; // natural log of the dynamic range
+
+    // The mutex guards the stored columns, but is not held while
+    // reading from the source, which may be slow; the generation is
+    // incremented by every invalidation, so that a column read from
+    // the source before one is not then stored as valid
+    mutable QMutex m_mutex;
+    mutable std::vector<uint8_t> m_values8;
+    mutable std::vector<uint16_t> m_values16;
+    mutable std::vector<float> m_scales;
+    mutable std::vector<char> m_filled;
+    int m_generation;
+
+    // Dequantisation table: the value of each level as a proportion
+    // of the column maximum
+    std::vector<float> m_levelValues;
+
+    // Quantise a column of m_height values into levels, returning
+    // its scale
+    float quantiseColumn(const float *in, uint16_t *levels) const;
+
+    void readSource(int x, int minbin, int count, float *values) const;
+
+    template <typename T>
+    void dequantise(const T *levels, float scale,
+                    int minbin, int count, float *values) const;
+};
+
+#endif
@@ -50,10 +50,13 @@ ImageLayer::ImageLayer() :
     m_editingPoint(0, "", ""),
     m_editingCommand(0)
 {
+    CacheGovernor::getInstance()->registerClient(this);
 }
 
 ImageLayer::~ImageLayer()
 {
+    CacheGovernor::getInstance()->unregisterClient(this);
+
     for (FileSourceMap::iterator i = m_fileSources.begin();
          i != m_fileSources.end(); ++i) {
         delete i->second;
@@ -497,6 +500,42 @@ ImageLayer::setLayerDormant(const LayerGeometryProvider *v, bool dormant)
 
 //!!! how to reap no-longer-used images?
 
+size_t
+ImageLayer::getCacheBytes() const
+{
+    QMutexLocker locker(&m_imageMapMutex);
+
+    size_t bytes = 0;
+    for (const auto &v: m_scaled) {
+        for (const auto &i: v.second) {
+            // Unscaled images share their data with the general image
+            // map, which is not ours to release
+            auto itr = m_images.find(i.first);
+            if (itr != m_images.end() &&
+                itr->second.cacheKey() == i.second.cacheKey()) {
+                continue;
+            }
+            bytes += size_t(i.second.bytesPerLine()) * i.second.height();
+        }
+    }
+    return bytes;
+}
+
+double
+ImageLayer::getCacheRebuildCost() const
+{
+    // Rescaling an image with smooth transformation takes a few
+    // milliseconds per megapixel
+    return double(getCacheBytes()) * 1e-9;
+}
+
+void
+ImageLayer::releaseCache()
+{
+    QMutexLocker locker(&m_imageMapMutex);
+    m_scaled.clear();
+}
+
 bool
 ImageLayer::getImageOriginalSize(QString name, QSize &size) const
 {
@@ -522,6 +561,8 @@ ImageLayer::getImage(LayerGeometryProvider *v, QString name, QSize maxSize) cons
 //    SVDEBUG << "ImageLayer::getImage(" << v << ", " << name << ", ("
 //              << maxSize.width() << "x" << maxSize.height() << "))" << endl;
 
+    CacheGovernor::getInstance()->touch(const_cast<ImageLayer *>(this));
+
     if (!m_scaled[v][name].isNull()  &&
         ((m_scaled[v][name].width()  == maxSize.width() &&
           m_scaled[v][name].height() <= maxSize.height()) ||
@@ -17,6 +17,7 @@
 #define _IMAGE_LAYER_H_
 
 #include "Layer.h"
+#include "CacheGovernor.h"
 #include "data/model/ImageModel.h"
 
 #include <QObject>
@@ -30,7 +31,8 @@ class View;
 class QPainter;
 class FileSource;
 
-class ImageLayer : public Layer
+class ImageLayer : public Layer,
+                   public CacheGovernor::Client
 {
     Q_OBJECT
 
@@ -100,6 +102,14 @@ public:
 
     virtual bool addImage(sv_frame_t frame, QString url); // using a command
 
+    /**
+     * CacheGovernor::Client methods, for the images scaled for
+     * display in each view.
+     */
+    virtual size_t getCacheBytes() const override;
+    virtual double getCacheRebuildCost() const override;
+    virtual void releaseCache() override;
+
 protected slots:
     void checkAddSources();
     void fileSourceReady();
@@ -0,0 +1,141 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "MagnitudeRangeTree.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+
+using namespace std;
+
+// Upper limit on the number of leaves, beyond which columns are
+// grouped into larger blocks
+static const int maxLeaves = 65536;
+
+MagnitudeRangeTree::MagnitudeRangeTree() :
+    m_blockSize(1),
+    m_leaves(0)
+{
+}
+
+void
+MagnitudeRangeTree::clear()
+{
+    QMutexLocker locker(&m_mutex);
+    m_blockSize = 1;
+    m_leaves = 0;
+    m_nodes.clear();
+}
+
+void
+MagnitudeRangeTree::sample(int column0, int column1,
+                           const MagnitudeRange &range)
+{
+    if (!range.isSet()) return;
+    if (column0 < 0) column0 = 0;
+    if (column1 <= column0) return;
+    
+    QMutexLocker locker(&m_mutex);
+
+    ensureColumns(column1);
+
+    sampleLeaves(column0 / m_blockSize,
+                 (column1 - 1) / m_blockSize + 1,
+                 range);
+}
+
+MagnitudeRange
+MagnitudeRangeTree::getRange(int column0, int column1) const
+{
+    MagnitudeRange result;
+    
+    if (column0 < 0) column0 = 0;
+    if (column1 <= column0) return result;
+
+    QMutexLocker locker(&m_mutex);
+
+    if (m_leaves == 0) return result;
+    
+    int lo = column0 / m_blockSize;
+    int hi = (column1 - 1) / m_blockSize + 1;
+    if (hi > m_leaves) hi = m_leaves;
+    if (lo >= hi) return result;
+
+    // standard bottom-up walk over the half-open leaf span [lo, hi)
+    for (lo += m_leaves, hi += m_leaves; lo < hi; lo /= 2, hi /= 2) {
+        if (lo & 1) result.sample(m_nodes[lo++]);
+        if (hi & 1) result.sample(m_nodes[--hi]);
+    }
+
+    return result;
+}
+
+void
+MagnitudeRangeTree::sampleLeaves(int leaf0, int leaf1,
+                                 const MagnitudeRange &range)
+{
+    for (int leaf = leaf0; leaf < leaf1; ++leaf) {
+        int node = leaf + m_leaves;
+        // ancestors already containing the range need no update
+        while (node >= 1) {
+            MagnitudeRange &r = m_nodes[node];
+            if (r.isSet() &&
+                r.getMin() <= range.getMin() &&
+                r.getMax() >= range.getMax()) {
+                break;
+            }
+            r.sample(range);
+            node /= 2;
+        }
+    }
+}
+
+void
+MagnitudeRangeTree::ensureColumns(int columns)
+{
+    if (m_leaves * m_blockSize >= columns) {
+        return;
+    }
+
+    int blockSize = m_blockSize;
+    while ((columns + blockSize - 1) / blockSize > maxLeaves) {
+        blockSize *= 2;
+    }
+
+    int blocks = (columns + blockSize - 1) / blockSize;
+    int leaves = 1;
+    while (leaves < blocks) {
+        leaves *= 2;
+    }
+
+    vector<MagnitudeRange> oldNodes;
+    oldNodes.swap(m_nodes);
+    int oldLeaves = m_leaves;
+    int oldBlockSize = m_blockSize;
+
+    m_nodes = vector<MagnitudeRange>(2 * leaves);
+    m_leaves = leaves;
+    m_blockSize = blockSize;
+
+    // Because block sizes are always powers of two, each old leaf
+    // falls within a single new one
+    for (int i = 0; i < oldLeaves; ++i) {
+        const MagnitudeRange &r = oldNodes[oldLeaves + i];
+        if (r.isSet()) {
+            int leaf = (i * oldBlockSize) / m_blockSize;
+            sampleLeaves(leaf, leaf + 1, r);
+        }
+    }
+}
@@ -0,0 +1,72 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef MAGNITUDE_RANGE_TREE_H
+#define MAGNITUDE_RANGE_TREE_H
+
+#include "base/MagnitudeRange.h"
+
+#include <QMutex>
+
+#include <vector>
+
+/**
+ * A record of the magnitude ranges seen in the columns of a model,
+ * arranged as a segment tree so that the overall range of any span
+ * of columns can be retrieved in logarithmic time. This allows the
+ * range of the visible area of a view to be known before rendering
+ * it, for any columns that have been rendered before.
+ *
+ * To keep the tree small for long models, columns are grouped into
+ * blocks of equal size, chosen so that there are no more than a
+ * fixed number of blocks, and ranges are recorded per block. A query
+ * therefore includes every column of any block it touches. The tree
+ * grows as needed to accommodate the highest column sampled.
+ *
+ * All methods are thread-safe.
+ */
+class MagnitudeRangeTree
+{
+public:
+    MagnitudeRangeTree();
+
+    /**
+     * Forget all recorded ranges.
+     */
+    void clear();
+
+    /**
+     * Sample the given range into the record for columns column0 to
+     * column1-1 inclusive.
+     */
+    void sample(int column0, int column1, const MagnitudeRange &range);
+
+    /**
+     * Return the range of all that has been sampled into any of the
+     * columns column0 to column1-1 inclusive, or an unset range if
+     * nothing has.
+     */
+    MagnitudeRange getRange(int column0, int column1) const;
+
+private:
+    mutable QMutex m_mutex;
+    int m_blockSize;  // columns per leaf
+    int m_leaves;     // a power of two
+    std::vector<MagnitudeRange> m_nodes; // 2 * m_leaves, root at 1
+
+    void sampleLeaves(int leaf0, int leaf1, const MagnitudeRange &range);
+    void ensureColumns(int columns);
+};
+
+#endif
@@ -0,0 +1,185 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "PeakColumnCache.h"
+#include "ColumnReader.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+
+#include "base/HitCount.h"
+
+#include <QMutexLocker>
+
+#include <algorithm>
+
+using namespace std;
+
+PeakColumnCache::PeakColumnCache(const DenseThreeDimensionalModel *source,
+                                 int columnsPerPeak,
+                                 QMutex *sourceMutex) :
+    m_model(source),
+    m_cache(0),
+    m_sourceMutex(sourceMutex),
+    m_columnsPerPeak(max(columnsPerPeak, 1)),
+    m_height(source->getHeight()),
+    m_resolution(source->getResolution() * m_columnsPerPeak),
+    m_filledCount(0),
+    m_generation(0)
+{
+}
+
+PeakColumnCache::PeakColumnCache(const PeakColumnCache *source,
+                                 int columnsPerPeak) :
+    m_model(0),
+    m_cache(source),
+    m_sourceMutex(0),
+    m_columnsPerPeak(max(columnsPerPeak, 1)),
+    m_height(source->getHeight()),
+    m_resolution(source->getResolution() * m_columnsPerPeak),
+    m_filledCount(0),
+    m_generation(0)
+{
+}
+
+int
+PeakColumnCache::getSourceWidth() const
+{
+    if (m_cache) {
+        return m_cache->getWidth();
+    }
+    return m_model->getWidth();
+}
+
+int
+PeakColumnCache::getWidth() const
+{
+    int sw = getSourceWidth();
+    return sw / m_columnsPerPeak + (sw % m_columnsPerPeak ? 1 : 0);
+}
+
+size_t
+PeakColumnCache::getBytes() const
+{
+    QMutexLocker locker(&m_mutex);
+    return m_filledCount * m_height * sizeof(float);
+}
+
+void
+PeakColumnCache::invalidate()
+{
+    QMutexLocker locker(&m_mutex);
+    m_columns.clear();
+    m_filledCount = 0;
+    ++m_generation;
+}
+
+void
+PeakColumnCache::invalidate(int x0, int x1)
+{
+    QMutexLocker locker(&m_mutex);
+    if (x0 < 0) x0 = 0;
+    if (x1 >= int(m_columns.size())) x1 = int(m_columns.size()) - 1;
+    for (int x = x0; x <= x1; ++x) {
+        if (!m_columns[x].empty()) {
+            vector<float>().swap(m_columns[x]);
+            --m_filledCount;
+        }
+    }
+    ++m_generation;
+}
+
+void
+PeakColumnCache::readSource(int x, float *values) const
+{
+    if (m_cache) {
+        m_cache->getColumnRange(x, 0, m_height, values);
+    } else if (m_sourceMutex) {
+        QMutexLocker locker(m_sourceMutex);
+        ColumnReader::getColumnRange(m_model, x, 0, m_height, values);
+    } else {
+        ColumnReader::getColumnRange(m_model, x, 0, m_height, values);
+    }
+}
+
+void
+PeakColumnCache::getColumnRange(int x, int minbin, int count,
+                                float *values) const
+{
+    static HitCount counter("PeakColumnCache: columns");
+
+    if (count <= 0) return;
+
+    int generation = 0;
+
+    {
+        QMutexLocker locker(&m_mutex);
+
+        if (x >= 0 && x < int(m_columns.size()) && !m_columns[x].empty()) {
+            counter.hit();
+            const vector<float> &column = m_columns[x];
+            for (int i = 0; i < count; ++i) {
+                int y = minbin + i;
+                values[i] = (y >= 0 && y < m_height ? column[y] : 0.f);
+            }
+            return;
+        }
+
+        generation = m_generation;
+    }
+
+    counter.miss();
+
+    // Read and reduce the whole column without the lock, so that
+    // other threads can go on reading columns we already have
+
+    vector<float> peaks(m_height, 0.f);
+
+    int sw = getSourceWidth();
+    int s0 = x * m_columnsPerPeak;
+    int s1 = min(s0 + m_columnsPerPeak, sw);
+
+    if (x >= 0 && s0 < s1) {
+        readSource(s0, peaks.data());
+        vector<float> column(m_height, 0.f);
+        for (int s = s0 + 1; s < s1; ++s) {
+            readSource(s, column.data());
+            for (int y = 0; y < m_height; ++y) {
+                peaks[y] = max(peaks[y], column[y]);
+            }
+        }
+    }
+
+    // A peak whose source columns are not all there yet is returned
+    // but not stored, as it will change once they are
+    bool complete = (x >= 0 && s0 + m_columnsPerPeak <= sw);
+
+    for (int i = 0; i < count; ++i) {
+        int y = minbin + i;
+        values[i] = (y >= 0 && y < m_height ? peaks[y] : 0.f);
+    }
+
+    if (!complete) return;
+
+    QMutexLocker locker(&m_mutex);
+
+    // Another thread may have filled the column meanwhile, which is
+    // harmless, or invalidated it, in which case what we have read
+    // may not be stored
+    if (m_generation != generation) return;
+    if (x >= int(m_columns.size())) m_columns.resize(x + 1);
+    if (m_columns[x].empty()) {
+        m_columns[x].swap(peaks);
+        ++m_filledCount;
+    }
+}
@@ -0,0 +1,135 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef PEAK_COLUMN_CACHE_H
+#define PEAK_COLUMN_CACHE_H
+
+#include <QMutex>
+
+#include <vector>
+#include <cstddef>
+
+class DenseThreeDimensionalModel;
+
+/**
+ * A cache of the bin-wise peaks of a dense 3d model, each of whose
+ * columns holds the maximum of each bin across a fixed number of
+ * consecutive columns of its source. The source is either a model or
+ * another peak cache, so that a pyramid of them may be built up with
+ * each level taken from the one below. With one column per peak, it
+ * is simply a cache of the source's columns.
+ *
+ * This does the job of Dense3DModelPeakCache for the renderers, but
+ * unlike that it can be read a bin range at a time, straight into a
+ * caller's buffer, in the manner of ColumnReader, and it can have a
+ * range of its columns invalidated without losing the rest.
+ *
+ * Columns are filled from the source on first use. The cache may be
+ * read from more than one thread.
+ */
+class PeakColumnCache
+{
+public:
+    /**
+     * Create a cache of the peaks of the given model, taken across
+     * columnsPerPeak columns at a time. The model must outlive the
+     * cache. If sourceMutex is non-null, it is held while (and only
+     * while) reading from the model, as for CompactColumnCache.
+     */
+    PeakColumnCache(const DenseThreeDimensionalModel *source,
+                    int columnsPerPeak,
+                    QMutex *sourceMutex = 0);
+
+    /**
+     * Create a cache of the peaks of another peak cache, which must
+     * outlive this one, taken across columnsPerPeak of its columns
+     * at a time.
+     */
+    PeakColumnCache(const PeakColumnCache *source,
+                    int columnsPerPeak);
+
+    /**
+     * Return the number of columns, which follows the width of the
+     * source model as it grows.
+     */
+    int getWidth() const;
+
+    int getHeight() const {
+        return m_height;
+    }
+
+    /**
+     * Return the number of columns of the immediate source (model or
+     * cache) taken into each peak.
+     */
+    int getColumnsPerPeak() const {
+        return m_columnsPerPeak;
+    }
+
+    /**
+     * Return the number of sample frames per column, in the manner
+     * of DenseThreeDimensionalModel::getResolution.
+     */
+    int getResolution() const {
+        return m_resolution;
+    }
+
+    /**
+     * Return the memory used by the columns filled so far.
+     */
+    size_t getBytes() const;
+
+    /**
+     * Mark all columns as needing to be fetched again from the
+     * source.
+     */
+    void invalidate();
+
+    /**
+     * Mark columns x0 to x1 inclusive (of this cache, not of its
+     * source) as needing to be fetched again from the source. This
+     * does not invalidate any cache this one is taken from.
+     */
+    void invalidate(int x0, int x1);
+
+    /**
+     * Read the values of bins minbin to minbin + count - 1 of column
+     * x into values, which must have room for count floats, in the
+     * manner of ColumnReader::getColumnRange.
+     */
+    void getColumnRange(int x, int minbin, int count, float *values) const;
+
+private:
+    const DenseThreeDimensionalModel *m_model;
+    const PeakColumnCache *m_cache;
+    QMutex *m_sourceMutex;
+    int m_columnsPerPeak;
+    int m_height;
+    int m_resolution;
+
+    // The mutex guards the stored columns, but is not held while
+    // reading from the source; the generation is incremented by
+    // every invalidation, so that a column read from the source
+    // before one is not then stored as valid. An unfilled column is
+    // an empty vector.
+    mutable QMutex m_mutex;
+    mutable std::vector<std::vector<float>> m_columns;
+    mutable size_t m_filledCount;
+    int m_generation;
+
+    int getSourceWidth() const;
+    void readSource(int x, float *values) const;
+};
+
+#endif
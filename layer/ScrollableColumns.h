@@ -0,0 +1,51 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SCROLLABLE_COLUMNS_H
+#define SCROLLABLE_COLUMNS_H
+
+#include "base/BaseTypes.h"
+
+/**
+ * Frame-to-column arithmetic shared by the scrollable caches, whose
+ * columns (or pixels) are each zoomLevel frames wide, counting from
+ * the cache's start frame.
+ */
+class ScrollableColumns
+{
+public:
+    /**
+     * Find the columns affected by a change to the frames from
+     * startFrame up to endFrame, rounding outward so that any column
+     * containing any part of that range is included. On return the
+     * affected columns are x0 up to (but not including) x1, relative
+     * to the column that starts at cacheStartFrame; either may lie
+     * outside the cache.
+     */
+    static void getAffectedColumns(sv_frame_t cacheStartFrame,
+                                   int zoomLevel,
+                                   sv_frame_t startFrame,
+                                   sv_frame_t endFrame,
+                                   sv_frame_t &x0,
+                                   sv_frame_t &x1) {
+        sv_frame_t f0 = startFrame - cacheStartFrame;
+        sv_frame_t f1 = endFrame - cacheStartFrame;
+        x0 = f0 / zoomLevel;
+        if (f0 < 0 && x0 * zoomLevel != f0) --x0;
+        x1 = f1 / zoomLevel;
+        if (f1 > 0 && x1 * zoomLevel != f1) ++x1;
+    }
+};
+
+#endif
@@ -13,6 +13,7 @@
 */
 
 #include "ScrollableImageCache.h"
+#include "ScrollableColumns.h"
 
 #include "base/HitCount.h"
 
@@ -21,6 +22,45 @@ using namespace std;
 
 //#define DEBUG_SCROLLABLE_IMAGE_CACHE 1
 
+void
+ScrollableImageCache::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (!isValid() || m_zoomLevel <= 0 || endFrame <= startFrame) {
+        return;
+    }
+
+    sv_frame_t x0 = 0, x1 = 0;
+    ScrollableColumns::getAffectedColumns(m_startFrame, m_zoomLevel,
+                                          startFrame, endFrame, x0, x1);
+
+    int left = getValidLeft();
+    int right = getValidRight();
+
+#ifdef DEBUG_SCROLLABLE_IMAGE_CACHE
+    cerr << "ScrollableImageCache::invalidate: frames " << startFrame
+         << " to " << endFrame << " -> x " << x0 << " to " << x1
+         << ", valid area " << left << " to " << right << endl;
+#endif
+
+    if (x1 <= left || x0 >= right) {
+        return;
+    }
+
+    if (x0 <= left && x1 >= right) {
+        invalidate();
+    } else if (x0 <= left) {
+        m_validLeft = int(x1);
+        m_validWidth = right - int(x1);
+    } else if (x1 >= right) {
+        m_validWidth = int(x0) - left;
+    } else if (x0 - left >= right - x1) {
+        m_validWidth = int(x0) - left;
+    } else {
+        m_validLeft = int(x1);
+        m_validWidth = right - int(x1);
+    }
+}
+
 void
 ScrollableImageCache::scrollTo(const LayerGeometryProvider *v,
                                sv_frame_t newStartFrame)
@@ -40,7 +80,12 @@ ScrollableImageCache::scrollTo(const LayerGeometryProvider *v,
         count.hit();
         return;
     }
-        
+
+    // Decaying record of recent scroll directions, for the benefit
+    // of anyone wanting to fill the margin ahead of time
+    m_scrollTrend = m_scrollTrend * 0.5 +
+        (newStartFrame > m_startFrame ? 1.0 : -1.0);
+    
     m_startFrame = newStartFrame;
         
     if (!isValid()) {
@@ -70,19 +115,21 @@ ScrollableImageCache::scrollTo(const LayerGeometryProvider *v,
     int dxp = dx;
     if (dxp < 0) dxp = -dxp;
 
-    int copylen = (w - dxp) * int(sizeof(QRgb));
+    int bytesPerPixel = m_image.depth() / 8;
+    int shift = dxp * bytesPerPixel;
+    int copylen = (w - dxp) * bytesPerPixel;
     for (int y = 0; y < m_image.height(); ++y) {
-        QRgb *line = (QRgb *)m_image.scanLine(y);
+        uchar *line = m_image.scanLine(y);
         if (dx < 0) {
-            memmove(line, line + dxp, copylen);
+            memmove(line, line + shift, copylen);
         } else {
-            memmove(line + dxp, line, copylen);
+            memmove(line + shift, line, copylen);
         }
     }
         
-    // update valid area
+    // update valid area, working in image coordinates
         
-    int px = m_validLeft;
+    int px = m_validLeft + m_margin;
     int pw = m_validWidth;
         
     px += dx;
@@ -106,10 +153,22 @@ ScrollableImageCache::scrollTo(const LayerGeometryProvider *v,
         }
     }
 
-    m_validLeft = px;
+    m_validLeft = px - m_margin;
     m_validWidth = pw;
 }
 
+void
+ScrollableImageCache::setColourTable(const QVector<QRgb> &table)
+{
+    if (!m_indexed) {
+        throw std::logic_error("Cache is not indexed in ScrollableImageCache::setColourTable");
+    }
+    m_colourTable = table;
+    if (!m_image.isNull()) {
+        m_image.setColorTable(m_colourTable);
+    }
+}
+
 void
 ScrollableImageCache::adjustToTouchValidArea(int &left, int &width,
                                              bool &isLeftOfValidArea) const
@@ -152,10 +211,12 @@ ScrollableImageCache::drawImage(int left,
              << m_image.height() << endl;
         throw std::logic_error("Image height must match cache height in ScrollableImageCache::drawImage");
     }
-    if (left < 0 || width < 0 || left + width > m_image.width()) {
+    if (left < -m_margin || width < 0 ||
+        left + width > m_size.width() + m_margin) {
         cerr << "ScrollableImageCache::drawImage: ERROR: Target area (left = "
              << left << ", width = " << width << ", so right = " << left + width
-             << ") out of bounds for cache of width " << m_image.width() << endl;
+             << ") out of bounds for cache of width " << m_size.width()
+             << " with margin " << m_margin << endl;
         throw std::logic_error("Target area out of bounds in ScrollableImageCache::drawImage");
     }
     if (imageLeft < 0 || imageWidth < 0 ||
@@ -167,11 +228,34 @@ ScrollableImageCache::drawImage(int left,
         throw std::logic_error("Source area out of bounds in ScrollableImageCache::drawImage");
     }
         
-    QPainter painter(&m_image);
-    painter.drawImage(QRect(left, 0, width, m_image.height()),
-                      image,
-                      QRect(imageLeft, 0, imageWidth, image.height()));
-    painter.end();
+    if (m_indexed) {
+        if (image.format() != QImage::Format_Indexed8) {
+            cerr << "ScrollableImageCache::drawImage: ERROR: Supplied image "
+                 << "format " << int(image.format()) << " is not indexed, "
+                 << "but cache is" << endl;
+            throw std::logic_error("Image must be indexed for indexed cache in ScrollableImageCache::drawImage");
+        }
+        if (imageWidth != width) {
+            cerr << "ScrollableImageCache::drawImage: ERROR: Source width "
+                 << imageWidth << " differs from target width " << width
+                 << ", but indexed cache cannot be scaled into" << endl;
+            throw std::logic_error("Image must not be scaled for indexed cache in ScrollableImageCache::drawImage");
+        }
+        for (int y = 0; y < m_image.height(); ++y) {
+            memcpy(m_image.scanLine(y) + left + m_margin,
+                   image.constScanLine(y) + imageLeft,
+                   width);
+        }
+    } else {
+        // Replace, rather than blend with, what was there before, as
+        // the image may be partly transparent
+        QPainter painter(&m_image);
+        painter.setCompositionMode(QPainter::CompositionMode_Source);
+        painter.drawImage(QRect(left + m_margin, 0, width, m_image.height()),
+                          image,
+                          QRect(imageLeft, 0, imageWidth, image.height()));
+        painter.end();
+    }
 
     if (!isValid()) {
         m_validLeft = left;
@@ -33,40 +33,107 @@
  *
  * The only way to *update* the valid area in a cache is to draw to it
  * using the drawImage call.
+ *
+ * The cache may optionally have an overscan margin, an off-screen
+ * area of a given width at either side of the view. All x coordinates
+ * used in the cache API are view coordinates, so with a margin m and
+ * view width w the cache spans x from -m to w+m and the valid area
+ * may extend beyond the view. A margin that has been filled ahead of
+ * time means that scrolling into it needs no further rendering.
+ *
+ * The cache image is normally ARGB32, but it may instead be indexed
+ * (8-bit with a colour table). Only indexed images may be drawn to
+ * an indexed cache, and changing its colour table recolours the
+ * whole cache at no cost.
  */
 class ScrollableImageCache
 {
 public:
     ScrollableImageCache() :
+        m_margin(0),
         m_validLeft(0),
         m_validWidth(0),
         m_startFrame(0),
-        m_zoomLevel(0)
+        m_zoomLevel(0),
+        m_scrollTrend(0.0),
+        m_indexed(false)
     {}
 
     void invalidate() {
         m_validWidth = 0;
     }
+
+    /**
+     * Invalidate the part of the cache that shows any of the frames
+     * from startFrame up to but not including endFrame. As the valid
+     * area must be contiguous, if that part lies within the valid
+     * area rather than at one end of it, only the larger of the two
+     * sides remains valid.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
     
     bool isValid() const {
         return m_validWidth > 0;
     }
 
+    /**
+     * Return the size of the view area of the cache, not including
+     * any overscan margins.
+     */
     QSize getSize() const {
-        return m_image.size();
+        return m_size;
     }
 
     /**
-     * Set the size of the cache. If the new size differs from the
-     * current size, the cache is invalidated.
+     * Set the size of the view area of the cache. If the new size
+     * differs from the current size, the cache is invalidated.
      */
     void resize(QSize newSize) {
         if (getSize() != newSize) {
-            m_image = QImage(newSize, QImage::Format_ARGB32_Premultiplied);
-            invalidate();
+            m_size = newSize;
+            recreateImage();
+        }
+    }
+
+    int getMargin() const {
+        return m_margin;
+    }
+
+    /**
+     * Set the width of the overscan margin at each side of the
+     * view. If the new margin differs from the current one, the cache
+     * is invalidated.
+     */
+    void setMargin(int margin) {
+        if (margin < 0) margin = 0;
+        if (m_margin != margin) {
+            m_margin = margin;
+            recreateImage();
         }
     }
         
+    bool isIndexed() const {
+        return m_indexed;
+    }
+
+    /**
+     * Set whether the cache image is indexed. If this differs from
+     * the current setting, the cache is invalidated.
+     */
+    void setIndexed(bool indexed) {
+        if (m_indexed != indexed) {
+            m_indexed = indexed;
+            recreateImage();
+        }
+    }
+
+    /**
+     * Set the colour table of an indexed cache. This does not affect
+     * the validity of the cache. It is an error to call this on a
+     * cache that is not indexed.
+     */
+    void setColourTable(const QVector<QRgb> &table);
+    
     int getValidLeft() const {
         return m_validLeft;
     }
@@ -117,10 +184,26 @@ public:
         }
     }
     
+    /**
+     * Return the cache image, including any overscan margins. View x
+     * coordinate x corresponds to x + getMargin() in the image.
+     */
     const QImage &getImage() const {
         return m_image;
     }
 
+    /**
+     * Return the direction in which the cache has been scrolling
+     * recently: 1 if toward later frames, -1 if toward earlier ones,
+     * or 0 if there is no clear trend. This is the side on which new
+     * material is likely to be needed next.
+     */
+    int getScrollDirection() const {
+        if (m_scrollTrend > 0.5) return 1;
+        if (m_scrollTrend < -0.5) return -1;
+        return 0;
+    }
+
     /**
      * Set the new start frame for the cache, according to the
      * geometry of the supplied LayerGeometryProvider, if possible
@@ -143,8 +226,14 @@ public:
      * Draw from an image onto the cache. The supplied image must have
      * the same height as the cache and the full height is always
      * drawn. The left and width parameters determine the target
-     * region of the cache, the imageLeft and imageWidth parameters
-     * the source region of the image.
+     * region of the cache (in view coordinates, which may extend into
+     * the margins), the imageLeft and imageWidth parameters the
+     * source region of the image. The target region is replaced
+     * with the source, including any transparency in it.
+     *
+     * If the cache is indexed, the image must be indexed too, its
+     * pixel indices are copied without reference to its colour table,
+     * and the source and target widths must be the same.
      */
     void drawImage(int left,
                    int width,
@@ -154,10 +243,27 @@ public:
     
 private:
     QImage m_image;
+    QSize m_size;
+    int m_margin;
     int m_validLeft;
     int m_validWidth;
     sv_frame_t m_startFrame;
     int m_zoomLevel;
+    double m_scrollTrend;
+    bool m_indexed;
+    QVector<QRgb> m_colourTable;
+
+    void recreateImage() {
+        if (m_indexed) {
+            m_image = QImage(m_size.width() + 2 * m_margin, m_size.height(),
+                             QImage::Format_Indexed8);
+            m_image.setColorTable(m_colourTable);
+        } else {
+            m_image = QImage(m_size.width() + 2 * m_margin, m_size.height(),
+                             QImage::Format_ARGB32_Premultiplied);
+        }
+        invalidate();
+    }
 };
 
 #endif
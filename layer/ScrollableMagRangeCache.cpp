@@ -13,14 +13,41 @@
 */
 
 #include "ScrollableMagRangeCache.h"
+#include "ScrollableColumns.h"
 
 #include "base/HitCount.h"
 
 #include <iostream>
+#include <algorithm>
 using namespace std;
 
 //#define DEBUG_SCROLLABLE_MAG_RANGE_CACHE 1
 
+void
+ScrollableMagRangeCache::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (m_zoomLevel <= 0 || endFrame <= startFrame) {
+        return;
+    }
+
+    sv_frame_t x0 = 0, x1 = 0;
+    ScrollableColumns::getAffectedColumns(m_startFrame, m_zoomLevel,
+                                          startFrame, endFrame, x0, x1);
+
+    sv_frame_t i0 = max(x0 + m_margin, sv_frame_t(0));
+    sv_frame_t i1 = min(x1 + m_margin, sv_frame_t(m_ranges.size()));
+
+#ifdef DEBUG_SCROLLABLE_MAG_RANGE_CACHE
+    cerr << "ScrollableMagRangeCache::invalidate: frames " << startFrame
+         << " to " << endFrame << " -> columns " << x0 << " to " << x1
+         << endl;
+#endif
+
+    for (sv_frame_t i = i0; i < i1; ++i) {
+        m_ranges[size_t(i)] = MagnitudeRange();
+    }
+}
+
 void
 ScrollableMagRangeCache::scrollTo(const LayerGeometryProvider *v,
                                   sv_frame_t newStartFrame)
@@ -102,7 +129,7 @@ ScrollableMagRangeCache::getRange(int x, int count) const
     cerr << "ScrollableMagRangeCache::getRange(" << x << ", " << count << ")" << endl;
 #endif
     for (int i = 0; i < count; ++i) {
-        r.sample(m_ranges.at(x + i));
+        r.sample(m_ranges.at(x + i + m_margin));
     }
     return r;
 }
@@ -110,13 +137,14 @@ ScrollableMagRangeCache::getRange(int x, int count) const
 void
 ScrollableMagRangeCache::sampleColumn(int column, const MagnitudeRange &r)
 {
-    if (!in_range_for(m_ranges, column)) {
+    if (!in_range_for(m_ranges, column + m_margin)) {
         cerr << "ERROR: ScrollableMagRangeCache::sampleColumn: column " << column
-             << " is out of range for cache of width " << m_ranges.size()
+             << " is out of range for cache of width " << m_width
+             << " with margin " << m_margin
              << " (with start frame " << m_startFrame << ")" << endl;
         throw logic_error("column out of range");
     } else {
-        m_ranges[column].sample(r);
+        m_ranges[column + m_margin].sample(r);
     }
 }
 
@@ -31,11 +31,17 @@
  *
  * The only way to *update* the valid area in a cache is to update the
  * magnitude range for a column using the sampleColumn call.
+ *
+ * Like ScrollableImageCache, the cache may have an overscan margin of
+ * columns at either side of the view, and column indices are view x
+ * coordinates, so they run from -margin to width+margin.
  */
 class ScrollableMagRangeCache
 {
 public:
     ScrollableMagRangeCache() :
+        m_width(0),
+        m_margin(0),
         m_startFrame(0),
         m_zoomLevel(0)
     {}
@@ -43,18 +49,47 @@ public:
     void invalidate() {
         m_ranges = std::vector<MagnitudeRange>(m_ranges.size());
     }
+
+    /**
+     * Clear the ranges of the columns that show any of the frames
+     * from startFrame up to but not including endFrame.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
     
+    /**
+     * Return the width of the view area of the cache in columns, not
+     * including any overscan margins.
+     */
     int getWidth() const {
-        return int(m_ranges.size());
+        return m_width;
     }
 
     /**
-     * Set the width of the cache in columns. If the new size differs
-     * from the current size, the cache is invalidated.
+     * Set the width of the view area of the cache in columns. If the
+     * new size differs from the current size, the cache is
+     * invalidated.
      */
     void resize(int newWidth) {
         if (getWidth() != newWidth) {
-            m_ranges = std::vector<MagnitudeRange>(newWidth);
+            m_width = newWidth;
+            m_ranges = std::vector<MagnitudeRange>(m_width + 2 * m_margin);
+        }
+    }
+
+    int getMargin() const {
+        return m_margin;
+    }
+
+    /**
+     * Set the number of overscan columns at each side of the view. If
+     * the new margin differs from the current one, the cache is
+     * invalidated.
+     */
+    void setMargin(int margin) {
+        if (margin < 0) margin = 0;
+        if (m_margin != margin) {
+            m_margin = margin;
+            m_ranges = std::vector<MagnitudeRange>(m_width + 2 * m_margin);
         }
     }
         
@@ -93,7 +128,8 @@ public:
     }
 
     bool isColumnSet(int column) const {
-        return in_range_for(m_ranges, column) && m_ranges.at(column).isSet();
+        return in_range_for(m_ranges, column + m_margin) &&
+            m_ranges.at(column + m_margin).isSet();
     }
 
     bool areColumnsSet(int x, int count) const {
@@ -107,7 +143,7 @@ public:
      * Get the magnitude range for a single column.
      */
     MagnitudeRange getRange(int column) const {
-        return m_ranges.at(column);
+        return m_ranges.at(column + m_margin);
     }
 
     /**
@@ -125,13 +161,16 @@ public:
     
     /**
      * Update a column in the cache, by column index. (Column zero is
-     * the first column in the cache, it has nothing to do with any
-     * underlying model that the cache may be used with.)
+     * the first column of the view area of the cache, it has nothing
+     * to do with any underlying model that the cache may be used
+     * with.)
      */
     void sampleColumn(int column, const MagnitudeRange &r);
     
 private:
-    std::vector<MagnitudeRange> m_ranges;
+    std::vector<MagnitudeRange> m_ranges; // including margins
+    int m_width;
+    int m_margin;
     sv_frame_t m_startFrame;
     int m_zoomLevel;
 };
@@ -0,0 +1,149 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#include "ScrollableRangeCache.h"
+#include "ScrollableColumns.h"
+
+#include "base/HitCount.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+
+using namespace std;
+
+//#define DEBUG_SCROLLABLE_RANGE_CACHE 1
+
+void
+ScrollableRangeCache::reallocate()
+{
+    int columns = m_width + 2 * m_margin;
+    m_ranges = vector<Range>(size_t(columns) * m_channels);
+    m_states = vector<char>(columns, Unset);
+}
+
+void
+ScrollableRangeCache::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (m_zoomLevel <= 0 || endFrame <= startFrame) {
+        return;
+    }
+
+    sv_frame_t x0 = 0, x1 = 0;
+    ScrollableColumns::getAffectedColumns(m_startFrame, m_zoomLevel,
+                                          startFrame, endFrame, x0, x1);
+
+    sv_frame_t i0 = max(x0 + m_margin, sv_frame_t(0));
+    sv_frame_t i1 = min(x1 + m_margin, sv_frame_t(m_states.size()));
+
+#ifdef DEBUG_SCROLLABLE_RANGE_CACHE
+    cerr << "ScrollableRangeCache::invalidate: frames " << startFrame
+         << " to " << endFrame << " -> columns " << x0 << " to " << x1
+         << endl;
+#endif
+
+    for (sv_frame_t i = i0; i < i1; ++i) {
+        m_states[size_t(i)] = Unset;
+    }
+}
+
+int
+ScrollableRangeCache::checkColumn(int column) const
+{
+    int ix = column + m_margin;
+    if (ix < 0 || ix >= int(m_states.size())) {
+        cerr << "ERROR: ScrollableRangeCache: column " << column
+             << " is out of range for cache of width " << m_width
+             << " with margin " << m_margin
+             << " (with start frame " << m_startFrame << ")" << endl;
+        throw logic_error("column out of range");
+    }
+    return ix;
+}
+
+void
+ScrollableRangeCache::setColumn(int column, const Range *ranges)
+{
+    int ix = checkColumn(column);
+    copy(ranges, ranges + m_channels,
+         m_ranges.begin() + size_t(ix) * m_channels);
+    m_states[ix] = Ranges;
+}
+
+void
+ScrollableRangeCache::setColumnBlank(int column)
+{
+    m_states[checkColumn(column)] = Blank;
+}
+
+void
+ScrollableRangeCache::scrollTo(const LayerGeometryProvider *v,
+                               sv_frame_t newStartFrame)
+{
+    static HitCount count("ScrollableRangeCache: scrolling");
+    
+    int dx = (v->getXForFrame(m_startFrame) -
+              v->getXForFrame(newStartFrame));
+
+#ifdef DEBUG_SCROLLABLE_RANGE_CACHE
+    cerr << "ScrollableRangeCache::scrollTo: start frame " << m_startFrame
+         << " -> " << newStartFrame << ", dx = " << dx << endl;
+#endif
+
+    if (m_startFrame == newStartFrame) {
+        // haven't moved
+        count.hit();
+        return;
+    }
+    
+    m_startFrame = newStartFrame;
+
+    if (dx == 0) {
+        // haven't moved visibly (even though start frame may have changed)
+        count.hit();
+        return;
+    }
+        
+    int w = int(m_states.size());
+
+    if (dx <= -w || dx >= w) {
+        // scrolled entirely off
+        invalidate();
+        count.miss();
+        return;
+    }
+
+    count.partial();
+
+    size_t ch = m_channels;
+    
+    if (dx < 0) {
+        // The new start frame is to the right of the old start
+        // frame: move the last w+dx columns left by -dx, and unset
+        // the -dx columns at the right
+        copy(m_ranges.begin() + size_t(-dx) * ch, m_ranges.end(),
+             m_ranges.begin());
+        copy(m_states.begin() + (-dx), m_states.end(), m_states.begin());
+        fill(m_states.end() + dx, m_states.end(), char(Unset));
+    } else {
+        // The new start frame is to the left of the old start frame:
+        // move the first w-dx columns right by dx, and unset the dx
+        // columns at the left
+        copy_backward(m_ranges.begin(), m_ranges.end() - size_t(dx) * ch,
+                      m_ranges.end());
+        copy_backward(m_states.begin(), m_states.end() - dx, m_states.end());
+        fill(m_states.begin(), m_states.begin() + dx, char(Unset));
+    }
+}
@@ -0,0 +1,203 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#ifndef SCROLLABLE_RANGE_CACHE_H
+#define SCROLLABLE_RANGE_CACHE_H
+
+#include "base/BaseTypes.h"
+
+#include "data/model/RangeSummarisableTimeValueModel.h"
+
+#include "LayerGeometryProvider.h"
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * A cached set of summary ranges for a waveform view that scrolls
+ * horizontally. The cache holds one range per channel for each
+ * column of the view, being the peak and mean levels the column
+ * shows, and scrolls in step with a ScrollableImageCache of the same
+ * geometry. Keeping the ranges alongside the image means the
+ * waveform can be redrawn, for example with a different gain or
+ * scale, without going back to the underlying model, and that
+ * scrolling need only fetch summaries for the newly exposed columns.
+ *
+ * Each column is either unset, blank (it shows no audio, for example
+ * because it is beyond the end of the model), or set to a range for
+ * every channel. Like ScrollableImageCache, the cache may have an
+ * overscan margin of columns at either side of the view, and column
+ * indices are view x coordinates, so they run from -margin to
+ * width+margin.
+ */
+class ScrollableRangeCache
+{
+public:
+    typedef RangeSummarisableTimeValueModel::Range Range;
+    
+    ScrollableRangeCache() :
+        m_width(0),
+        m_channels(0),
+        m_margin(0),
+        m_startFrame(0),
+        m_zoomLevel(0)
+    {}
+
+    void invalidate() {
+        m_states = std::vector<char>(m_states.size(), Unset);
+    }
+
+    /**
+     * Unset the columns that show any of the frames from startFrame
+     * up to but not including endFrame.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
+
+    int getWidth() const {
+        return m_width;
+    }
+
+    int getChannelCount() const {
+        return m_channels;
+    }
+
+    int getMargin() const {
+        return m_margin;
+    }
+
+    /**
+     * Return the memory used by the cache.
+     */
+    size_t getBytes() const {
+        return m_ranges.size() * sizeof(Range) + m_states.size();
+    }
+
+    /**
+     * Set the width of the view area of the cache in columns, and
+     * the number of channels it has ranges for. If either differs
+     * from the current value, the cache is invalidated.
+     */
+    void resize(int width, int channels) {
+        if (m_width != width || m_channels != channels) {
+            m_width = width;
+            m_channels = channels;
+            reallocate();
+        }
+    }
+
+    /**
+     * Set the number of overscan columns at each side of the view. If
+     * the new margin differs from the current one, the cache is
+     * invalidated.
+     */
+    void setMargin(int margin) {
+        if (margin < 0) margin = 0;
+        if (m_margin != margin) {
+            m_margin = margin;
+            reallocate();
+        }
+    }
+        
+    int getZoomLevel() const {
+        return m_zoomLevel;
+    }
+
+    /**
+     * Set the zoom level. If the new zoom level differs from the
+     * current one, the cache is invalidated.
+     */
+    void setZoomLevel(int zoom) {
+        if (m_zoomLevel != zoom) {
+            m_zoomLevel = zoom;
+            invalidate();
+        }
+    }
+
+    sv_frame_t getStartFrame() const {
+        return m_startFrame;
+    }
+
+    /**
+     * Set the start frame. If the new start frame differs from the
+     * current one, the cache is invalidated. To scroll, use
+     * scrollTo() instead.
+     */
+    void setStartFrame(sv_frame_t frame) {
+        if (m_startFrame != frame) {
+            m_startFrame = frame;
+            invalidate();
+        }
+    }
+
+    /**
+     * Return true if the column is either blank or has ranges.
+     */
+    bool isColumnSet(int column) const {
+        int ix = column + m_margin;
+        return ix >= 0 && ix < int(m_states.size()) && m_states[ix] != Unset;
+    }
+
+    bool isColumnBlank(int column) const {
+        return isColumnSet(column) && m_states[column + m_margin] == Blank;
+    }
+    
+    /**
+     * Return the ranges, one per channel, for a column that has
+     * them, or null for a column that is unset or blank.
+     */
+    const Range *getColumn(int column) const {
+        int ix = column + m_margin;
+        if (ix < 0 || ix >= int(m_states.size()) || m_states[ix] != Ranges) {
+            return 0;
+        }
+        return m_ranges.data() + size_t(ix) * m_channels;
+    }
+
+    /**
+     * Set the ranges for a column, from an array of
+     * getChannelCount() ranges. Throw std::logic_error if the column
+     * is out of range.
+     */
+    void setColumn(int column, const Range *ranges);
+
+    /**
+     * Mark a column as blank.
+     */
+    void setColumnBlank(int column);
+    
+    /**
+     * Set the new start frame for the cache, according to the
+     * geometry of the supplied LayerGeometryProvider, if possible
+     * also moving along any existing valid columns so that they
+     * continue to be valid for the new start frame.
+     */
+    void scrollTo(const LayerGeometryProvider *v, sv_frame_t newStartFrame);
+
+private:
+    enum State : char { Unset = 0, Blank, Ranges };
+    
+    std::vector<Range> m_ranges; // column-major, including margins
+    std::vector<char> m_states; // per column, including margins
+    int m_width;
+    int m_channels;
+    int m_margin;
+    sv_frame_t m_startFrame;
+    int m_zoomLevel;
+
+    void reallocate();
+    int checkColumn(int column) const;
+};
+
+#endif
@@ -0,0 +1,151 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ScrollableValueCache.h"
+#include "ScrollableColumns.h"
+
+#include "base/HitCount.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <algorithm>
+#include <cstring>
+
+using namespace std;
+
+//#define DEBUG_SCROLLABLE_VALUE_CACHE 1
+
+void
+ScrollableValueCache::reallocate()
+{
+    int columns = m_width + 2 * m_margin;
+    m_values = vector<float>(size_t(columns) * m_height);
+    m_states = vector<char>(columns, Unset);
+}
+
+void
+ScrollableValueCache::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (m_zoomLevel <= 0 || endFrame <= startFrame) {
+        return;
+    }
+
+    sv_frame_t x0 = 0, x1 = 0;
+    ScrollableColumns::getAffectedColumns(m_startFrame, m_zoomLevel,
+                                          startFrame, endFrame, x0, x1);
+
+    sv_frame_t i0 = max(x0 + m_margin, sv_frame_t(0));
+    sv_frame_t i1 = min(x1 + m_margin, sv_frame_t(m_states.size()));
+
+    for (sv_frame_t i = i0; i < i1; ++i) {
+        m_states[size_t(i)] = Unset;
+    }
+}
+
+int
+ScrollableValueCache::checkColumn(int column) const
+{
+    int ix = column + m_margin;
+    if (ix < 0 || ix >= int(m_states.size())) {
+        cerr << "ERROR: ScrollableValueCache: column " << column
+             << " is out of range for cache of width " << m_width
+             << " with margin " << m_margin
+             << " (with start frame " << m_startFrame << ")" << endl;
+        throw logic_error("column out of range");
+    }
+    return ix;
+}
+
+void
+ScrollableValueCache::setColumn(int column, const float *values)
+{
+    int ix = checkColumn(column);
+    if (m_height > 0) {
+        memcpy(m_values.data() + size_t(ix) * m_height, values,
+               m_height * sizeof(float));
+    }
+    m_states[ix] = Values;
+}
+
+void
+ScrollableValueCache::setColumnBlank(int column)
+{
+    m_states[checkColumn(column)] = Blank;
+}
+
+void
+ScrollableValueCache::unsetColumn(int column)
+{
+    m_states[checkColumn(column)] = Unset;
+}
+
+void
+ScrollableValueCache::scrollTo(const LayerGeometryProvider *v,
+                               sv_frame_t newStartFrame)
+{
+    static HitCount count("ScrollableValueCache: scrolling");
+    
+    int dx = (v->getXForFrame(m_startFrame) -
+              v->getXForFrame(newStartFrame));
+
+#ifdef DEBUG_SCROLLABLE_VALUE_CACHE
+    cerr << "ScrollableValueCache::scrollTo: start frame " << m_startFrame
+         << " -> " << newStartFrame << ", dx = " << dx << endl;
+#endif
+
+    if (m_startFrame == newStartFrame) {
+        // haven't moved
+        count.hit();
+        return;
+    }
+    
+    m_startFrame = newStartFrame;
+
+    if (dx == 0) {
+        // haven't moved visibly (even though start frame may have changed)
+        count.hit();
+        return;
+    }
+        
+    int w = int(m_states.size());
+
+    if (dx <= -w || dx >= w) {
+        // scrolled entirely off
+        invalidate();
+        count.miss();
+        return;
+    }
+
+    count.partial();
+
+    size_t h = m_height;
+    
+    if (dx < 0) {
+        // The new start frame is to the right of the old start
+        // frame: move the last w+dx columns left by -dx, and unset
+        // the -dx columns at the right
+        memmove(m_values.data(), m_values.data() + size_t(-dx) * h,
+                size_t(w + dx) * h * sizeof(float));
+        memmove(m_states.data(), m_states.data() + (-dx), w + dx);
+        fill(m_states.end() + dx, m_states.end(), char(Unset));
+    } else {
+        // The new start frame is to the left of the old start frame:
+        // move the first w-dx columns right by dx, and unset the dx
+        // columns at the left
+        memmove(m_values.data() + size_t(dx) * h, m_values.data(),
+                size_t(w - dx) * h * sizeof(float));
+        memmove(m_states.data() + dx, m_states.data(), w - dx);
+        fill(m_states.begin(), m_states.begin() + dx, char(Unset));
+    }
+}
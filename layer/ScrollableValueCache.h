@@ -0,0 +1,202 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef SCROLLABLE_VALUE_CACHE_H
+#define SCROLLABLE_VALUE_CACHE_H
+
+#include "base/BaseTypes.h"
+
+#include "LayerGeometryProvider.h"
+
+#include <vector>
+#include <cstddef>
+
+/**
+ * A cached set of pixel values, prior to colour mapping, for a view
+ * that scrolls horizontally, such as a spectrogram. The cache holds
+ * one column of values per column of the view, one value per pixel
+ * row, and scrolls in step with a ScrollableImageCache of the same
+ * geometry. Keeping these values alongside the image means the image
+ * can be recoloured, for example with a different gain or colour
+ * map, without going back to the underlying model.
+ *
+ * Each column is either unset, blank (rendered, but with nothing to
+ * show), or set to a column of values. Like ScrollableImageCache,
+ * the cache may have an overscan margin of columns at either side of
+ * the view, and column indices are view x coordinates, so they run
+ * from -margin to width+margin. Values within a column are indexed
+ * from the bottom of the view.
+ */
+class ScrollableValueCache
+{
+public:
+    ScrollableValueCache() :
+        m_width(0),
+        m_height(0),
+        m_margin(0),
+        m_startFrame(0),
+        m_zoomLevel(0)
+    {}
+
+    void invalidate() {
+        m_states = std::vector<char>(m_states.size(), Unset);
+    }
+
+    /**
+     * Unset the columns that show any of the frames from startFrame
+     * up to but not including endFrame.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
+
+    int getWidth() const {
+        return m_width;
+    }
+
+    int getHeight() const {
+        return m_height;
+    }
+
+    int getMargin() const {
+        return m_margin;
+    }
+
+    /**
+     * Return the memory used by the cache.
+     */
+    size_t getBytes() const {
+        return m_values.size() * sizeof(float) + m_states.size();
+    }
+
+    /**
+     * Set the width and height of the view area of the cache. If the
+     * new size differs from the current size, the cache is
+     * invalidated.
+     */
+    void resize(int width, int height) {
+        if (m_width != width || m_height != height) {
+            m_width = width;
+            m_height = height;
+            reallocate();
+        }
+    }
+
+    /**
+     * Set the number of overscan columns at each side of the view. If
+     * the new margin differs from the current one, the cache is
+     * invalidated.
+     */
+    void setMargin(int margin) {
+        if (margin < 0) margin = 0;
+        if (m_margin != margin) {
+            m_margin = margin;
+            reallocate();
+        }
+    }
+        
+    int getZoomLevel() const {
+        return m_zoomLevel;
+    }
+
+    /**
+     * Set the zoom level. If the new zoom level differs from the
+     * current one, the cache is invalidated.
+     */
+    void setZoomLevel(int zoom) {
+        if (m_zoomLevel != zoom) {
+            m_zoomLevel = zoom;
+            invalidate();
+        }
+    }
+
+    sv_frame_t getStartFrame() const {
+        return m_startFrame;
+    }
+
+    /**
+     * Set the start frame. If the new start frame differs from the
+     * current one, the cache is invalidated. To scroll, use
+     * scrollTo() instead.
+     */
+    void setStartFrame(sv_frame_t frame) {
+        if (m_startFrame != frame) {
+            m_startFrame = frame;
+            invalidate();
+        }
+    }
+
+    /**
+     * Return true if the column is either blank or has values.
+     */
+    bool isColumnSet(int column) const {
+        int ix = column + m_margin;
+        return ix >= 0 && ix < int(m_states.size()) && m_states[ix] != Unset;
+    }
+
+    bool isColumnBlank(int column) const {
+        return isColumnSet(column) && m_states[column + m_margin] == Blank;
+    }
+    
+    /**
+     * Return the values for a column that has them, or null for a
+     * column that is unset or blank.
+     */
+    const float *getColumn(int column) const {
+        int ix = column + m_margin;
+        if (ix < 0 || ix >= int(m_states.size()) || m_states[ix] != Values) {
+            return 0;
+        }
+        return m_values.data() + size_t(ix) * m_height;
+    }
+
+    /**
+     * Set the values for a column, from an array of getHeight()
+     * values. Throw std::logic_error if the column is out of range.
+     */
+    void setColumn(int column, const float *values);
+
+    /**
+     * Mark a column as blank.
+     */
+    void setColumnBlank(int column);
+    
+    /**
+     * Mark a column as unset, e.g. because its image has been drawn
+     * from somewhere that has no values for it.
+     */
+    void unsetColumn(int column);
+    
+    /**
+     * Set the new start frame for the cache, according to the
+     * geometry of the supplied LayerGeometryProvider, if possible
+     * also moving along any existing valid columns so that they
+     * continue to be valid for the new start frame.
+     */
+    void scrollTo(const LayerGeometryProvider *v, sv_frame_t newStartFrame);
+
+private:
+    enum State : char { Unset = 0, Blank, Values };
+    
+    std::vector<float> m_values; // column-major, including margins
+    std::vector<char> m_states; // per column, including margins
+    int m_width;
+    int m_height;
+    int m_margin;
+    sv_frame_t m_startFrame;
+    int m_zoomLevel;
+
+    void reallocate();
+    int checkColumn(int column) const;
+};
+
+#endif
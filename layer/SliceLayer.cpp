@@ -23,6 +23,7 @@
 #include "ColourDatabase.h"
 
 #include "PaintAssistant.h"
+#include "ColumnReader.h"
 
 #include <QPainter>
 #include <QPainterPath>
@@ -441,9 +442,13 @@ SliceLayer::paint(LayerGeometryProvider *v, QPainter &paint, QRect rect) const
     getBiasCurve(curve);
     int cs = int(curve.size());
 
+    std::vector<float> column(mh);
+
     for (int col = col0; col <= col1; ++col) {
+        ColumnReader::getColumnRange(m_sliceableModel, col, bin0, mh,
+                                     column.data());
         for (int bin = 0; bin < mh; ++bin) {
-            float value = m_sliceableModel->getValueAt(col, bin0 + bin);
+            float value = column[bin];
             if (bin < cs) value *= curve[bin];
             if (m_samplingMode == SamplePeak) {
                 if (value > m_values[bin]) m_values[bin] = value;
@@ -469,7 +474,10 @@ SliceLayer::paint(LayerGeometryProvider *v, QPainter &paint, QRect rect) const
 
     double nx = getXForBin(v, bin0);
 
-    ColourMapper mapper(m_colourMap, 0, 1);
+    // Entries 1-255 of the palette span the colour map; we don't use
+    // the background entry
+    QVector<QRgb> palette = ColourMapper::getPalette
+        (m_colourMap, 0, v->getBackground().rgb());
 
     for (int bin = 0; bin < mh; ++bin) {
 
@@ -507,7 +515,10 @@ SliceLayer::paint(LayerGeometryProvider *v, QPainter &paint, QRect rect) const
 
         } else if (m_plotStyle == PlotFilledBlocks) {
 
-            paint.fillRect(QRectF(x, y, nx - x, yorigin - y), mapper.map(norm));
+            if (norm < 0.0) norm = 0.0;
+            if (norm > 1.0) norm = 1.0;
+            QColor colour(palette[1 + int(lrint(norm * 254.0))]);
+            paint.fillRect(QRectF(x, y, nx - x, yorigin - y), colour);
         }
 
     }
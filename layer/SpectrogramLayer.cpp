@@ -28,7 +28,6 @@
 #include "base/StorageAdviser.h"
 #include "base/Exceptions.h"
 #include "widgets/CommandHistory.h"
-#include "data/model/Dense3DModelPeakCache.h"
 
 #include "ColourMapper.h"
 #include "PianoScale.h"
@@ -44,6 +43,7 @@
 #include <QMouseEvent>
 #include <QTextStream>
 #include <QSettings>
+#include <QThread>
 
 #include <iostream>
 
@@ -82,9 +82,13 @@ SpectrogramLayer::SpectrogramLayer(Configuration config) :
     m_haveDetailedScale(false),
     m_exiting(false),
     m_fftModel(0),
+    m_renderFFTModel(0),
     m_wholeCache(0),
-    m_peakCache(0),
-    m_peakCacheDivisor(8)
+    m_compactCache(0),
+    m_peakCacheDivisor(8),
+    m_peakCacheMaxDivisor(1024),
+    m_warmerCancelled(false),
+    m_magnitudes(&m_sourceMutex)
 {
     QString colourConfigName = "spectrogram-colour";
     int colourConfigDefault = int(ColourMapper::Green);
@@ -127,10 +131,14 @@ SpectrogramLayer::SpectrogramLayer(Configuration config) :
     connect(prefs, SIGNAL(propertyChanged(PropertyContainer::PropertyName)),
             this, SLOT(preferenceChanged(PropertyContainer::PropertyName)));
     setWindowType(prefs->getWindowType());
+
+    CacheGovernor::getInstance()->registerClient(this);
 }
 
 SpectrogramLayer::~SpectrogramLayer()
 {
+    CacheGovernor::getInstance()->unregisterClient(this);
+
     invalidateRenderers();
     deleteDerivedModels();
 }
@@ -138,17 +146,75 @@ SpectrogramLayer::~SpectrogramLayer()
 void
 SpectrogramLayer::deleteDerivedModels()
 {
+    deletePeakCaches();
+
     if (m_fftModel) m_fftModel->aboutToDelete();
-    if (m_peakCache) m_peakCache->aboutToDelete();
-    if (m_wholeCache) m_wholeCache->aboutToDelete();
+    if (m_renderFFTModel) m_renderFFTModel->aboutToDelete();
 
     delete m_fftModel;
-    delete m_peakCache;
+    delete m_renderFFTModel;
     delete m_wholeCache;
+    delete m_compactCache;
 
     m_fftModel = 0;
-    m_peakCache = 0;
+    m_renderFFTModel = 0;
     m_wholeCache = 0;
+    m_compactCache = 0;
+}
+
+void
+SpectrogramLayer::createPeakCaches()
+{
+    deletePeakCaches();
+
+    if (!m_renderFFTModel) return;
+    
+    PeakColumnCache *cache = 0;
+    if (m_wholeCache) {
+        cache = new PeakColumnCache(m_wholeCache, m_peakCacheDivisor);
+    } else {
+        cache = new PeakColumnCache(m_renderFFTModel, m_peakCacheDivisor,
+                                    &m_sourceMutex);
+    }
+    m_peakCaches.push_back(cache);
+
+    // Stop short of levels that would have fewer than a couple of
+    // columns, as those would never be chosen for a view of any width
+    int width = m_renderFFTModel->getWidth();
+    
+    for (int divisor = m_peakCacheDivisor * 2;
+         divisor <= m_peakCacheMaxDivisor && width / divisor >= 2;
+         divisor *= 2) {
+        cache = new PeakColumnCache(cache, 2);
+        m_peakCaches.push_back(cache);
+    }
+
+    m_binReductions.push_back(new BinReductionCache
+                              (m_renderFFTModel, &m_sourceMutex,
+                               m_compactCache));
+    for (auto c: m_peakCaches) {
+        m_binReductions.push_back(new BinReductionCache(c));
+    }
+    if (m_wholeCache) {
+        m_binReductions.push_back(new BinReductionCache(m_wholeCache));
+    }
+}
+
+void
+SpectrogramLayer::deletePeakCaches()
+{
+    stopWarming();
+    
+    for (auto r: m_binReductions) {
+        delete r;
+    }
+    m_binReductions.clear();
+    
+    // Each cache is taken from the one before, so delete coarsest first
+    while (!m_peakCaches.empty()) {
+        delete m_peakCaches.back();
+        m_peakCaches.pop_back();
+    }
 }
 
 pair<ColourScaleType, double>
@@ -214,6 +280,10 @@ SpectrogramLayer::setModel(const DenseTimeValueModel *model)
 
     m_model = model;
 
+    // The renderers, and any stale ones, may be reading from the
+    // derived models that are about to be deleted
+    invalidateRenderers();
+    invalidateMagnitudes();
     recreateFFTModel();
 
     if (!m_model || !m_model->isOK()) return;
@@ -660,6 +730,199 @@ SpectrogramLayer::invalidateRenderers()
         delete i->second;
     }
     m_renderers.clear();
+
+    // Whatever invalidated the renderers invalidates the stale ones
+    // as well
+    discardStaleGeneration();
+}
+
+void
+SpectrogramLayer::startWarming()
+{
+    stopWarming();
+
+    if (m_peakCaches.empty()) {
+        return;
+    }
+
+    // Reading one bin of a peak column fills the whole column, and
+    // the columns of whatever it is taken from. The width is checked
+    // as we go, as the model may still be growing.
+    
+    PeakColumnCache *cache = m_peakCaches[0];
+    m_warmerCancelled = false;
+    
+    m_warmer = std::thread([this, cache]() {
+            float value = 0.f;
+            for (int x = 0; x < cache->getWidth(); ++x) {
+                if (m_warmerCancelled) {
+                    return;
+                }
+                cache->getColumnRange(x, 0, 1, &value);
+            }
+#ifdef DEBUG_SPECTROGRAM
+            cerr << "SpectrogramLayer: peak cache warmed" << endl;
+#endif
+        });
+}
+
+void
+SpectrogramLayer::stopWarming()
+{
+    if (m_warmer.joinable()) {
+        m_warmerCancelled = true;
+        m_warmer.join();
+    }
+}
+
+void
+SpectrogramLayer::replaceFFTModel()
+{
+    // The warmer may be reading caches that are about to become
+    // stale or be deleted
+    stopWarming();
+    
+    if (!m_stale.renderers.empty() || m_renderers.empty() ||
+        !m_fftModel || m_synchronous) {
+
+        // Nothing on display to keep, or we are already showing a
+        // stale generation, which is better than a partial render
+        // from the model we are about to replace
+        
+        for (ViewRendererMap::iterator i = m_renderers.begin();
+             i != m_renderers.end(); ++i) {
+            delete i->second;
+        }
+        m_renderers.clear();
+
+        // The new model's columns may not correspond to the old
+        invalidateMagnitudes();
+        recreateFFTModel();
+        return;
+    }
+
+#ifdef DEBUG_SPECTROGRAM
+    cerr << "SpectrogramLayer::replaceFFTModel: keeping "
+         << m_renderers.size() << " renderer(s) as stale" << endl;
+#endif
+    
+    discardStaleGeneration();
+    
+    for (ViewRendererMap::iterator i = m_renderers.begin();
+         i != m_renderers.end(); ++i) {
+        i->second->cancelPendingRender();
+    }
+    m_stale.renderers = m_renderers;
+    m_renderers.clear();
+
+    // The stale renderers keep the magnitude records they were
+    // sampling into, as the new model's columns may not correspond
+    // to theirs; the new renderers will start afresh
+    m_stale.columnMags = m_magnitudes.takeColumnRanges();
+    invalidateMagnitudes();
+
+    m_stale.fftModel = m_fftModel;
+    m_stale.renderFFTModel = m_renderFFTModel;
+    m_stale.wholeCache = m_wholeCache;
+    m_stale.compactCache = m_compactCache;
+    m_stale.peakCaches = m_peakCaches;
+    m_stale.binReductions = m_binReductions;
+
+    m_fftModel = 0;
+    m_wholeCache = 0;
+    m_compactCache = 0;
+    m_peakCaches.clear();
+    m_binReductions.clear();
+
+    recreateFFTModel();
+
+    // The views go on showing the stale generation until they have
+    // rendered in full from the new one, which they do from the peak
+    // caches once zoomed out at all
+    startWarming();
+}
+
+void
+SpectrogramLayer::retireStaleRenderer(LayerGeometryProvider *v) const
+{
+    auto itr = m_stale.renderers.find(v->getId());
+    if (itr == m_stale.renderers.end()) {
+        return;
+    }
+
+    delete itr->second;
+    m_stale.renderers.erase(itr);
+
+    // The view has been painted in part from the stale renderer, so
+    // repaint it all from the new one
+    v->updatePaintRect(v->getPaintRect());
+
+    if (m_stale.renderers.empty()) {
+        // Not while we are painting
+        QMetaObject::invokeMethod(const_cast<SpectrogramLayer *>(this),
+                                  "discardStaleGeneration",
+                                  Qt::QueuedConnection);
+    }
+}
+
+void
+SpectrogramLayer::discardStaleGeneration()
+{
+    // Renderers first, as they may be reading from the models in the
+    // background until deleted
+    
+    for (ViewRendererMap::iterator i = m_stale.renderers.begin();
+         i != m_stale.renderers.end(); ++i) {
+        delete i->second;
+    }
+    m_stale.renderers.clear();
+
+    for (auto &m: m_stale.columnMags) {
+        delete m.second;
+    }
+    m_stale.columnMags.clear();
+
+    if (!m_stale.fftModel) {
+        return;
+    }
+    
+    for (auto r: m_stale.binReductions) {
+        delete r;
+    }
+    m_stale.binReductions.clear();
+    
+    while (!m_stale.peakCaches.empty()) {
+        delete m_stale.peakCaches.back();
+        m_stale.peakCaches.pop_back();
+    }
+
+    delete m_stale.wholeCache;
+    m_stale.wholeCache = 0;
+
+    delete m_stale.compactCache;
+    m_stale.compactCache = 0;
+
+    m_stale.fftModel->aboutToDelete();
+    delete m_stale.fftModel;
+    m_stale.fftModel = 0;
+
+    if (m_stale.renderFFTModel) m_stale.renderFFTModel->aboutToDelete();
+    delete m_stale.renderFFTModel;
+    m_stale.renderFFTModel = 0;
+}
+
+void
+SpectrogramLayer::updateRendererColourScales()
+{
+    // For changes that affect only the mapping from value to colour,
+    // which the renderers can apply to what they already have
+    
+    auto make = [this](int viewId) { return createColourScale(viewId); };
+    Colour3DPlotRenderer::setColourScales(m_renderers, make);
+    Colour3DPlotRenderer::setColourScales(m_stale.renderers, make);
+
+    m_crosshairColour =
+        ColourMapper(m_colourMap, 1.f, 255.f).getContrastingColour();
 }
 
 void
@@ -693,6 +956,7 @@ SpectrogramLayer::setChannel(int ch)
     if (m_channel == ch) return;
 
     invalidateRenderers();
+    invalidateMagnitudes();
     m_channel = ch;
     recreateFFTModel();
 
@@ -734,11 +998,9 @@ SpectrogramLayer::setWindowSize(int ws)
 {
     if (m_windowSize == ws) return;
 
-    invalidateRenderers();
-    
     m_windowSize = ws;
     
-    recreateFFTModel();
+    replaceFFTModel();
 
     emit layerParametersChanged();
 }
@@ -754,11 +1016,9 @@ SpectrogramLayer::setWindowHopLevel(int v)
 {
     if (m_windowHopLevel == v) return;
 
-    invalidateRenderers();
-    
     m_windowHopLevel = v;
     
-    recreateFFTModel();
+    replaceFFTModel();
 
     emit layerParametersChanged();
 }
@@ -774,11 +1034,9 @@ SpectrogramLayer::setWindowType(WindowType w)
 {
     if (m_windowType == w) return;
 
-    invalidateRenderers();
-    
     m_windowType = w;
 
-    recreateFFTModel();
+    replaceFFTModel();
 
     emit layerParametersChanged();
 }
@@ -797,10 +1055,10 @@ SpectrogramLayer::setGain(float gain)
 
     if (m_gain == gain) return;
 
-    invalidateRenderers();
-    
     m_gain = gain;
     
+    updateRendererColourScales();
+    
     emit layerParametersChanged();
 }
 
@@ -815,10 +1073,10 @@ SpectrogramLayer::setThreshold(float threshold)
 {
     if (m_threshold == threshold) return;
 
-    invalidateRenderers();
-    
     m_threshold = threshold;
 
+    updateRendererColourScales();
+    
     emit layerParametersChanged();
 }
 
@@ -881,11 +1139,17 @@ SpectrogramLayer::setColourRotation(int r)
         m_colourRotation = r;
     }
 
-    // Initially the idea with colour rotation was that we would just
-    // rotate the palette of an already-generated cache. That's not
-    // really practical now that cacheing is handled in a separate
-    // class in which the main cache no longer has a palette.
-    invalidateRenderers();
+    // The renderers keep their caches in indexed form, so this only
+    // rotates their palettes. The stale ones too, as they are still
+    // on display until the new ones have caught up.
+    for (ViewRendererMap::iterator i = m_renderers.begin();
+         i != m_renderers.end(); ++i) {
+        i->second->setColourRotation(m_colourRotation);
+    }
+    for (ViewRendererMap::iterator i = m_stale.renderers.begin();
+         i != m_stale.renderers.end(); ++i) {
+        i->second->setColourRotation(m_colourRotation);
+    }
     
     emit layerParametersChanged();
 }
@@ -895,9 +1159,17 @@ SpectrogramLayer::setColourScale(ColourScaleType colourScale)
 {
     if (m_colourScale == colourScale) return;
 
-    invalidateRenderers();
+    bool phaseChanged = ((m_colourScale == ColourScaleType::Phase) !=
+                         (colourScale == ColourScaleType::Phase));
     
     m_colourScale = colourScale;
+
+    if (phaseChanged) {
+        // the renderers read different data for phase
+        invalidateRenderers();
+    } else {
+        updateRendererColourScales();
+    }
     
     emit layerParametersChanged();
 }
@@ -913,10 +1185,10 @@ SpectrogramLayer::setColourScaleMultiple(double multiple)
 {
     if (m_colourScaleMultiple == multiple) return;
 
-    invalidateRenderers();
-    
     m_colourScaleMultiple = multiple;
     
+    updateRendererColourScales();
+    
     emit layerParametersChanged();
 }
 
@@ -931,10 +1203,10 @@ SpectrogramLayer::setColourMap(int map)
 {
     if (m_colourMap == map) return;
 
-    invalidateRenderers();
-    
     m_colourMap = map;
 
+    updateRendererColourScales();
+    
     emit layerParametersChanged();
 }
 
@@ -1051,31 +1323,55 @@ SpectrogramLayer::cacheInvalid()
     cerr << "SpectrogramLayer::cacheInvalid()" << endl;
 #endif
 
+    if (m_compactCache) m_compactCache->invalidate();
+    for (auto r: m_binReductions) r->invalidate();
+
     invalidateRenderers();
     invalidateMagnitudes();
 }
 
 void
-SpectrogramLayer::cacheInvalid(
-#ifdef DEBUG_SPECTROGRAM_REPAINT
-    sv_frame_t from, sv_frame_t to
-#else 
-    sv_frame_t     , sv_frame_t
-#endif
-    )
+SpectrogramLayer::cacheInvalid(sv_frame_t from, sv_frame_t to)
 {
 #ifdef DEBUG_SPECTROGRAM_REPAINT
     cerr << "SpectrogramLayer::cacheInvalid(" << from << ", " << to << ")" << endl;
 #endif
 
-    // We used to call invalidateMagnitudes(from, to) to invalidate
-    // only those caches whose views contained some of the (from, to)
-    // range. That's the right thing to do; it has been lost in
-    // pulling out the image cache code, but it might not matter very
-    // much, since the underlying models for spectrogram layers don't
-    // change very often. Let's see.
-    invalidateRenderers();
-    invalidateMagnitudes();
+    // Only the columns showing the changed range, and those whose
+    // windows overlap it, need to be rendered again. The per-column
+    // magnitude records are left alone: at worst they overstate the
+    // range until the next full invalidation, and they are only used
+    // as a starting point for normalisation.
+    if (!m_fftModel) {
+        invalidateRenderers();
+        invalidateMagnitudes();
+        return;
+    }
+    
+    int resolution = m_fftModel->getResolution();
+    sv_frame_t margin = m_fftModel->getFFTSize();
+
+    if (m_compactCache) {
+        // a column depends on a window's worth of frames either side
+        int columnMargin = int(margin / resolution) + 1;
+        m_compactCache->invalidate(int(from / resolution) - columnMargin,
+                                   int(to / resolution) + columnMargin);
+    }
+
+    // The reductions are listed as the renderers' sources list them:
+    // the FFT model first, then the peak caches and whole-model cache
+    for (size_t i = 0; i < m_binReductions.size(); ++i) {
+        int r = resolution;
+        if (i > 0 && i - 1 < m_peakCaches.size()) {
+            r = m_peakCaches[i - 1]->getResolution();
+        }
+        m_binReductions[i]->invalidate(int((from - margin) / r) - 1,
+                                       int((to + margin) / r) + 1);
+    }
+
+    for (auto &r: m_renderers) {
+        r.second->invalidate(from - margin, to + margin);
+    }
 }
 
 bool
@@ -1362,14 +1658,18 @@ SpectrogramLayer::recreateFFTModel()
     }
 
     if (m_fftModel) m_fftModel->aboutToDelete();
+    if (m_renderFFTModel) m_renderFFTModel->aboutToDelete();
     
-    if (m_peakCache) m_peakCache->aboutToDelete();
-    delete m_peakCache;
-    m_peakCache = 0;
+    deletePeakCaches();
 
-    if (m_wholeCache) m_wholeCache->aboutToDelete();
     delete m_wholeCache;
     m_wholeCache = 0;
+
+    delete m_compactCache;
+    m_compactCache = 0;
+
+    delete m_renderFFTModel;
+    m_renderFFTModel = 0;
     
     FFTModel *newModel = new FFTModel(m_model,
                                       m_channel,
@@ -1392,28 +1692,71 @@ SpectrogramLayer::recreateFFTModel()
     FFTModel *oldModel = m_fftModel;
     m_fftModel = newModel;
 
-    if (canStoreWholeCache()) { // i.e. if enough memory
-        m_wholeCache = new Dense3DModelPeakCache(m_fftModel, 1);
-        m_peakCache = new Dense3DModelPeakCache(m_wholeCache, m_peakCacheDivisor);
+    // The renderers (and the caches they fill) read from a model of
+    // their own, so that they never share one with the GUI thread
+    m_renderFFTModel = new FFTModel(m_model,
+                                    m_channel,
+                                    m_windowType,
+                                    m_windowSize,
+                                    getWindowIncrement(),
+                                    getFFTSize());
+
+    if (canStoreWholeCache(getWholeCacheBytes())) { // i.e. if enough memory
+        m_wholeCache = new PeakColumnCache(m_renderFFTModel, 1,
+                                           &m_sourceMutex);
+        createPeakCaches();
     } else {
-        m_peakCache = new Dense3DModelPeakCache(m_fftModel, m_peakCacheDivisor);
+        // Try a quantised whole-model cache, which is 2-4x smaller
+        // and quite precise enough for display
+        CompactColumnCache::Precision precisions[] = {
+            CompactColumnCache::Bits16, CompactColumnCache::Bits8
+        };
+        for (auto p: precisions) {
+            size_t sz = CompactColumnCache::getBytesFor
+                (m_fftModel->getWidth(), m_fftModel->getHeight(), p);
+            if (canStoreWholeCache(sz)) {
+                SVDEBUG << "Creating compact whole-model cache with "
+                        << (p == CompactColumnCache::Bits8 ? 8 : 16)
+                        << "-bit values" << endl;
+                m_compactCache = new CompactColumnCache
+                    (m_renderFFTModel, p, &m_sourceMutex);
+                break;
+            }
+        }
+        createPeakCaches();
     }
 
-    emit sliceableModelReplaced(oldModel, m_fftModel);
+    // If the old model has been kept in the stale generation, that
+    // is still the one that any slice layers are using
+    emit sliceableModelReplaced(oldModel ? oldModel : m_stale.fftModel,
+                                m_fftModel);
     delete oldModel;
 }
 
-bool
-SpectrogramLayer::canStoreWholeCache() const
+size_t
+SpectrogramLayer::getWholeCacheBytes() const
 {
     if (!m_fftModel) {
-        return false; // or true, doesn't really matter
+        return 0;
     }
 
-    size_t sz =
+    return
         size_t(m_fftModel->getWidth()) *
         size_t(m_fftModel->getHeight()) *
         sizeof(float);
+}
+
+bool
+SpectrogramLayer::canStoreWholeCache(size_t sz) const
+{
+    if (!m_fftModel) {
+        return false; // or true, doesn't really matter
+    }
+
+    if (!CacheGovernor::getInstance()->requestAllocation(sz, this)) {
+        SVDEBUG << "Whole-model cache would not fit within cache budget" << endl;
+        return false;
+    }
 
     try {
         SVDEBUG << "Requesting advice from StorageAdviser on whether to create whole-model cache" << endl;
@@ -1437,6 +1780,64 @@ SpectrogramLayer::canStoreWholeCache() const
     }
 }
 
+size_t
+SpectrogramLayer::getCacheBytes() const
+{
+    size_t sz = getWholeCacheBytes();
+    size_t bytes = 0;
+    if (m_wholeCache) bytes += sz;
+    if (m_compactCache) bytes += m_compactCache->getBytes();
+    for (auto c: m_peakCaches) {
+        bytes += sz / (c->getResolution() / m_fftModel->getResolution());
+    }
+    for (auto r: m_binReductions) {
+        bytes += r->getBytes();
+    }
+    return bytes;
+}
+
+double
+SpectrogramLayer::getCacheRebuildCost() const
+{
+    // Roughly the time taken to calculate the FFT columns again, at
+    // something like 10 microseconds per column
+    if (!m_fftModel) return 0.0;
+    return double(m_fftModel->getWidth()) * 1e-5;
+}
+
+bool
+SpectrogramLayer::isCacheDormant() const
+{
+    return m_renderers.empty();
+}
+
+void
+SpectrogramLayer::releaseCache()
+{
+    if (!m_wholeCache && !m_compactCache) {
+        // The peak cache alone is what we need in order to paint at
+        // all at coarse zoom levels, so we don't release it
+        return;
+    }
+
+    SVDEBUG << "SpectrogramLayer::releaseCache: discarding whole-model cache" << endl;
+
+    // The renderers refer to the caches we are about to delete
+    invalidateRenderers();
+
+    deletePeakCaches();
+
+    delete m_wholeCache;
+    m_wholeCache = 0;
+
+    delete m_compactCache;
+    m_compactCache = 0;
+
+    createPeakCaches();
+
+    emit layerParametersChanged();
+}
+
 const Model *
 SpectrogramLayer::getSliceableModel() const
 {
@@ -1449,7 +1850,7 @@ SpectrogramLayer::invalidateMagnitudes()
 #ifdef DEBUG_SPECTROGRAM
     cerr << "SpectrogramLayer::invalidateMagnitudes called" << endl;
 #endif
-    m_viewMags.clear();
+    m_magnitudes.invalidate();
 }
 
 void
@@ -1458,6 +1859,46 @@ SpectrogramLayer::setSynchronousPainting(bool synchronous)
     m_synchronous = synchronous;
 }
 
+ColourScale
+SpectrogramLayer::createColourScale(int viewId) const
+{
+    ColourScale::Parameters cparams;
+    cparams.colourMap = m_colourMap;
+    cparams.scaleType = m_colourScale;
+    cparams.multiple = m_colourScaleMultiple;
+
+    if (m_colourScale != ColourScaleType::Phase) {
+        cparams.gain = m_gain;
+        cparams.threshold = m_threshold;
+    }
+
+    double minValue = 0.0f;
+    double maxValue = 1.0f;
+
+    bool visible = m_magnitudes.getColourScaleRange
+        (viewId, m_normalizeVisibleArea, minValue, maxValue);
+    
+    if (!visible &&
+        m_colourScale == ColourScaleType::Linear &&
+        m_normalization == ColumnNormalization::None) {
+        maxValue = 0.1f;
+    }
+
+    if (maxValue <= minValue) {
+        maxValue = minValue + 0.1f;
+    }
+    if (maxValue <= m_threshold) {
+        maxValue = m_threshold + 0.1f;
+    }
+
+    cparams.minValue = minValue;
+    cparams.maxValue = maxValue;
+
+    m_magnitudes.setColourScaleRange(viewId, visible, minValue, maxValue);
+
+    return ColourScale(cparams);
+}
+
 Colour3DPlotRenderer *
 SpectrogramLayer::getRenderer(LayerGeometryProvider *v) const
 {
@@ -1467,47 +1908,18 @@ SpectrogramLayer::getRenderer(LayerGeometryProvider *v) const
 
         Colour3DPlotRenderer::Sources sources;
         sources.verticalBinLayer = this;
-        sources.fft = getFFTModel();
+        sources.fft = m_renderFFTModel;
         sources.source = sources.fft;
-        if (m_peakCache) sources.peakCaches.push_back(m_peakCache);
+        for (auto c: m_peakCaches) sources.peakCaches.push_back(c);
         if (m_wholeCache) sources.peakCaches.push_back(m_wholeCache);
+        sources.compactCache = m_compactCache;
+        sources.binReductions = m_binReductions;
 
-        ColourScale::Parameters cparams;
-        cparams.colourMap = m_colourMap;
-        cparams.scaleType = m_colourScale;
-        cparams.multiple = m_colourScaleMultiple;
-
-        if (m_colourScale != ColourScaleType::Phase) {
-            cparams.gain = m_gain;
-            cparams.threshold = m_threshold;
-        }
-
-        double minValue = 0.0f;
-        double maxValue = 1.0f;
-        
-        if (m_normalizeVisibleArea && m_viewMags[viewId].isSet()) {
-            minValue = m_viewMags[viewId].getMin();
-            maxValue = m_viewMags[viewId].getMax();
-        } else if (m_colourScale == ColourScaleType::Linear &&
-                   m_normalization == ColumnNormalization::None) {
-            maxValue = 0.1f;
-        }
-
-        if (maxValue <= minValue) {
-            maxValue = minValue + 0.1f;
-        }
-        if (maxValue <= m_threshold) {
-            maxValue = m_threshold + 0.1f;
-        }
-
-        cparams.minValue = minValue;
-        cparams.maxValue = maxValue;
-
-        m_lastRenderedMags[viewId] = MagnitudeRange(float(minValue),
-                                                    float(maxValue));
+        sources.columnRanges = m_magnitudes.getColumnRanges(viewId);
+        sources.sourceMutex = &m_sourceMutex;
 
         Colour3DPlotRenderer::Parameters params;
-        params.colourScale = ColourScale(cparams);
+        params.colourScale = createColourScale(viewId);
         params.normalization = m_normalization;
         params.binDisplay = m_binDisplay;
         params.binScale = m_binScale;
@@ -1515,6 +1927,11 @@ SpectrogramLayer::getRenderer(LayerGeometryProvider *v) const
         params.invertVertical = false;
         params.scaleFactor = 1.0;
         params.colourRotation = m_colourRotation;
+        params.threadCount = QThread::idealThreadCount();
+        params.overscan = 1;
+        params.asynchronous = true;
+        params.retainValues = true;
+        params.indexedCache = true;
 
         if (m_colourScale != ColourScaleType::Phase &&
             m_normalization != ColumnNormalization::Hybrid) {
@@ -1529,6 +1946,9 @@ SpectrogramLayer::getRenderer(LayerGeometryProvider *v) const
 
         m_renderers[viewId] = new Colour3DPlotRenderer(sources, params);
 
+        // Repaint as background rendering makes progress
+        m_renderers[viewId]->connectRenderReady(v->getView(), SLOT(update()));
+
         m_crosshairColour =
             ColourMapper(m_colourMap, 1.f, 255.f).getContrastingColour();
     }
@@ -1546,18 +1966,44 @@ SpectrogramLayer::paintWithRenderer(LayerGeometryProvider *v, QPainter &paint, Q
     int viewId = v->getId();
 
     bool continuingPaint = !renderer->geometryChanged(v);
-    
-    if (continuingPaint) {
-        magRange = m_viewMags[viewId];
+
+    if (m_magnitudes.startPaint(v, m_fftModel, continuingPaint,
+                                m_normalizeVisibleArea, magRange)) {
+        renderer->setColourScale(createColourScale(viewId));
     }
+
+    bool complete = true;
     
     if (m_synchronous) {
 
         result = renderer->render(v, paint, rect);
+        retireStaleRenderer(v);
 
     } else {
 
-        result = renderer->renderTimeConstrained(v, paint, rect);
+        // While there is a stale renderer for this view, render from
+        // the new model offscreen, showing it only once complete
+        
+        Colour3DPlotRenderer *stale = 0;
+        if (m_stale.renderers.find(viewId) != m_stale.renderers.end()) {
+            stale = m_stale.renderers[viewId];
+        }
+
+        QImage offscreen;
+        QPainter offscreenPaint;
+        if (stale) {
+            offscreen = QImage(rect.size(), QImage::Format_ARGB32_Premultiplied);
+            offscreen.fill(Qt::transparent);
+            offscreenPaint.begin(&offscreen);
+            offscreenPaint.translate(-rect.topLeft());
+        }
+        
+        result = renderer->renderTimeConstrained
+            (v, stale ? offscreenPaint : paint, rect);
+
+        if (stale) {
+            offscreenPaint.end();
+        }
 
 #ifdef DEBUG_SPECTROGRAM_REPAINT
         cerr << "rect width from this paint: " << result.rendered.width()
@@ -1566,31 +2012,34 @@ SpectrogramLayer::paintWithRenderer(LayerGeometryProvider *v, QPainter &paint, Q
 #endif
         
         QRect uncached = renderer->getLargestUncachedRect(v);
-        if (uncached.width() > 0) {
+        if (renderer->hasPendingRender()) {
+            // The renderer will tell the view when it has more for us
+            complete = false;
+        } else if (uncached.width() > 0) {
+            complete = false;
             v->updatePaintRect(uncached);
+        } else {
+            // The visible area is complete, so arrange to fill the
+            // off-screen margin in the scroll direction
+            renderer->prefetch(v);
         }
-    }
-
-    magRange.sample(result.range);
 
-    if (magRange.isSet()) {
-        if (m_viewMags[viewId] != magRange) {
-            m_viewMags[viewId] = magRange;
-#ifdef DEBUG_SPECTROGRAM_REPAINT
-            cerr << "mag range in this view has changed: "
-                 << magRange.getMin() << " -> " << magRange.getMax() << endl;
-#endif
+        if (stale) {
+            if (complete) {
+                paint.drawImage(rect.topLeft(), offscreen);
+                retireStaleRenderer(v);
+            } else {
+                stale->paintFromCache(v, paint, rect);
+                QColor wash = v->getBackground();
+                wash.setAlpha(96);
+                paint.fillRect(rect, wash);
+            }
         }
     }
 
-    if (!continuingPaint && m_normalizeVisibleArea &&
-        m_viewMags[viewId] != m_lastRenderedMags[viewId]) {
-#ifdef DEBUG_SPECTROGRAM_REPAINT
-        cerr << "mag range has changed from last rendered range: re-rendering"
-             << endl;
-#endif
-        delete m_renderers[viewId];
-        m_renderers.erase(viewId);
+    if (m_magnitudes.endPaint(v, m_fftModel, m_normalizeVisibleArea,
+                              complete, result.range, magRange)) {
+        renderer->setColourScale(createColourScale(viewId));
         v->updatePaintRect(v->getPaintRect());
     }
 }
@@ -1610,6 +2059,8 @@ SpectrogramLayer::paint(LayerGeometryProvider *v, QPainter &paint, QRect rect) c
         return;
     }
 
+    CacheGovernor::getInstance()->touch(const_cast<SpectrogramLayer *>(this));
+
     paintWithRenderer(v, paint, rect);
 
     illuminateLocalFeatures(v, paint);
@@ -2171,8 +2622,9 @@ SpectrogramLayer::paintDetailedScale(LayerGeometryProvider *v,
     paint.drawRect(4 + cw - cbw, textHeight * topLines + 4, cbw - 1, ch + 1);
 
     QString top, bottom;
-    double min = m_viewMags[v->getId()].getMin();
-    double max = m_viewMags[v->getId()].getMax();
+    MagnitudeRange range = m_magnitudes.getRange(v->getId());
+    double min = range.getMin();
+    double max = range.getMax();
 
     if (min < m_threshold) min = m_threshold;
     if (max <= min) max = min + 0.1;
@@ -29,19 +29,27 @@
 #include "VerticalBinLayer.h"
 #include "ColourScale.h"
 #include "Colour3DPlotRenderer.h"
+#include "ViewMagnitudes.h"
+#include "CacheGovernor.h"
+#include "CompactColumnCache.h"
+#include "PeakColumnCache.h"
+#include "BinReductionCache.h"
 
 #include <QMutex>
 #include <QWaitCondition>
 #include <QImage>
 #include <QPixmap>
 
+#include <vector>
+#include <thread>
+#include <atomic>
+
 class View;
 class QPainter;
 class QImage;
 class QPixmap;
 class QTimer;
 class FFTModel;
-class Dense3DModelPeakCache;
 
 /**
  * SpectrogramLayer represents waveform data (obtained from a
@@ -49,7 +57,8 @@ class Dense3DModelPeakCache;
  */
 
 class SpectrogramLayer : public VerticalBinLayer,
-                         public PowerOfSqrtTwoZoomConstraint
+                         public PowerOfSqrtTwoZoomConstraint,
+                         public CacheGovernor::Client
 {
     Q_OBJECT
 
@@ -233,12 +242,26 @@ public:
 
     virtual const Model *getSliceableModel() const;
 
+    /**
+     * CacheGovernor::Client methods, for the whole-model and peak
+     * caches. The layer counts as dormant when it has no renderers,
+     * i.e. when it is not on display in any view. Releasing the
+     * cache discards the whole-model cache, whether full or compact,
+     * leaving a peak cache taken directly from the FFT model.
+     */
+    virtual size_t getCacheBytes() const override;
+    virtual double getCacheRebuildCost() const override;
+    virtual bool isCacheDormant() const override;
+    virtual void releaseCache() override;
+
 protected slots:
     void cacheInvalid();
     void cacheInvalid(sv_frame_t startFrame, sv_frame_t endFrame);
     
     void preferenceChanged(PropertyContainer::PropertyName name);
 
+    void discardStaleGeneration();
+
 protected:
     const DenseTimeValueModel *m_model; // I do not own this
 
@@ -302,24 +325,97 @@ protected:
     int getFFTOversampling() const;
     int getFFTSize() const; // m_windowSize * getFFTOversampling()
 
+    // The FFT model we offer as sliceable and read from the GUI
+    // thread, and an identical one that only the renderers read
+    // (under m_sourceMutex) and from which the caches below are
+    // filled. Their column caches are not shared, so hover and slice
+    // layers never wait behind a background render.
     FFTModel *m_fftModel;
+    FFTModel *m_renderFFTModel;
     FFTModel *getFFTModel() const { return m_fftModel; }
-    Dense3DModelPeakCache *m_wholeCache;
-    Dense3DModelPeakCache *m_peakCache;
-    Dense3DModelPeakCache *getPeakCache() const { return m_peakCache; }
+    PeakColumnCache *m_wholeCache; // one column per peak
+    CompactColumnCache *m_compactCache; // used if m_wholeCache won't fit
+
+    // Pyramid of peak caches, finest first. The first is taken from
+    // the whole-model cache, or the FFT model, at m_peakCacheDivisor
+    // columns per peak, and each further one from the one before at
+    // twice as many, up to m_peakCacheMaxDivisor. The caches fill
+    // columns only on demand, so the coarser levels cost nothing
+    // until a far zoom-out asks for them.
+    std::vector<PeakColumnCache *> m_peakCaches;
+    PeakColumnCache *getPeakCache() const {
+        return m_peakCaches.empty() ? 0 : m_peakCaches[0];
+    }
     const int m_peakCacheDivisor;
-    bool canStoreWholeCache() const;
+    const int m_peakCacheMaxDivisor;
+
+    // Bin reductions of the render FFT model (read through the
+    // compact cache if there is one) and of each of the peak caches
+    // and then the whole-model cache, in the order in which the
+    // renderers' sources list them. They are made and deleted along
+    // with the peak caches.
+    std::vector<BinReductionCache *> m_binReductions;
+    
+    void createPeakCaches();
+    void deletePeakCaches();
+
+    // Fills the finest peak cache, and so the FFT model's caches
+    // beneath it, from a background thread after the FFT model has
+    // been replaced under a view, so that the new model is warm by
+    // the time the view has caught up with it. It is stopped before
+    // the caches are deleted or replaced.
+    std::thread m_warmer;
+    std::atomic<bool> m_warmerCancelled;
+    void startWarming();
+    void stopWarming();
+    size_t getWholeCacheBytes() const;
+    bool canStoreWholeCache(size_t bytes) const;
     void recreateFFTModel();
 
-    typedef std::map<int, MagnitudeRange> ViewMagMap; // key is view id
-    mutable ViewMagMap m_viewMags;
-    mutable ViewMagMap m_lastRenderedMags; // when in normalizeVisibleArea mode
+    // The magnitude range of each view, and the per-column ranges
+    // recorded by its renderer, from which normalizeVisibleArea mode
+    // finds the visible range before rendering
+    mutable ViewMagnitudes m_magnitudes;
     void invalidateMagnitudes();
 
     typedef std::map<int, Colour3DPlotRenderer *> ViewRendererMap; // key is view id
     mutable ViewRendererMap m_renderers;
+
+    // Held by the renderers, current and stale, while reading the
+    // render FFT model, its caches and the column magnitudes, as they
+    // may do so from background threads for more than one view at
+    // once; and by us while reading the column magnitudes
+    mutable QMutex m_sourceMutex;
+
     Colour3DPlotRenderer *getRenderer(LayerGeometryProvider *) const;
+    ColourScale createColourScale(int viewId) const;
     void invalidateRenderers();
+    void updateRendererColourScales();
+
+    // When the FFT model is replaced following a change of window
+    // parameters, the old model, its caches, and the renderers that
+    // were using them are kept as a stale generation until each view
+    // has been rendered in full from the new ones. Until then, a view
+    // shows the last render of its stale renderer, washed over to
+    // mark it as stale, while it renders from the new model
+    // offscreen. The stale renderers are never asked to render again.
+    struct StaleGeneration {
+        StaleGeneration() : fftModel(0), renderFFTModel(0),
+                            wholeCache(0), compactCache(0) { }
+        FFTModel *fftModel;
+        FFTModel *renderFFTModel;
+        PeakColumnCache *wholeCache;
+        CompactColumnCache *compactCache;
+        std::vector<PeakColumnCache *> peakCaches;
+        std::vector<BinReductionCache *> binReductions;
+        ViewRendererMap renderers;
+        // the renderers' own column magnitudes, as their columns
+        // differ from ours
+        ViewMagnitudes::ColumnRangeMap columnMags;
+    };
+    mutable StaleGeneration m_stale;
+    void replaceFFTModel();
+    void retireStaleRenderer(LayerGeometryProvider *v) const;
 
     void deleteDerivedModels();
     
@@ -0,0 +1,216 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#include "SummaryPeakTable.h"
+
+#include "data/model/RangeSummarisableTimeValueModel.h"
+
+#include "base/HitCount.h"
+
+#include <iostream>
+#include <algorithm>
+#include <cmath>
+
+using namespace std;
+
+//#define DEBUG_SUMMARY_PEAK_TABLE 1
+
+// Large enough that the table for an hour or more of audio is only a
+// few thousand blocks, small enough that the partial blocks at the
+// ends of a range are quick to summarise
+static const int preferredBlockSize = 65536;
+
+SummaryPeakTable::SummaryPeakTable(const RangeSummarisableTimeValueModel *model,
+                                   int channel) :
+    m_model(model),
+    m_channel(channel),
+    m_blockSize(model->getSummaryBlockSize(preferredBlockSize)),
+    m_dirtyStart(0),
+    m_dirtyEnd(0)
+{
+    if (m_blockSize < 1) m_blockSize = 1;
+    m_levels.resize(1);
+}
+
+void
+SummaryPeakTable::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (endFrame <= startFrame) return;
+
+    sv_frame_t b0 = max(startFrame, sv_frame_t(0)) / m_blockSize;
+    sv_frame_t b1 = (endFrame + m_blockSize - 1) / m_blockSize;
+    if (b1 <= b0) return;
+
+    if (m_dirtyEnd <= m_dirtyStart) {
+        m_dirtyStart = b0;
+        m_dirtyEnd = b1;
+    } else {
+        m_dirtyStart = min(m_dirtyStart, b0);
+        m_dirtyEnd = max(m_dirtyEnd, b1);
+    }
+}
+
+void
+SummaryPeakTable::invalidate()
+{
+    m_dirtyStart = 0;
+    m_dirtyEnd = sv_frame_t(m_levels[0].size());
+}
+
+size_t
+SummaryPeakTable::getBytes() const
+{
+    size_t bytes = 0;
+    for (const auto &level: m_levels) {
+        bytes += level.size() * sizeof(float);
+    }
+    return bytes;
+}
+
+void
+SummaryPeakTable::update()
+{
+    // Only whole blocks go in the table. A block that becomes whole
+    // as the model grows is new, and so is fetched
+    
+    sv_frame_t blocks = m_model->getEndFrame() / m_blockSize;
+    sv_frame_t had = sv_frame_t(m_levels[0].size());
+
+    if (blocks != had) {
+        m_levels[0].resize(size_t(blocks), 0.f);
+        if (blocks > had) {
+            invalidate(had * m_blockSize, blocks * m_blockSize);
+        }
+    } else if (m_dirtyEnd <= m_dirtyStart) {
+        return;
+    }
+
+    sv_frame_t b0 = min(m_dirtyStart, blocks);
+    sv_frame_t b1 = min(m_dirtyEnd, blocks);
+    m_dirtyStart = m_dirtyEnd = 0;
+
+    if (b1 > b0) {
+
+#ifdef DEBUG_SUMMARY_PEAK_TABLE
+        cerr << "SummaryPeakTable::update: channel " << m_channel
+             << ": fetching blocks " << b0 << " to " << b1
+             << " of " << blocks << " (block size " << m_blockSize
+             << ")" << endl;
+#endif
+
+        RangeSummarisableTimeValueModel::RangeBlock ranges;
+        int blockSize = m_blockSize;
+        m_model->getSummaries(m_channel, b0 * m_blockSize,
+                              (b1 - b0) * m_blockSize, ranges, blockSize);
+
+        if (blockSize != m_blockSize) {
+            // The model has not summarised at the size it said it
+            // would: summarise each block directly instead
+            cerr << "WARNING: SummaryPeakTable::update: model returned "
+                 << "block size " << blockSize << " for requested "
+                 << m_blockSize << endl;
+            for (sv_frame_t b = b0; b < b1; ++b) {
+                m_levels[0][size_t(b)] = getModelPeak
+                    (b * m_blockSize, (b + 1) * m_blockSize);
+            }
+        } else {
+            for (sv_frame_t b = b0; b < b1; ++b) {
+                size_t i = size_t(b - b0);
+                float peak = 0.f;
+                if (i < ranges.size()) {
+                    peak = max(fabsf(ranges[i].max()),
+                               fabsf(ranges[i].min()));
+                }
+                m_levels[0][size_t(b)] = peak;
+            }
+        }
+    }
+
+    // Rebuild the levels above. There are only a few thousand blocks
+    // even for long recordings, so there is no need to be selective
+    
+    size_t n = m_levels[0].size();
+    size_t nlevels = 1;
+    while ((size_t(1) << nlevels) <= n) ++nlevels;
+    m_levels.resize(nlevels);
+
+    for (size_t k = 1; k < nlevels; ++k) {
+        const vector<float> &below = m_levels[k-1];
+        vector<float> &level = m_levels[k];
+        size_t half = size_t(1) << (k-1);
+        size_t count = n - (size_t(1) << k) + 1;
+        level.resize(count);
+        for (size_t i = 0; i < count; ++i) {
+            level[i] = max(below[i], below[i + half]);
+        }
+    }
+}
+
+float
+SummaryPeakTable::getBlockPeak(sv_frame_t b0, sv_frame_t b1) const
+{
+    // Peak of blocks b0 up to but not including b1, from the two
+    // overlapping runs of 2^k blocks that cover them
+    
+    if (b1 <= b0) return 0.f;
+    
+    sv_frame_t n = b1 - b0;
+    int k = 0;
+    while ((sv_frame_t(1) << (k + 1)) <= n) ++k;
+
+    const vector<float> &level = m_levels[k];
+    return max(level[size_t(b0)],
+               level[size_t(b1 - (sv_frame_t(1) << k))]);
+}
+
+float
+SummaryPeakTable::getModelPeak(sv_frame_t start, sv_frame_t end) const
+{
+    if (end <= start) return 0.f;
+    RangeSummarisableTimeValueModel::Range range =
+        m_model->getSummary(m_channel, start, end - start);
+    return max(fabsf(range.max()), fabsf(range.min()));
+}
+
+float
+SummaryPeakTable::getPeak(sv_frame_t start, sv_frame_t end)
+{
+    static HitCount count("SummaryPeakTable: peaks");
+    
+    update();
+
+    // Whole blocks in the range, which are in the table
+    sv_frame_t b0 = (max(start, sv_frame_t(0)) + m_blockSize - 1) / m_blockSize;
+    sv_frame_t b1 = min(end / m_blockSize, sv_frame_t(m_levels[0].size()));
+
+    if (b1 <= b0) {
+        // No whole block to look up
+        count.miss();
+        return getModelPeak(start, end);
+    }
+
+    count.hit();
+
+    float peak = getBlockPeak(b0, b1);
+    peak = max(peak, getModelPeak(start, b0 * m_blockSize));
+    peak = max(peak, getModelPeak(b1 * m_blockSize, end));
+
+#ifdef DEBUG_SUMMARY_PEAK_TABLE
+    cerr << "SummaryPeakTable::getPeak(" << start << ", " << end
+         << "): blocks " << b0 << " to " << b1 << ", peak " << peak << endl;
+#endif
+
+    return peak;
+}
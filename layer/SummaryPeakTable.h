@@ -0,0 +1,95 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+    
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+
+#ifndef SUMMARY_PEAK_TABLE_H
+#define SUMMARY_PEAK_TABLE_H
+
+#include "base/BaseTypes.h"
+
+#include <vector>
+#include <cstddef>
+
+class RangeSummarisableTimeValueModel;
+
+/**
+ * A table of the peak absolute levels of one channel of a
+ * range-summarisable model, for finding the peak level over a range
+ * of frames without summarising the whole range each time, as when
+ * normalising a waveform to its visible area.
+ *
+ * The table holds the peak of each whole block of a coarse summary
+ * block size, with a sparse table above it of the peaks of runs of 2,
+ * 4, 8 ... blocks, so that the peak of any run of blocks is the
+ * larger of two table entries. A range of frames is split into the
+ * whole blocks it contains, looked up in the table, and the partial
+ * blocks at either end, summarised from the model as before. The
+ * result is exact.
+ *
+ * Blocks are fetched from the model on first use, and again after
+ * they are invalidated, for example because the model has changed
+ * within them. Blocks added as the model grows are fetched as they
+ * become complete.
+ */
+class SummaryPeakTable
+{
+public:
+    /**
+     * Create a table for the given channel of the given model, which
+     * must outlive the table.
+     */
+    SummaryPeakTable(const RangeSummarisableTimeValueModel *model,
+                     int channel);
+
+    /**
+     * Return the peak absolute level of the channel from frame start
+     * up to but not including frame end.
+     */
+    float getPeak(sv_frame_t start, sv_frame_t end);
+
+    /**
+     * Mark the blocks that include any of the frames from startFrame
+     * up to but not including endFrame as needing to be fetched again
+     * from the model.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
+
+    /**
+     * Mark all blocks as needing to be fetched again.
+     */
+    void invalidate();
+
+    /**
+     * Return the memory used by the table.
+     */
+    size_t getBytes() const;
+
+private:
+    const RangeSummarisableTimeValueModel *m_model;
+    int m_channel;
+    int m_blockSize;
+
+    // m_levels[k][i] is the peak of blocks i to i + 2^k - 1
+    std::vector<std::vector<float>> m_levels;
+
+    // Blocks from m_dirtyStart up to m_dirtyEnd need fetching
+    sv_frame_t m_dirtyStart;
+    sv_frame_t m_dirtyEnd;
+
+    void update();
+    float getBlockPeak(sv_frame_t b0, sv_frame_t b1) const;
+    float getModelPeak(sv_frame_t start, sv_frame_t end) const;
+};
+
+#endif
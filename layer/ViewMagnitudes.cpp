@@ -0,0 +1,203 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ViewMagnitudes.h"
+#include "MagnitudeRangeTree.h"
+#include "LayerGeometryProvider.h"
+
+#include "data/model/DenseThreeDimensionalModel.h"
+
+#include <QMutexLocker>
+
+#include <iostream>
+
+//#define DEBUG_VIEW_MAGNITUDES 1
+
+using namespace std;
+
+ViewMagnitudes::ViewMagnitudes(QMutex *columnMutex) :
+    m_columnMutex(columnMutex)
+{
+}
+
+ViewMagnitudes::~ViewMagnitudes()
+{
+    for (auto &m: m_columnMags) {
+        delete m.second;
+    }
+}
+
+MagnitudeRange
+ViewMagnitudes::getRange(int viewId) const
+{
+    auto itr = m_viewMags.find(viewId);
+    if (itr == m_viewMags.end()) {
+        return MagnitudeRange();
+    }
+    return itr->second;
+}
+
+MagnitudeRangeTree *
+ViewMagnitudes::getColumnRanges(int viewId)
+{
+    if (m_columnMags.find(viewId) == m_columnMags.end()) {
+        m_columnMags[viewId] = new MagnitudeRangeTree;
+    }
+    return m_columnMags[viewId];
+}
+
+ViewMagnitudes::ColumnRangeMap
+ViewMagnitudes::takeColumnRanges()
+{
+    ColumnRangeMap taken;
+    taken.swap(m_columnMags);
+    return taken;
+}
+
+void
+ViewMagnitudes::invalidate()
+{
+#ifdef DEBUG_VIEW_MAGNITUDES
+    cerr << "ViewMagnitudes::invalidate called" << endl;
+#endif
+    m_viewMags.clear();
+
+    QMutexLocker locker(m_columnMutex);
+    for (auto &m: m_columnMags) {
+        m.second->clear();
+    }
+}
+
+bool
+ViewMagnitudes::getColourScaleRange(int viewId, bool normalizeVisibleArea,
+                                    double &min, double &max) const
+{
+    if (!normalizeVisibleArea) {
+        return false;
+    }
+    MagnitudeRange range = getRange(viewId);
+    if (!range.isSet()) {
+        return false;
+    }
+    min = range.getMin();
+    max = range.getMax();
+    return true;
+}
+
+void
+ViewMagnitudes::setColourScaleRange(int viewId, bool fromView,
+                                    double min, double max)
+{
+    if (fromView) {
+        // record the range as requested, before any adjustment by
+        // the caller, so that it compares equal next time
+        m_lastRenderedMags[viewId] = getRange(viewId);
+    } else {
+        m_lastRenderedMags[viewId] = MagnitudeRange(float(min), float(max));
+    }
+}
+
+MagnitudeRange
+ViewMagnitudes::getVisibleColumnRange(const LayerGeometryProvider *v,
+                                      const DenseThreeDimensionalModel *model) const
+{
+    auto itr = m_columnMags.find(v->getId());
+    if (itr == m_columnMags.end() || !model) {
+        return MagnitudeRange();
+    }
+
+    int resolution = model->getResolution();
+    sv_frame_t modelStart = model->getStartFrame();
+    
+    int c0 = int((v->getStartFrame() - modelStart) / resolution);
+    int c1 = int((v->getEndFrame() - modelStart) / resolution) + 1;
+
+    QMutexLocker locker(m_columnMutex);
+    return itr->second->getRange(c0, c1);
+}
+
+bool
+ViewMagnitudes::startPaint(const LayerGeometryProvider *v,
+                           const DenseThreeDimensionalModel *model,
+                           bool continuingPaint, bool normalizeVisibleArea,
+                           MagnitudeRange &magRange)
+{
+    int viewId = v->getId();
+
+    if (continuingPaint) {
+        magRange = getRange(viewId);
+        return false;
+    }
+
+    if (!normalizeVisibleArea) {
+        return false;
+    }
+    
+    // If we have rendered the visible columns before, we know their
+    // range already and can render with it from the outset
+    MagnitudeRange visible = getVisibleColumnRange(v, model);
+    if (visible.isSet() && visible != m_lastRenderedMags[viewId]) {
+        m_viewMags[viewId] = visible;
+        return true;
+    }
+
+    return false;
+}
+
+bool
+ViewMagnitudes::endPaint(const LayerGeometryProvider *v,
+                         const DenseThreeDimensionalModel *model,
+                         bool normalizeVisibleArea, bool complete,
+                         const MagnitudeRange &rendered,
+                         MagnitudeRange &magRange)
+{
+    int viewId = v->getId();
+
+    if (normalizeVisibleArea) {
+
+        MagnitudeRange visible = getVisibleColumnRange(v, model);
+        if (visible.isSet()) {
+            m_viewMags[viewId] = visible;
+        }
+
+        // Columns seen for the first time may have widened the
+        // range. Once the view is complete, re-render with the new
+        // range (doing so earlier could mean starting again for
+        // every new fragment)
+        if (complete && m_viewMags[viewId].isSet() &&
+            m_viewMags[viewId] != m_lastRenderedMags[viewId]) {
+#ifdef DEBUG_VIEW_MAGNITUDES
+            cerr << "mag range has changed from last rendered range: re-rendering"
+                 << endl;
+#endif
+            return true;
+        }
+
+        return false;
+    }
+    
+    magRange.sample(rendered);
+
+    if (magRange.isSet()) {
+        if (m_viewMags[viewId] != magRange) {
+            m_viewMags[viewId] = magRange;
+#ifdef DEBUG_VIEW_MAGNITUDES
+            cerr << "mag range in this view has changed: "
+                 << magRange.getMin() << " -> " << magRange.getMax() << endl;
+#endif
+        }
+    }
+
+    return false;
+}
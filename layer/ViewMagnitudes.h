@@ -0,0 +1,144 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef VIEW_MAGNITUDES_H
+#define VIEW_MAGNITUDES_H
+
+#include "base/MagnitudeRange.h"
+
+#include <QMutex>
+
+#include <map>
+
+class LayerGeometryProvider;
+class DenseThreeDimensionalModel;
+class MagnitudeRangeTree;
+
+/**
+ * The magnitude ranges of the views of a layer drawn with
+ * Colour3DPlotRenderer, used to make each view's colour scale and,
+ * in normalise-visible-area mode, to normalise it to the range of
+ * what is on display.
+ *
+ * For each view this holds the range found in its last paint, the
+ * range its colour scale was last made from, and a per-column
+ * record into which its renderer samples the range of every column
+ * it renders. From that record the range of the visible area is
+ * known before rendering it, for any columns rendered before, so the
+ * view can be rendered with the right colour scale from the outset
+ * rather than once to find the range and again to show it.
+ */
+class ViewMagnitudes
+{
+public:
+    typedef std::map<int, MagnitudeRangeTree *> ColumnRangeMap; // key is view id
+
+    /**
+     * Create a set of view ranges whose per-column records are
+     * shared with renderers that hold the given mutex while sampling
+     * into them. It is held here while reading or clearing them.
+     */
+    ViewMagnitudes(QMutex *columnMutex);
+    ~ViewMagnitudes();
+
+    /**
+     * Return the range found in the last paint of the given view,
+     * or an unset range if it has not been painted since the last
+     * invalidation.
+     */
+    MagnitudeRange getRange(int viewId) const;
+
+    /**
+     * Return the per-column record for the given view, creating it
+     * if necessary, for its renderer to sample into.
+     */
+    MagnitudeRangeTree *getColumnRanges(int viewId);
+
+    /**
+     * Give up the per-column records, which the caller then owns,
+     * typically to stay with the renderers using them while new ones
+     * are made for new renderers.
+     */
+    ColumnRangeMap takeColumnRanges();
+
+    /**
+     * Forget all ranges, as when the model or anything affecting its
+     * values has changed. The per-column records are cleared rather
+     * than deleted, as the renderers may still refer to them.
+     */
+    void invalidate();
+
+    /**
+     * In normalise-visible-area mode, retrieve into min and max the
+     * range from which to make the given view's colour scale and
+     * return true. Otherwise, or if there is no range for the view
+     * yet, return false, leaving the caller to use its defaults.
+     */
+    bool getColourScaleRange(int viewId, bool normalizeVisibleArea,
+                             double &min, double &max) const;
+
+    /**
+     * Record the range that a colour scale for the given view has
+     * been made from, so that a change to it can be detected. If
+     * fromView is true, this is the range returned by
+     * getColourScaleRange, and the view's range as such is recorded
+     * rather than the min and max adjusted from it.
+     */
+    void setColourScaleRange(int viewId, bool fromView,
+                             double min, double max);
+
+    /**
+     * Call before rendering the given view. If continuingPaint is
+     * true, the renderer's geometry is as it was for the last paint,
+     * and magRange is set to the range from that. Otherwise, in
+     * normalise-visible-area mode, the range of the visible columns
+     * of the given source model is taken from the per-column record.
+     * Return true if that differs from the range the colour scale
+     * was made from, in which case the colour scale should be made
+     * again before rendering.
+     */
+    bool startPaint(const LayerGeometryProvider *v,
+                    const DenseThreeDimensionalModel *model,
+                    bool continuingPaint, bool normalizeVisibleArea,
+                    MagnitudeRange &magRange);
+
+    /**
+     * Call after rendering the given view, with the range of the
+     * columns just rendered and the magRange from startPaint.
+     * Return true if, in normalise-visible-area mode, the view is
+     * complete and its range is no longer that of its colour scale,
+     * in which case the colour scale should be made again and the
+     * view repainted.
+     */
+    bool endPaint(const LayerGeometryProvider *v,
+                  const DenseThreeDimensionalModel *model,
+                  bool normalizeVisibleArea, bool complete,
+                  const MagnitudeRange &rendered,
+                  MagnitudeRange &magRange);
+
+private:
+    typedef std::map<int, MagnitudeRange> ViewMagMap; // key is view id
+    ViewMagMap m_viewMags;
+    ViewMagMap m_lastRenderedMags; // in normalise-visible-area mode
+    ColumnRangeMap m_columnMags;
+    QMutex *m_columnMutex;
+
+    MagnitudeRange getVisibleColumnRange(const LayerGeometryProvider *v,
+                                         const DenseThreeDimensionalModel *model) const;
+
+    ViewMagnitudes(const ViewMagnitudes &) = delete;
+    ViewMagnitudes &operator=(const ViewMagnitudes &) = delete;
+};
+
+#endif
@@ -25,14 +25,114 @@
 #include "PaintAssistant.h"
 
 #include <QPainter>
-#include <QPixmap>
+#include <QImage>
 #include <QTextStream>
 
 #include <iostream>
 #include <cmath>
+#include <algorithm>
 
 //#define DEBUG_WAVEFORM_PAINT 1
 
+namespace {
+
+/**
+ * Writes the vertical spans, points and horizontal lines that make
+ * up a waveform straight into the scanlines of an ARGB32 image,
+ * instead of making a QPainter call for each. The waveform colours
+ * are all opaque, so nothing needs blending: each pixel is simply
+ * stored. The image is composited once, when it is drawn into the
+ * cache.
+ *
+ * Coordinates are those of the view. Column x is stored at image
+ * column x - left, and anything outside the image is clipped. A
+ * vertical scale and offset may be applied to y, for layers whose
+ * middle line is not at the centre.
+ */
+class WaveformRasteriser
+{
+public:
+    WaveformRasteriser(QImage &image, int left, double yoffset, double yscale) :
+        m_bits(reinterpret_cast<QRgb *>(image.bits())),
+        m_stride(image.bytesPerLine() / int(sizeof(QRgb))),
+        m_width(image.width()),
+        m_height(image.height()),
+        m_left(left),
+        m_yoffset(yoffset),
+        m_yscale(yscale),
+        m_identity(yoffset == 0.0 && yscale == 1.0),
+        m_pixel(0) { }
+
+    void setColour(QColor colour) {
+        m_pixel = qPremultiply(colour.rgba());
+    }
+
+    /// Fill column x from y0 to y1 inclusive, in either order
+    void span(int x, int y0, int y1) {
+        x -= m_left;
+        if (x < 0 || x >= m_width) return;
+        y0 = mapY(y0);
+        y1 = mapY(y1);
+        if (y0 > y1) std::swap(y0, y1);
+        if (y0 < 0) y0 = 0;
+        if (y1 >= m_height) y1 = m_height - 1;
+        QRgb *p = m_bits + size_t(y0) * m_stride + x;
+        for (int y = y0; y <= y1; ++y) {
+            *p = m_pixel;
+            p += m_stride;
+        }
+    }
+
+    void point(int x, int y) {
+        span(x, y, y);
+    }
+
+    /// Fill row y from x0 to x1 inclusive
+    void row(int x0, int x1, int y) {
+        y = mapY(y);
+        if (y < 0 || y >= m_height) return;
+        x0 -= m_left;
+        x1 -= m_left;
+        if (x0 < 0) x0 = 0;
+        if (x1 >= m_width) x1 = m_width - 1;
+        QRgb *p = m_bits + size_t(y) * m_stride;
+        for (int x = x0; x <= x1; ++x) {
+            p[x] = m_pixel;
+        }
+    }
+
+    /// Join (x-1, y0) to (x, y1) with a steep line, half in each
+    /// column, as an aliased QPainter::drawLine would
+    void join(int x, int y0, int y1) {
+        if (y0 == y1) {
+            point(x-1, y0);
+            point(x, y1);
+            return;
+        }
+        int mid = y0 + (y1 - y0) / 2;
+        span(x-1, y0, mid);
+        span(x, mid + (y1 > y0 ? 1 : -1), y1);
+    }
+
+private:
+    QRgb *m_bits;
+    int m_stride;
+    int m_width;
+    int m_height;
+    int m_left;
+    double m_yoffset;
+    double m_yscale;
+    bool m_identity;
+    QRgb m_pixel;
+
+    int mapY(int y) const {
+        if (m_identity) return y;
+        return int(floor(m_yoffset + y * m_yscale));
+    }
+};
+
+}
+
 
 
 
@@ -47,17 +147,14 @@ WaveformLayer::WaveformLayer() :
     m_channel(-1),
     m_scale(LinearScale),
     m_middleLineHeight(0.5),
-    m_aggressive(false),
-    m_cache(0),
-    m_cacheValid(false),
-    m_cacheZoomLevel(0)
+    m_aggressive(false)
 {
-    
+    CacheGovernor::getInstance()->registerClient(this);
 }
 
 WaveformLayer::~WaveformLayer()
 {
-    delete m_cache;
+    CacheGovernor::getInstance()->unregisterClient(this);
 }
 
 void
@@ -78,16 +175,110 @@ WaveformLayer::setModel(const RangeSummarisableTimeValueModel *model)
     }
 
     m_model = model;
-    m_cacheValid = false;
+    m_peakTables.clear();
+    invalidateCaches();
+    invalidateRangeCaches();
     if (!m_model || !m_model->isOK()) return;
 
     connectSignals(m_model);
 
+    connect(m_model, SIGNAL(modelChanged()), this, SLOT(cacheInvalid()));
+    connect(m_model, SIGNAL(modelChangedWithin(sv_frame_t, sv_frame_t)),
+            this, SLOT(cacheInvalid(sv_frame_t, sv_frame_t)));
+
     emit modelReplaced();
 
     if (channelsChanged) emit layerParametersChanged();
 }
 
+void
+WaveformLayer::invalidateCaches()
+{
+    for (auto &c: m_viewCaches) {
+        c.second.cache.invalidate();
+    }
+}
+
+void
+WaveformLayer::invalidateRangeCaches()
+{
+    for (auto &c: m_viewCaches) {
+        c.second.ranges.invalidate();
+    }
+}
+
+void
+WaveformLayer::cacheInvalid()
+{
+    invalidateCaches();
+    invalidateRangeCaches();
+    for (auto &t: m_peakTables) {
+        t.second.invalidate();
+    }
+}
+
+void
+WaveformLayer::cacheInvalid(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    for (auto &t: m_peakTables) {
+        t.second.invalidate(startFrame, endFrame);
+    }
+
+    for (auto &c: m_viewCaches) {
+
+        ViewCache &vc = c.second;
+        sv_frame_t from = startFrame, to = endFrame;
+
+        // A change reaching the model end as last painted also
+        // affects the blank columns beyond it. Include those, so
+        // that the valid area is cut back from the right rather than
+        // split.
+        if (vc.endFrame >= 0 && to >= vc.endFrame) {
+            to = std::max(to, getCacheEndFrame(vc.cache));
+        }
+
+        // Each column is joined to those either side
+        sv_frame_t margin = 2 * sv_frame_t(vc.cache.getZoomLevel());
+        vc.cache.invalidate(from - margin, to + margin);
+        vc.ranges.invalidate(from - margin, to + margin);
+    }
+}
+
+size_t
+WaveformLayer::getCacheBytes() const
+{
+    size_t bytes = 0;
+    for (const auto &c: m_viewCaches) {
+        const QImage &image = c.second.cache.getImage();
+        bytes += size_t(image.bytesPerLine()) * size_t(image.height());
+        bytes += c.second.ranges.getBytes();
+    }
+    return bytes;
+}
+
+double
+WaveformLayer::getCacheRebuildCost() const
+{
+    // Drawing a waveform from the model's summaries takes a few tens
+    // of milliseconds per megapixel
+    return double(getCacheBytes()) * 1e-8;
+}
+
+bool
+WaveformLayer::isCacheDormant() const
+{
+    // We don't know which of our views are on display, but a view
+    // that is will paint us again when scrolled or resized
+    return !m_lastPainted.isValid() ||
+        m_lastPainted.elapsed() > CacheGovernor::dormancyTimeout;
+}
+
+void
+WaveformLayer::releaseCache()
+{
+    m_viewCaches.clear();
+}
+
 Layer::PropertyList
 WaveformLayer::getProperties() const
 {
@@ -249,7 +440,7 @@ WaveformLayer::setGain(float gain)
 {
     if (m_gain == gain) return;
     m_gain = gain;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
     emit verticalZoomChanged();
 }
@@ -259,7 +450,7 @@ WaveformLayer::setAutoNormalize(bool autoNormalize)
 {
     if (m_autoNormalize == autoNormalize) return;
     m_autoNormalize = autoNormalize;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -268,7 +459,7 @@ WaveformLayer::setShowMeans(bool showMeans)
 {
     if (m_showMeans == showMeans) return;
     m_showMeans = showMeans;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -277,7 +468,7 @@ WaveformLayer::setUseGreyscale(bool useGreyscale)
 {
     if (m_greyscale == useGreyscale) return;
     m_greyscale = useGreyscale;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -286,7 +477,8 @@ WaveformLayer::setChannelMode(ChannelMode channelMode)
 {
     if (m_channelMode == channelMode) return;
     m_channelMode = channelMode;
-    m_cacheValid = false;
+    invalidateCaches();
+    invalidateRangeCaches();
     emit layerParametersChanged();
 }
 
@@ -297,7 +489,8 @@ WaveformLayer::setChannel(int channel)
 
     if (m_channel == channel) return;
     m_channel = channel;
-    m_cacheValid = false;
+    invalidateCaches();
+    invalidateRangeCaches();
     emit layerParametersChanged();
 }
 
@@ -306,7 +499,7 @@ WaveformLayer::setScale(Scale scale)
 {
     if (m_scale == scale) return;
     m_scale = scale;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -315,7 +508,7 @@ WaveformLayer::setMiddleLineHeight(double height)
 {
     if (m_middleLineHeight == height) return;
     m_middleLineHeight = height;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -324,7 +517,7 @@ WaveformLayer::setAggressiveCacheing(bool aggressive)
 {
     if (m_aggressive == aggressive) return;
     m_aggressive = aggressive;
-    m_cacheValid = false;
+    invalidateCaches();
     emit layerParametersChanged();
 }
 
@@ -404,9 +597,18 @@ WaveformLayer::getChannelArrangement(int &min, int &max,
 bool
 WaveformLayer::isLayerScrollable(const LayerGeometryProvider *) const
 {
-    return !m_autoNormalize;
+    // As with the spectrogram, the layer scrolls its own image cache
+    // for each view, so the view should ask it for the whole area on
+    // every repaint rather than scrolling its own copy. That also
+    // means a change of auto-normalise gain on scrolling is always
+    // painted across the whole view.
+    return false;
 }
 
+// Fraction of the auto-normalise gain that the gain a view cache was
+// painted with may fall to before the cache is repainted (about 1dB)
+static const float normalizeGainTolerance = 0.89f;
+
 static float meterdbs[] = { -40, -30, -20, -15, -10,
                             -5, -3, -2, -1, -0.5, 0 };
 
@@ -455,24 +657,38 @@ WaveformLayer::getNormalizeGain(LayerGeometryProvider *v, int channel) const
 
     if (rangeEnd < rangeStart) rangeEnd = rangeStart;
 
-    RangeSummarisableTimeValueModel::Range range =
-        m_model->getSummary(channel, rangeStart, rangeEnd - rangeStart);
-
     int minChannel = 0, maxChannel = 0;
     bool mergingChannels = false, mixingChannels = false;
 
     (void)getChannelArrangement(minChannel, maxChannel,
                                 mergingChannels, mixingChannels);
 
+    // A merged or mixed channel is normalised to the peak of all the
+    // channels it combines
+    
+    int c0 = channel, c1 = channel;
     if (mergingChannels || mixingChannels) {
-        RangeSummarisableTimeValueModel::Range otherRange =
-            m_model->getSummary(1, rangeStart, rangeEnd - rangeStart);
-        range.setMax(std::max(range.max(), otherRange.max()));
-        range.setMin(std::min(range.min(), otherRange.min()));
-        range.setAbsmean(std::min(range.absmean(), otherRange.absmean()));
+        c0 = 0;
+        c1 = m_model->getChannelCount() - 1;
+    }
+
+    float peak = 0.f;
+    for (int c = c0; c <= c1; ++c) {
+        peak = std::max(peak, getPeakTable(c).getPeak(rangeStart, rangeEnd));
     }
 
-    return float(1.0 / std::max(fabs(range.max()), fabs(range.min())));
+    return float(1.0 / peak);
+}
+
+SummaryPeakTable &
+WaveformLayer::getPeakTable(int channel) const
+{
+    auto itr = m_peakTables.find(channel);
+    if (itr == m_peakTables.end()) {
+        itr = m_peakTables.insert
+            ({ channel, SummaryPeakTable(m_model, channel) }).first;
+    }
+    return itr->second;
 }
 
 void
@@ -497,72 +713,191 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
                                      mergingChannels, mixingChannels);
     if (channels == 0) return;
 
+    CacheGovernor::getInstance()->touch(const_cast<WaveformLayer *>(this));
+    m_lastPainted.start();
+
     int w = v->getPaintWidth();
     int h = v->getPaintHeight();
 
-    bool ready = m_model->isReady();
-    QPainter *paint;
+    int completion = 0;
+    bool ready = m_model->isReady(&completion);
+    if (ready) completion = 100;
 
-    if (m_aggressive) {
+    sv_frame_t modelEnd = m_model->getEndFrame();
 
-#ifdef DEBUG_WAVEFORM_PAINT
-        cerr << "WaveformLayer::paint: aggressive is true" << endl;
-#endif
+    while ((int)m_effectiveGains.size() <= maxChannel) {
+        m_effectiveGains.push_back(m_gain);
+    }
+
+    ViewCache &vc = m_viewCaches[v->getId()];
 
-        if (m_cacheValid && (zoomLevel != m_cacheZoomLevel)) {
-            m_cacheValid = false;
+    for (int ch = minChannel; ch <= maxChannel; ++ch) {
+        m_effectiveGains[ch] = m_gain;
+        if (m_autoNormalize) {
+            float gain = getNormalizeGain(v, ch);
+            // The normalise gain follows the peak of the visible
+            // area, so it changes a little on almost every scroll.
+            // Keep the gain the cache was painted with, and so the
+            // cache itself, for as long as it is slightly below the
+            // new one: waveforms are then drawn a little smaller
+            // than full height but never clipped.
+            if (ch < (int)vc.gains.size() &&
+                vc.gains[ch] <= gain &&
+                vc.gains[ch] >= gain * normalizeGainTolerance) {
+                gain = vc.gains[ch];
+            }
+            m_effectiveGains[ch] = gain;
         }
+    }
+
+    ScrollableImageCache &cache = vc.cache;
+    ScrollableRangeCache &ranges = vc.ranges;
 
-        if (!m_cache || m_cache->width() != w || m_cache->height() != h) {
+    // Anything that changes the appearance of every column
+    // invalidates the whole cache
+    
+    bool lightBackground = v->hasLightBackground();
+    bool scaleGuides = (v->getViewManager() &&
+                        v->getViewManager()->shouldShowScaleGuides());
+    
+    if (completion != vc.completion ||
+        lightBackground != vc.lightBackground ||
+        scaleGuides != vc.scaleGuides ||
+        m_effectiveGains != vc.gains ||
+        modelEnd < vc.endFrame) {
 #ifdef DEBUG_WAVEFORM_PAINT
-            if (m_cache) {
-                cerr << "WaveformLayer::paint: cache size " << m_cache->width() << "x" << m_cache->height() << " differs from view size " << w << "x" << h << ": regenerating aggressive cache" << endl;
-            }
+        cerr << "WaveformLayer::paint: appearance changed, invalidating cache"
+             << endl;
 #endif
-            delete m_cache;
-            m_cache = new QPixmap(w, h);
-            m_cacheValid = false;
+        cache.invalidate();
+        if (completion != vc.completion || modelEnd < vc.endFrame) {
+            // Summaries of a model that is still loading may be
+            // incomplete anywhere, not just at the end
+            ranges.invalidate();
         }
+        vc.completion = completion;
+        vc.lightBackground = lightBackground;
+        vc.scaleGuides = scaleGuides;
+        vc.gains = m_effectiveGains;
+    }
 
-        if (m_cacheValid) {
-            viewPainter.drawPixmap(rect, *m_cache, rect);
-            return;
+    cache.resize(QSize(w, h));
+    cache.setZoomLevel(zoomLevel);
+    if (cache.isValid()) {
+        cache.scrollTo(v, v->getStartFrame());
+    } else {
+        cache.setStartFrame(v->getStartFrame());
+    }
+
+    // The summary ranges scroll in step with the image, and have a
+    // column of margin at each side for the columns the image joins
+    // to. A repaint that invalidates only the image, such as for a
+    // gain change, is then drawn without going back to the model.
+    ranges.setMargin(1);
+    ranges.resize(w, channels);
+    ranges.setZoomLevel(zoomLevel);
+    ranges.scrollTo(v, v->getStartFrame());
+
+    // Columns beyond the model end as last painted were painted
+    // blank. If the model has grown since, as while recording,
+    // repaint from the last column before the old end onward, and
+    // keep the rest
+    if (vc.endFrame >= 0 && modelEnd > vc.endFrame) {
+        cache.invalidate(vc.endFrame - zoomLevel, getCacheEndFrame(cache));
+        ranges.invalidate(vc.endFrame - zoomLevel,
+                          getCacheEndFrame(cache) + zoomLevel);
+    }
+    vc.endFrame = modelEnd;
+
+    int x0 = rect.left();
+    int x1 = rect.right() + 1;
+    if (x0 < 0) x0 = 0;
+    if (x1 > w) x1 = w;
+
+    if (x1 > x0) {
+        if (!cache.isValid()) {
+            paintToCache(v, vc, x0, x1 - x0, ready);
+        } else {
+            // Paint whatever is missing at either side, adjacent to
+            // the valid area so that it remains contiguous
+            int validLeft = cache.getValidLeft();
+            int validRight = cache.getValidRight();
+            if (x0 < validLeft) {
+                paintToCache(v, vc, x0, validLeft - x0, ready);
+            }
+            if (x1 > validRight) {
+                paintToCache(v, vc, validRight, x1 - validRight, ready);
+            }
         }
+    }
+
+    viewPainter.drawImage(rect, cache.getImage(),
+                          rect.translated(cache.getMargin(), 0));
+}
 
-        paint = new QPainter(m_cache);
+sv_frame_t
+WaveformLayer::getCacheEndFrame(const ScrollableImageCache &cache) const
+{
+    return cache.getStartFrame() +
+        sv_frame_t(cache.getSize().width() + cache.getMargin()) *
+        cache.getZoomLevel();
+}
 
-        paint->setPen(Qt::NoPen);
-        paint->setBrush(getBackgroundQColor(v));
-        paint->drawRect(rect);
+void
+WaveformLayer::paintToCache(LayerGeometryProvider *v, ViewCache &vc,
+                            int left, int width, bool ready) const
+{
+    Profiler profiler("WaveformLayer::paintToCache");
 
-        paint->setPen(getForegroundQColor(v));
-        paint->setBrush(Qt::NoBrush);
+#ifdef DEBUG_WAVEFORM_PAINT
+    cerr << "WaveformLayer::paintToCache: x " << left << " to "
+         << left + width << endl;
+#endif
+
+    // Each column is joined to its neighbours, so draw one extra
+    // column at either side and copy only the ones in between
+    
+    ScrollableImageCache &cache = vc.cache;
+    int h = cache.getSize().height();
+    QImage image(width + 2, h, QImage::Format_ARGB32_Premultiplied);
 
+    if (m_aggressive) {
+        image.fill(getBackgroundQColor(v));
     } else {
-        paint = &viewPainter;
+        image.fill(Qt::transparent);
     }
 
-    paint->setRenderHint(QPainter::Antialiasing, false);
+    fillRangeCache(v, vc.ranges, left - 1, left + width);
+    drawWaveform(v, vc.ranges, image, left - 1, left + width, ready);
+    
+    cache.drawImage(left, width, image, 1, width);
+}
 
-    if (m_middleLineHeight != 0.5) {
-        paint->save();
-        double space = m_middleLineHeight * 2;
-        if (space > 1.0) space = 2.0 - space;
-        double yt = h * (m_middleLineHeight - space/2);
-        paint->translate(QPointF(0, yt));
-        paint->scale(1.0, space);
-    }
+void
+WaveformLayer::fillRangeCache(LayerGeometryProvider *v,
+                              ScrollableRangeCache &cache,
+                              int x0, int x1) const
+{
+    // Only the columns not already in the cache need summaries from
+    // the model. Find the span that contains all of them.
 
-    int x0 = 0, x1 = w - 1;
-    int y0 = 0, y1 = h - 1;
+    x0 = std::max(x0, -cache.getMargin());
+    x1 = std::min(x1, cache.getWidth() + cache.getMargin() - 1);
 
-    x0 = rect.left();
-    x1 = rect.right();
-    y0 = rect.top();
-    y1 = rect.bottom();
+    while (x0 <= x1 && cache.isColumnSet(x0)) ++x0;
+    while (x1 > x0 && cache.isColumnSet(x1)) --x1;
+    if (x0 > x1) return;
 
-    if (x0 > 0) --x0;
-    if (x1 < w) ++x1;
+    Profiler profiler("WaveformLayer::fillRangeCache");
+
+    int channels = 0, minChannel = 0, maxChannel = 0;
+    bool mergingChannels = false, mixingChannels = false;
+
+    channels = getChannelArrangement(minChannel, maxChannel,
+                                     mergingChannels, mixingChannels);
+    if (channels == 0) return;
+
+    int zoomLevel = v->getZoomLevel();
 
     // Our zoom level may differ from that at which the underlying
     // model has its blocks.
@@ -583,13 +918,219 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
     getSourceFramesForX(v, x1, modelZoomLevel, spare, frame1);
     
 #ifdef DEBUG_WAVEFORM_PAINT
-    cerr << "Painting waveform from " << frame0 << " to " << frame1 << " (" << (x1-x0+1) << " pixels at zoom " << zoomLevel << " and model zoom " << modelZoomLevel << ")" <<  endl;
+    cerr << "Fetching summaries from " << frame0 << " to " << frame1 << " (" << (x1-x0+1) << " pixels at zoom " << zoomLevel << " and model zoom " << modelZoomLevel << ")" <<  endl;
+#endif
+
+    typedef RangeSummarisableTimeValueModel::Range Range;
+    typedef RangeSummarisableTimeValueModel::RangeBlock RangeBlock;
+
+    // When merging or mixing, every channel of the model contributes
+    // to the single displayed channel
+    
+    int fetchMin = minChannel, fetchMax = maxChannel;
+    if (mergingChannels || mixingChannels) {
+        fetchMin = 0;
+        fetchMax = m_model->getChannelCount() - 1;
+    }
+    int fetchCount = fetchMax - fetchMin + 1;
+
+    SummaryBuffers &buffers = m_summaryBuffers;
+    fetchSummaries(fetchMin, fetchMax, frame0, frame1 - frame0,
+                   modelZoomLevel, buffers);
+
+    std::vector<const RangeBlock *> channelRanges(channels);
+
+    if (mergingChannels || mixingChannels) {
+        combineSummaries(buffers, fetchCount, mergingChannels);
+        channelRanges[0] = &buffers.combined;
+    } else {
+        for (int ch = minChannel; ch <= maxChannel; ++ch) {
+            channelRanges[ch - minChannel] = &buffers.channels[ch - minChannel];
+        }
+    }
+
+    std::vector<Range> column(channels);
+
+    for (int x = x0; x <= x1; ++x) {
+
+        if (cache.isColumnSet(x)) continue;
+
+        sv_frame_t f0, f1;
+        if (!getSourceFramesForX(v, x, modelZoomLevel, f0, f1)) {
+            cache.setColumnBlank(x);
+            continue;
+        }
+        f1 = f1 - 1;
+
+        if (f0 < frame0) {
+            cerr << "ERROR: WaveformLayer::fillRangeCache: pixel " << x << " has f0 = " << f0 << " which is less than range frame0 " << frame0 << " for x0 = " << x0 << endl;
+            cache.setColumnBlank(x);
+            continue;
+        }
+
+        sv_frame_t i0 = (f0 - frame0) / modelZoomLevel;
+        sv_frame_t i1 = (f1 - frame0) / modelZoomLevel;
+
+#ifdef DEBUG_WAVEFORM_PAINT
+        cerr << "WaveformLayer::fillRangeCache: pixel " << x << ": i0 " << i0 << " (f " << f0 << "), i1 " << i1 << " (f " << f1 << ")" << endl;
+#endif
+
+        if (i1 > i0 + 1) {
+            cerr << "WaveformLayer::fillRangeCache: ERROR: i1 " << i1 << " > i0 " << i0 << " plus one (zoom = " << zoomLevel << ", model zoom = " << modelZoomLevel << ")" << endl;
+        }
+
+        // The channels all have the same length, so if one has no
+        // range here, none has and the column is blank
+        bool blank = false;
+        
+        for (int ch = minChannel; ch <= maxChannel; ++ch) {
+
+            const RangeBlock &ranges = *channelRanges[ch - minChannel];
+            
+            if (i0 >= (sv_frame_t)ranges.size()) {
+#ifdef DEBUG_WAVEFORM_PAINT
+                cerr << "No (or not enough) ranges for i0 = " << i0 << endl;
+#endif
+                blank = true;
+                break;
+            }
+
+            Range range = ranges[size_t(i0)];
+
+            if (i1 > i0 && i1 < (sv_frame_t)ranges.size()) {
+                range.setMax(std::max(range.max(),
+                                      ranges[size_t(i1)].max()));
+                range.setMin(std::min(range.min(),
+                                      ranges[size_t(i1)].min()));
+                range.setAbsmean((range.absmean()
+                                  + ranges[size_t(i1)].absmean()) / 2);
+            }
+
+            column[ch - minChannel] = range;
+        }
+
+        if (blank) {
+            cache.setColumnBlank(x);
+        } else {
+            cache.setColumn(x, column.data());
+        }
+    }
+}
+
+void
+WaveformLayer::fetchSummaries(int ch0, int ch1, sv_frame_t frame0,
+                              sv_frame_t count, int blockSize,
+                              SummaryBuffers &buffers) const
+{
+    // The summaries go into blocks reused from one fetch to the next,
+    // rather than allocated afresh. The model can only be asked for
+    // one channel at a time, so this is a call per channel over the
+    // same span.
+    
+    int channels = ch1 - ch0 + 1;
+    if (int(buffers.channels.size()) < channels) {
+        buffers.channels.resize(channels);
+    }
+    
+    for (int ch = ch0; ch <= ch1; ++ch) {
+        m_model->getSummaries(ch, frame0, count,
+                              buffers.channels[ch - ch0], blockSize);
+#ifdef DEBUG_WAVEFORM_PAINT
+        cerr << "channel " << ch << ": " << buffers.channels[ch - ch0].size() << " ranges from " << frame0 << " for " << count << " frames at zoom level " << blockSize << endl;
 #endif
+    }
+}
+
+void
+WaveformLayer::combineSummaries(SummaryBuffers &buffers, int channels,
+                                bool merging)
+{
+    // Combine the summaries of all channels, block by block, into a
+    // single block in buffers.combined. When merging, the peak of the
+    // first half of the channels goes above the axis and that of the
+    // second half below, so that a stereo pair shows left above and
+    // right below. When mixing, the ranges are averaged. Either way
+    // the means are averaged. The accumulation runs through one
+    // channel at a time in plain float arrays, which the compiler can
+    // vectorise.
+
+    typedef RangeSummarisableTimeValueModel::Range Range;
+
+    size_t n = buffers.channels[0].size();
+    for (int c = 1; c < channels; ++c) {
+        n = std::min(n, buffers.channels[c].size());
+    }
+
+    buffers.upper.assign(n, 0.f);
+    buffers.lower.assign(n, 0.f);
+    buffers.mean.assign(n, 0.f);
+
+    float *upper = buffers.upper.data();
+    float *lower = buffers.lower.data();
+    float *mean = buffers.mean.data();
+
+    int split = (channels + 1) / 2;
+    
+    for (int c = 0; c < channels; ++c) {
+        const Range *r = buffers.channels[c].data();
+        if (merging) {
+            float *peak = (c < split ? upper : lower);
+            for (size_t i = 0; i < n; ++i) {
+                peak[i] = std::max(peak[i], fabsf(r[i].max()));
+                mean[i] += r[i].absmean();
+            }
+        } else {
+            for (size_t i = 0; i < n; ++i) {
+                upper[i] += r[i].max();
+                lower[i] += r[i].min();
+                mean[i] += r[i].absmean();
+            }
+        }
+    }
+
+    float scale = 1.f / float(channels);
+    
+    buffers.combined.resize(n);
+
+    for (size_t i = 0; i < n; ++i) {
+        Range &r = buffers.combined[i];
+        if (merging) {
+            r.setMax(upper[i]);
+            r.setMin(-lower[i]);
+        } else {
+            r.setMax(upper[i] * scale);
+            r.setMin(lower[i] * scale);
+        }
+        r.setAbsmean(mean[i] * scale);
+    }
+}
+
+void
+WaveformLayer::drawWaveform(LayerGeometryProvider *v,
+                            const ScrollableRangeCache &ranges,
+                            QImage &image,
+                            int x0, int x1, bool ready) const
+{
+    int h = v->getPaintHeight();
+
+    int channels = 0, minChannel = 0, maxChannel = 0;
+    bool mergingChannels = false, mixingChannels = false;
+
+    channels = getChannelArrangement(minChannel, maxChannel,
+                                     mergingChannels, mixingChannels);
+    if (channels == 0) return;
+
+    double yt = 0.0, space = 1.0;
+    
+    if (m_middleLineHeight != 0.5) {
+        space = m_middleLineHeight * 2;
+        if (space > 1.0) space = 2.0 - space;
+        yt = h * (m_middleLineHeight - space/2);
+    }
 
-    RangeSummarisableTimeValueModel::RangeBlock *ranges = 
-        new RangeSummarisableTimeValueModel::RangeBlock;
+    // Image column 0 is view x0
+    WaveformRasteriser raster(image, x0, yt, space);
 
-    RangeSummarisableTimeValueModel::RangeBlock *otherChannelRanges = 0;
     RangeSummarisableTimeValueModel::Range range;
 
     QColor baseColour = getBaseQColor();
@@ -604,21 +1145,11 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
         midColour = midColour.light(50);
     }
 
-    while ((int)m_effectiveGains.size() <= maxChannel) {
-        m_effectiveGains.push_back(m_gain);
-    }
-
     for (int ch = minChannel; ch <= maxChannel; ++ch) {
 
         int prevRangeBottom = -1, prevRangeTop = -1;
         QColor prevRangeBottomColour = baseColour, prevRangeTopColour = baseColour;
 
-        m_effectiveGains[ch] = m_gain;
-
-        if (m_autoNormalize) {
-            m_effectiveGains[ch] = getNormalizeGain(v, ch);
-        }
-
         double gain = m_effectiveGains[ch];
 
         int m = (h / channels) / 2;
@@ -628,16 +1159,14 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
         cerr << "ch = " << ch << ", channels = " << channels << ", m = " << m << ", my = " << my << ", h = " << h << endl;
 #endif
 
-        if (my - m > y1 || my + m < y0) continue;
-
         if ((m_scale == dBScale || m_scale == MeterScale) &&
             m_channelMode != MergeChannels) {
             m = (h / channels);
             my = m + (((ch - minChannel) * h) / channels);
         }
 
-        paint->setPen(greys[1]);
-        paint->drawLine(x0, my, x1, my);
+        raster.setColour(greys[1]);
+        raster.row(x0, x1, my);
 
         int n = 10;
         int py = -1;
@@ -646,7 +1175,7 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
             v->getViewManager() &&
             v->getViewManager()->shouldShowScaleGuides()) {
 
-            paint->setPen(QColor(240, 240, 240));
+            raster.setColour(QColor(240, 240, 240));
 
             for (int i = 1; i < n; ++i) {
                 
@@ -680,113 +1209,23 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
                     ny = getYForValue(v, nval, ch);
                 }
 
-                paint->drawLine(x0, y, x1, y);
+                raster.row(x0, x1, y);
                 if (ny != y) {
-                    paint->drawLine(x0, ny, x1, ny);
+                    raster.row(x0, x1, ny);
                 }
             }
         }
   
-        m_model->getSummaries(ch, frame0, frame1 - frame0,
-                              *ranges, modelZoomLevel);
-
-#ifdef DEBUG_WAVEFORM_PAINT
-        cerr << "channel " << ch << ": " << ranges->size() << " ranges from " << frame0 << " to " << frame1 << " at zoom level " << modelZoomLevel << endl;
-#endif
-
-        if (mergingChannels || mixingChannels) {
-            if (m_model->getChannelCount() > 1) {
-                if (!otherChannelRanges) {
-                    otherChannelRanges =
-                        new RangeSummarisableTimeValueModel::RangeBlock;
-                }
-                m_model->getSummaries
-                    (1, frame0, frame1 - frame0, *otherChannelRanges,
-                     modelZoomLevel);
-            } else {
-                if (otherChannelRanges != ranges) delete otherChannelRanges;
-                otherChannelRanges = ranges;
-            }
-        }
-
         for (int x = x0; x <= x1; ++x) {
 
-            range = RangeSummarisableTimeValueModel::Range();
-
-            sv_frame_t f0, f1;
-            if (!getSourceFramesForX(v, x, modelZoomLevel, f0, f1)) continue;
-            f1 = f1 - 1;
-
-            if (f0 < frame0) {
-                cerr << "ERROR: WaveformLayer::paint: pixel " << x << " has f0 = " << f0 << " which is less than range frame0 " << frame0 << " for x0 = " << x0 << endl;
-                continue;
-            }
-
-            sv_frame_t i0 = (f0 - frame0) / modelZoomLevel;
-            sv_frame_t i1 = (f1 - frame0) / modelZoomLevel;
-
-#ifdef DEBUG_WAVEFORM_PAINT
-            cerr << "WaveformLayer::paint: pixel " << x << ": i0 " << i0 << " (f " << f0 << "), i1 " << i1 << " (f " << f1 << ")" << endl;
-#endif
-
-            if (i1 > i0 + 1) {
-                cerr << "WaveformLayer::paint: ERROR: i1 " << i1 << " > i0 " << i0 << " plus one (zoom = " << zoomLevel << ", model zoom = " << modelZoomLevel << ")" << endl;
-            }
-
-            if (ranges && i0 < (sv_frame_t)ranges->size()) {
-
-                range = (*ranges)[size_t(i0)];
+            const RangeSummarisableTimeValueModel::Range *column =
+                ranges.getColumn(x);
+            if (!column) continue;
 
-                if (i1 > i0 && i1 < (int)ranges->size()) {
-                    range.setMax(std::max(range.max(),
-                                          (*ranges)[size_t(i1)].max()));
-                    range.setMin(std::min(range.min(),
-                                          (*ranges)[size_t(i1)].min()));
-                    range.setAbsmean((range.absmean()
-                                      + (*ranges)[size_t(i1)].absmean()) / 2);
-                }
-
-            } else {
-#ifdef DEBUG_WAVEFORM_PAINT
-                cerr << "No (or not enough) ranges for i0 = " << i0 << endl;
-#endif
-                continue;
-            }
+            range = column[ch - minChannel];
 
             int rangeBottom = 0, rangeTop = 0, meanBottom = 0, meanTop = 0;
 
-            if (mergingChannels) {
-
-                if (otherChannelRanges && i0 < (sv_frame_t)otherChannelRanges->size()) {
-
-                    range.setMax(fabsf(range.max()));
-                    range.setMin(-fabsf((*otherChannelRanges)[size_t(i0)].max()));
-                    range.setAbsmean
-                        ((range.absmean() +
-                          (*otherChannelRanges)[size_t(i0)].absmean()) / 2);
-
-                    if (i1 > i0 && i1 < (sv_frame_t)otherChannelRanges->size()) {
-                        // let's not concern ourselves about the mean
-                        range.setMin
-                            (std::min
-                             (range.min(),
-                              -fabsf((*otherChannelRanges)[size_t(i1)].max())));
-                    }
-                }
-
-            } else if (mixingChannels) {
-
-                if (otherChannelRanges && i0 < (sv_frame_t)otherChannelRanges->size()) {
-
-                    range.setMax((range.max()
-                                  + (*otherChannelRanges)[size_t(i0)].max()) / 2);
-                    range.setMin((range.min()
-                                  + (*otherChannelRanges)[size_t(i0)].min()) / 2);
-                    range.setAbsmean((range.absmean()
-                                      + (*otherChannelRanges)[size_t(i0)].absmean()) / 2);
-                }
-            }
-
             int greyLevels = 1;
             if (m_greyscale && (m_scale == LinearScale)) greyLevels = 4;
 
@@ -873,18 +1312,16 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
             if (x != x0 && prevRangeBottom != -1) {
                 if (prevRangeBottom > rangeBottom + 1 &&
                     prevRangeTop    > rangeBottom + 1) {
-//                    paint->setPen(midColour);
-                    paint->setPen(baseColour);
-                    paint->drawLine(x-1, prevRangeTop, x, rangeBottom + 1);
-                    paint->setPen(prevRangeTopColour);
-                    paint->drawPoint(x-1, prevRangeTop);
+                    raster.setColour(baseColour);
+                    raster.join(x, prevRangeTop, rangeBottom + 1);
+                    raster.setColour(prevRangeTopColour);
+                    raster.point(x-1, prevRangeTop);
                 } else if (prevRangeBottom < rangeTop - 1 &&
                            prevRangeTop    < rangeTop - 1) {
-//                    paint->setPen(midColour);
-                    paint->setPen(baseColour);
-                    paint->drawLine(x-1, prevRangeBottom, x, rangeTop - 1);
-                    paint->setPen(prevRangeBottomColour);
-                    paint->drawPoint(x-1, prevRangeBottom);
+                    raster.setColour(baseColour);
+                    raster.join(x, prevRangeBottom, rangeTop - 1);
+                    raster.setColour(prevRangeBottomColour);
+                    raster.point(x-1, prevRangeBottom);
                 }
             }
 
@@ -892,23 +1329,19 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
                 if (clipped /*!!! ||
                     range.min() * gain <= -1.0 ||
                     range.max() * gain >=  1.0 */) {
-                    paint->setPen(Qt::red); //!!! getContrastingColour
+                    raster.setColour(Qt::red); //!!! getContrastingColour
                 } else {
-                    paint->setPen(baseColour);
+                    raster.setColour(baseColour);
                 }
             } else {
-                paint->setPen(midColour);
+                raster.setColour(midColour);
             }
 
 #ifdef DEBUG_WAVEFORM_PAINT
             cerr << "range " << rangeBottom << " -> " << rangeTop << ", means " << meanBottom << " -> " << meanTop << ", raw range " << range.min() << " -> " << range.max() << endl;
 #endif
 
-            if (rangeTop == rangeBottom) {
-                paint->drawPoint(x, rangeTop);
-            } else {
-                paint->drawLine(x, rangeBottom, x, rangeTop);
-            }
+            raster.span(x, rangeBottom, rangeTop);
 
             prevRangeTopColour = baseColour;
             prevRangeBottomColour = baseColour;
@@ -918,14 +1351,14 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
                     if (rangeTop < rangeBottom) {
                         if (topFill > 0 &&
                             (!drawMean || (rangeTop < meanTop - 1))) {
-                            paint->setPen(greys[topFill - 1]);
-                            paint->drawPoint(x, rangeTop);
+                            raster.setColour(greys[topFill - 1]);
+                            raster.point(x, rangeTop);
                             prevRangeTopColour = greys[topFill - 1];
                         }
                         if (bottomFill > 0 && 
                             (!drawMean || (rangeBottom > meanBottom + 1))) {
-                            paint->setPen(greys[bottomFill - 1]);
-                            paint->drawPoint(x, rangeBottom);
+                            raster.setColour(greys[bottomFill - 1]);
+                            raster.point(x, rangeBottom);
                             prevRangeBottomColour = greys[bottomFill - 1];
                         }
                     }
@@ -933,32 +1366,14 @@ WaveformLayer::paint(LayerGeometryProvider *v, QPainter &viewPainter, QRect rect
             }
         
             if (drawMean) {
-                paint->setPen(midColour);
-                paint->drawLine(x, meanBottom, x, meanTop);
+                raster.setColour(midColour);
+                raster.span(x, meanBottom, meanTop);
             }
         
             prevRangeBottom = rangeBottom;
             prevRangeTop = rangeTop;
         }
     }
-
-    if (m_middleLineHeight != 0.5) {
-        paint->restore();
-    }
-
-    if (m_aggressive) {
-
-        if (ready && rect == v->getPaintRect()) {
-            m_cacheValid = true;
-            m_cacheZoomLevel = zoomLevel;
-        }
-        paint->end();
-        delete paint;
-        viewPainter.drawPixmap(rect, *m_cache, rect);
-    }
-
-    if (otherChannelRanges != ranges) delete otherChannelRanges;
-    delete ranges;
 }
 
 QString
@@ -996,11 +1411,14 @@ WaveformLayer::getFeatureDescription(LayerGeometryProvider *v, QPoint &pos) cons
                                      mergingChannels, mixingChannels);
     if (channels == 0) return "";
 
+    SummaryBuffers &buffers = m_summaryBuffers;
+    fetchSummaries(minChannel, maxChannel, f0, f1 - f0, v->getZoomLevel(),
+                   buffers);
+    
     for (int ch = minChannel; ch <= maxChannel; ++ch) {
 
-        int blockSize = v->getZoomLevel();
-        RangeSummarisableTimeValueModel::RangeBlock ranges;
-        m_model->getSummaries(ch, f0, f1 - f0, ranges, blockSize);
+        const RangeSummarisableTimeValueModel::RangeBlock &ranges =
+            buffers.channels[ch - minChannel];
 
         if (ranges.empty()) continue;
         
@@ -17,16 +17,25 @@
 #define _WAVEFORM_LAYER_H_
 
 #include <QRect>
+#include <QElapsedTimer>
 
 #include "SingleColourLayer.h"
+#include "ScrollableImageCache.h"
+#include "ScrollableRangeCache.h"
+#include "SummaryPeakTable.h"
+#include "CacheGovernor.h"
 
 #include "data/model/RangeSummarisableTimeValueModel.h"
 
+#include <map>
+#include <vector>
+
 class View;
 class QPainter;
-class QPixmap;
+class QImage;
 
-class WaveformLayer : public SingleColourLayer
+class WaveformLayer : public SingleColourLayer,
+                      public CacheGovernor::Client
 {
     Q_OBJECT
 
@@ -109,8 +118,9 @@ public:
      * channel 1 below (MergeChannels), or with a single axis showing
      * the average of the channels (MixChannels).
      * 
-     * MergeChannels does not work for files with more than 2
-     * channels.
+     * With more than 2 channels, MergeChannels shows the peak of the
+     * first half of the channels above the axis and that of the
+     * second half below, and MixChannels the average of all of them.
      * 
      * The default is SeparateChannels.
      */
@@ -160,20 +170,20 @@ public:
     double getMiddleLineHeight() const { return m_middleLineHeight; }
 
     /**
-     * Enable or disable aggressive pixmap cacheing.  If enabled,
-     * waveforms will be rendered to an off-screen pixmap and
-     * refreshed from there instead of being redrawn from the peak
-     * data each time.  This may be faster if the data and zoom level
-     * do not change often, but it may be slower for frequently zoomed
-     * data and it will only work if the waveform is the "bottom"
-     * layer on the displayed widget, as each refresh will erase
-     * anything beneath the waveform.
+     * Enable or disable aggressive cacheing. Waveforms are always
+     * rendered to an off-screen image cache for each view, which
+     * scrolls with the view, and refreshed from there instead of
+     * being redrawn from the peak data each time. If aggressive
+     * cacheing is enabled, the cache is also filled with the view
+     * background, which makes it quicker to draw from but means it
+     * will only work if the waveform is the "bottom" layer on the
+     * displayed widget, as each refresh will erase anything beneath
+     * the waveform.
      *
      * This is intended specifically for a panner widget display in
      * which the waveform never moves, zooms, or changes, but some
      * graphic such as a panner outline is frequently redrawn over the
-     * waveform.  This situation would necessitate a lot of waveform
-     * refresh if the default cacheing strategy was used.
+     * waveform.
      *
      * The default is not to use aggressive cacheing.
      */
@@ -204,6 +214,18 @@ public:
 
     virtual bool canExistWithoutModel() const { return true; }
 
+    /**
+     * CacheGovernor::Client methods, for the per-view image caches.
+     */
+    virtual size_t getCacheBytes() const override;
+    virtual double getCacheRebuildCost() const override;
+    virtual bool isCacheDormant() const override;
+    virtual void releaseCache() override;
+
+protected slots:
+    void cacheInvalid();
+    void cacheInvalid(sv_frame_t startFrame, sv_frame_t endFrame);
+
 protected:
     int dBscale(double sample, int m) const;
 
@@ -221,8 +243,9 @@ protected:
                              sv_frame_t &f0, sv_frame_t &f1) const;
 
     float getNormalizeGain(LayerGeometryProvider *v, int channel) const;
+    SummaryPeakTable &getPeakTable(int channel) const;
 
-    virtual void flagBaseColourChanged() { m_cacheValid = false; }
+    virtual void flagBaseColourChanged() { invalidateCaches(); }
 
     float        m_gain;
     bool         m_autoNormalize;
@@ -236,9 +259,61 @@ protected:
 
     mutable std::vector<float> m_effectiveGains;
 
-    mutable QPixmap *m_cache;
-    mutable bool m_cacheValid;
-    mutable int m_cacheZoomLevel;
+    // Summaries fetched for the range caches, kept from one fill to
+    // the next so as to reuse their storage
+    struct SummaryBuffers {
+        std::vector<RangeSummarisableTimeValueModel::RangeBlock> channels;
+        RangeSummarisableTimeValueModel::RangeBlock combined;
+        std::vector<float> upper;
+        std::vector<float> lower;
+        std::vector<float> mean;
+    };
+    mutable SummaryBuffers m_summaryBuffers;
+
+    // Fetch the summaries of channels ch0 to ch1 inclusive into the
+    // first ch1 - ch0 + 1 channel blocks of buffers
+    void fetchSummaries(int ch0, int ch1, sv_frame_t frame0,
+                        sv_frame_t count, int blockSize,
+                        SummaryBuffers &buffers) const;
+    
+    static void combineSummaries(SummaryBuffers &buffers, int channels,
+                                 bool merging);
+
+    // Peak tables for auto-normalisation, by model channel
+    typedef std::map<int, SummaryPeakTable> PeakTableMap;
+    mutable PeakTableMap m_peakTables;
+
+    // An image cache for each view, with the view-dependent state
+    // it was painted with and the summary ranges it was painted
+    // from. Columns beyond the model end frame were painted blank,
+    // so that if the model grows only the columns from there on need
+    // painting again.
+    struct ViewCache {
+        ViewCache() :
+            endFrame(-1), completion(0),
+            lightBackground(false), scaleGuides(false) { }
+        ScrollableImageCache cache;
+        ScrollableRangeCache ranges;
+        sv_frame_t endFrame;
+        int completion;
+        bool lightBackground;
+        bool scaleGuides;
+        std::vector<float> gains;
+    };
+    typedef std::map<int, ViewCache> ViewCacheMap; // key is view id
+    mutable ViewCacheMap m_viewCaches;
+    mutable QElapsedTimer m_lastPainted; // for isCacheDormant
+
+    void invalidateCaches();
+    void invalidateRangeCaches();
+    sv_frame_t getCacheEndFrame(const ScrollableImageCache &cache) const;
+    void paintToCache(LayerGeometryProvider *v, ViewCache &vc,
+                      int left, int width, bool ready) const;
+    void fillRangeCache(LayerGeometryProvider *v, ScrollableRangeCache &cache,
+                        int x0, int x1) const;
+    void drawWaveform(LayerGeometryProvider *v,
+                      const ScrollableRangeCache &ranges, QImage &image,
+                      int x0, int x1, bool ready) const;
 };
 
 #endif
@@ -0,0 +1,206 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#include "ZoomTileCache.h"
+
+#include "base/HitCount.h"
+
+#include <iostream>
+#include <stdexcept>
+#include <cmath>
+
+using namespace std;
+
+//#define DEBUG_ZOOM_TILE_CACHE 1
+
+ZoomTileCache::ZoomTileCache(int tileWidth, size_t maxBytes) :
+    m_tileWidth(tileWidth),
+    m_height(0),
+    m_maxBytes(maxBytes),
+    m_bytes(0),
+    m_useCounter(0)
+{
+    if (m_tileWidth < 1) {
+        throw std::logic_error("Tile width must be positive in ZoomTileCache");
+    }
+}
+
+void
+ZoomTileCache::setHeight(int height)
+{
+    if (m_height != height) {
+        m_height = height;
+        clear();
+    }
+}
+
+void
+ZoomTileCache::setMaxBytes(size_t maxBytes)
+{
+    m_maxBytes = maxBytes;
+    while (m_tiles.size() > 1 && m_bytes > m_maxBytes) {
+        discardLeastRecentlyUsed();
+    }
+}
+
+void
+ZoomTileCache::clear()
+{
+    m_tiles.clear();
+    m_bytes = 0;
+}
+
+void
+ZoomTileCache::invalidate(sv_frame_t startFrame, sv_frame_t endFrame)
+{
+    if (endFrame <= startFrame) return;
+
+    auto itr = m_tiles.begin();
+    while (itr != m_tiles.end()) {
+        sv_frame_t zoom = itr->first.first;
+        sv_frame_t tileStart = sv_frame_t(itr->first.second) * m_tileWidth * zoom;
+        sv_frame_t tileEnd = tileStart + m_tileWidth * zoom;
+        if (tileStart < endFrame && tileEnd > startFrame) {
+#ifdef DEBUG_ZOOM_TILE_CACHE
+            cerr << "ZoomTileCache::invalidate: discarding tile at zoom level "
+                 << itr->first.first << ", index " << itr->first.second
+                 << endl;
+#endif
+            m_bytes -= getTileBytes(itr->second.tile);
+            itr = m_tiles.erase(itr);
+        } else {
+            ++itr;
+        }
+    }
+}
+
+int
+ZoomTileCache::getTileIndexForPixel(sv_frame_t pixel) const
+{
+    // round toward minus infinity, so that tiles to the left of frame
+    // 0 are the same width as the rest
+    sv_frame_t index = pixel / m_tileWidth;
+    if (pixel < 0 && index * m_tileWidth != pixel) {
+        --index;
+    }
+    return int(index);
+}
+
+bool
+ZoomTileCache::haveTile(int zoomLevel, int tileIndex) const
+{
+    return m_tiles.find(Key(zoomLevel, tileIndex)) != m_tiles.end();
+}
+
+const ZoomTileCache::Tile *
+ZoomTileCache::getTile(int zoomLevel, int tileIndex)
+{
+    static HitCount count("ZoomTileCache: tiles");
+
+    auto itr = m_tiles.find(Key(zoomLevel, tileIndex));
+    if (itr == m_tiles.end()) {
+        count.miss();
+        return 0;
+    }
+
+    count.hit();
+    itr->second.lastUsed = ++m_useCounter;
+    return &itr->second.tile;
+}
+
+void
+ZoomTileCache::storeTile(int zoomLevel, int tileIndex, const Tile &tile)
+{
+    if (tile.image.width() != m_tileWidth ||
+        tile.image.height() != m_height ||
+        int(tile.ranges.size()) != m_tileWidth) {
+        cerr << "ZoomTileCache::storeTile: ERROR: Tile of size "
+             << tile.image.width() << "x" << tile.image.height()
+             << " with " << tile.ranges.size() << " ranges does not match "
+             << "cache tile size " << m_tileWidth << "x" << m_height << endl;
+        throw std::logic_error("Tile size must match cache in ZoomTileCache::storeTile");
+    }
+
+#ifdef DEBUG_ZOOM_TILE_CACHE
+    cerr << "ZoomTileCache::storeTile: zoom level " << zoomLevel
+         << ", tile index " << tileIndex << endl;
+#endif
+
+    Key key(zoomLevel, tileIndex);
+    auto itr = m_tiles.find(key);
+    if (itr != m_tiles.end()) {
+        m_bytes -= getTileBytes(itr->second.tile);
+    }
+    
+    Entry entry;
+    entry.tile = tile;
+    entry.lastUsed = ++m_useCounter;
+    m_tiles[key] = entry;
+    m_bytes += getTileBytes(tile);
+
+    while (m_tiles.size() > 1 && m_bytes > m_maxBytes) {
+        discardLeastRecentlyUsed();
+    }
+}
+
+int
+ZoomTileCache::getNearestOtherZoomLevel(int zoomLevel) const
+{
+    int nearest = 0;
+    double nearestDistance = 0.0;
+
+    for (const auto &t: m_tiles) {
+        int z = t.first.first;
+        if (z == zoomLevel || z == nearest) {
+            continue;
+        }
+        double distance = fabs(log(double(z) / double(zoomLevel)));
+        if (nearest == 0 || distance < nearestDistance) {
+            nearest = z;
+            nearestDistance = distance;
+        }
+    }
+
+    return nearest;
+}
+
+size_t
+ZoomTileCache::getTileBytes(const Tile &tile)
+{
+    return size_t(tile.image.bytesPerLine()) * size_t(tile.image.height()) +
+        tile.ranges.size() * sizeof(MagnitudeRange);
+}
+
+void
+ZoomTileCache::discardLeastRecentlyUsed()
+{
+    auto oldest = m_tiles.end();
+
+    for (auto itr = m_tiles.begin(); itr != m_tiles.end(); ++itr) {
+        if (oldest == m_tiles.end() ||
+            itr->second.lastUsed < oldest->second.lastUsed) {
+            oldest = itr;
+        }
+    }
+
+    if (oldest != m_tiles.end()) {
+#ifdef DEBUG_ZOOM_TILE_CACHE
+        cerr << "ZoomTileCache: discarding tile at zoom level "
+             << oldest->first.first << ", index " << oldest->first.second
+             << endl;
+#endif
+        m_bytes -= getTileBytes(oldest->second.tile);
+        m_tiles.erase(oldest);
+    }
+}
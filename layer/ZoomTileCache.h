@@ -0,0 +1,150 @@
+/* -*- c-basic-offset: 4 indent-tabs-mode: nil -*-  vi:set ts=8 sts=4 sw=4: */
+
+/*
+    Sonic Visualiser
+    An audio file viewer and annotation editor.
+    Centre for Digital Music, Queen Mary, University of London.
+
+    This program is free software; you can redistribute it and/or
+    modify it under the terms of the GNU General Public License as
+    published by the Free Software Foundation; either version 2 of the
+    License, or (at your option) any later version.  See the file
+    COPYING included with this distribution for more information.
+*/
+
+#ifndef ZOOM_TILE_CACHE_H
+#define ZOOM_TILE_CACHE_H
+
+#include "base/BaseTypes.h"
+#include "base/MagnitudeRange.h"
+
+#include <QImage>
+
+#include <map>
+#include <vector>
+
+/**
+ * A cache of rendered image tiles, together with the magnitude
+ * ranges of their columns, for a view that zooms and scrolls
+ * horizontally, such as a spectrogram. It is intended to sit behind a
+ * ScrollableImageCache, which is invalidated whenever the zoom level
+ * changes, so that returning to a recently visited zoom level needs
+ * no further rendering.
+ *
+ * Tiles have a fixed width and are keyed by zoom level and tile
+ * index. The tile index counts tile widths of pixels from frame 0 at
+ * the given zoom level: because a view's start frame is always a
+ * multiple of its zoom level, tiles line up exactly with the pixels
+ * of any view at that level.
+ *
+ * The cache holds tiles of a single height only, and is bounded in
+ * size, discarding the least recently used tiles first. The bound is
+ * on the memory actually used, so that more indexed (8-bit) tiles
+ * than ARGB tiles fit within it.
+ */
+class ZoomTileCache
+{
+public:
+    struct Tile {
+        QImage image;
+        std::vector<MagnitudeRange> ranges; // one per column of image
+    };
+
+    ZoomTileCache(int tileWidth, size_t maxBytes);
+
+    int getTileWidth() const {
+        return m_tileWidth;
+    }
+
+    int getHeight() const {
+        return m_height;
+    }
+
+    /**
+     * Set the height of the tiles. If the new height differs from the
+     * current one, the cache is cleared.
+     */
+    void setHeight(int height);
+
+    /**
+     * Set the memory the tiles may use in total, discarding the least
+     * recently used tiles if they now use more.
+     */
+    void setMaxBytes(size_t maxBytes);
+
+    size_t getMaxBytes() const {
+        return m_maxBytes;
+    }
+
+    void clear();
+
+    /**
+     * Discard all tiles, at any zoom level, that show any of the
+     * frames from startFrame up to but not including endFrame.
+     */
+    void invalidate(sv_frame_t startFrame, sv_frame_t endFrame);
+
+    bool isEmpty() const {
+        return m_tiles.empty();
+    }
+
+    int getTileCount() const {
+        return int(m_tiles.size());
+    }
+
+    /**
+     * Return the memory used by the tiles in the cache.
+     */
+    size_t getBytes() const {
+        return m_bytes;
+    }
+
+    /**
+     * Return the index of the tile containing the given pixel, where
+     * the pixel is counted from frame 0 at the zoom level in question.
+     */
+    int getTileIndexForPixel(sv_frame_t pixel) const;
+
+    bool haveTile(int zoomLevel, int tileIndex) const;
+
+    /**
+     * Return the tile with the given zoom level and index, marking it
+     * as recently used, or null if there is no such tile. The
+     * returned pointer is valid until the next non-const call.
+     */
+    const Tile *getTile(int zoomLevel, int tileIndex);
+
+    /**
+     * Store a tile, discarding the least recently used tiles if the
+     * cache is then too large. The image must have the tile width and
+     * the cache height, and there must be one range per column.
+     */
+    void storeTile(int zoomLevel, int tileIndex, const Tile &tile);
+
+    /**
+     * Return the zoom level, other than the given one, for which we
+     * have tiles and which is closest to the given one in ratio, or 0
+     * if there is none.
+     */
+    int getNearestOtherZoomLevel(int zoomLevel) const;
+
+private:
+    typedef std::pair<int, int> Key; // zoom level, tile index
+
+    struct Entry {
+        Tile tile;
+        unsigned long lastUsed;
+    };
+
+    int m_tileWidth;
+    int m_height;
+    size_t m_maxBytes;
+    size_t m_bytes;
+    std::map<Key, Entry> m_tiles;
+    unsigned long m_useCounter;
+
+    static size_t getTileBytes(const Tile &tile);
+    void discardLeastRecentlyUsed();
+};
+
+#endif
@@ -72,18 +72,61 @@ View::View(QWidget *w, bool showProgress) :
     m_propertyContainer(new ViewPropertyContainer(this))
 {
 //    cerr << "View::View(" << this << ")" << endl;
+
+    CacheGovernor::getInstance()->registerClient(this);
 }
 
 View::~View()
 {
 //    cerr << "View::~View(" << this << ")" << endl;
 
+    CacheGovernor::getInstance()->unregisterClient(this);
+
     m_deleting = true;
     delete m_propertyContainer;
     delete m_cache;
     delete m_buffer;
 }
 
+size_t
+View::getCacheBytes() const
+{
+    size_t bytes = 0;
+    if (m_cache) {
+        bytes += size_t(m_cache->width()) * m_cache->height() *
+            m_cache->depth() / 8;
+    }
+    if (m_buffer) {
+        bytes += size_t(m_buffer->width()) * m_buffer->height() *
+            m_buffer->depth() / 8;
+    }
+    return bytes;
+}
+
+double
+View::getCacheRebuildCost() const
+{
+    // Repainting the view is a matter of asking the layers to paint
+    // again, which is cheap for layers that keep caches of their own
+    // and is accounted for by those caches if not
+    return 0.01;
+}
+
+bool
+View::isCacheDormant() const
+{
+    return !isVisible();
+}
+
+void
+View::releaseCache()
+{
+    delete m_cache;
+    m_cache = 0;
+    delete m_buffer;
+    m_buffer = 0;
+}
+
 PropertyContainer::PropertyList
 View::getProperties() const
 {
@@ -1664,6 +1707,8 @@ View::paintEvent(QPaintEvent *e)
         return;
     }
 
+    CacheGovernor::getInstance()->touch(this);
+
     // ensure our constraints are met
 
 /*!!! Should we do this only if we have layers that can't support other
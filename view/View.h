@@ -20,6 +20,7 @@
 #include <QProgressBar>
 
 #include "layer/LayerGeometryProvider.h"
+#include "layer/CacheGovernor.h"
 
 #include "base/ZoomConstraint.h"
 #include "base/PropertyContainer.h"
@@ -52,7 +53,8 @@ class QPushButton;
 
 class View : public QFrame,
              public XmlExportable,
-             public LayerGeometryProvider
+             public LayerGeometryProvider,
+             public CacheGovernor::Client
 {
     Q_OBJECT
 
@@ -384,6 +386,15 @@ public:
     
     View *getView() { return this; } 
     const View *getView() const { return this; } 
+
+    /**
+     * CacheGovernor::Client methods, for the view's pixmap cache and
+     * paint buffer. A hidden view counts as dormant.
+     */
+    virtual size_t getCacheBytes() const override;
+    virtual double getCacheRebuildCost() const override;
+    virtual bool isCacheDormant() const override;
+    virtual void releaseCache() override;
     
 signals:
     void propertyContainerAdded(PropertyContainer *pc);